@@ -1,7 +1,8 @@
 /* Hack Computer Assembler/Disassembler
  *
  * Assembler reads a .asm file and generates a .hack file in ASCII with one
- * instruction per line.
+ * instruction per line, plus a .sym file listing the ROM address of every
+ * label.
  * Disassembler reads an ASCII .hack file and generates a .asm file with one
  * instruction per line.
  * 
@@ -658,6 +659,29 @@ bool gen_hack(char *filename, Program *program)
     return true;
 }
 
+/* Generates a symbol map listing every label found on the first pass as its
+ROM address and name, one per line in order of address, so tools such as the
+emulator's profiler can refer back to the assembly. */
+bool gen_symbols(char *filename, SymbolTable *symtbl, int first_label)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to generate %s\n", filename);
+        return false;
+    }
+
+    // Labels are added in order of address, after the predefined symbols.
+    for (int i = first_label; i < symtbl->count; i++)
+    {
+        fprintf(fp, "%s %s\n", symtbl->symbols[i].value,
+        symtbl->symbols[i].name);
+    }
+
+    fclose(fp);
+    return true;
+}
+
 // Converts binary string to decimal integer.
 int bin_to_dec(char *bin)
 {
@@ -962,11 +986,18 @@ int main(int argc, char **argv)
     symboltable_init(&symtbl);
 
     // Perform first pass
+    const int first_label = symtbl.count;
     if (!first_pass(argv[1], &program, &symtbl))
     {
         clean_exit(&program, 1);
     }
 
+    // Write labels to .sym file before variables join them in the table
+    if (!gen_symbols("out.sym", &symtbl, first_label))
+    {
+        clean_exit(&program, 1);
+    }
+
     // Perform second pass
     second_pass(&program, &symtbl);
 
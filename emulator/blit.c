@@ -0,0 +1,171 @@
+#include <stddef.h>
+#include "blit.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled in for its own functions and picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLIT_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define BLIT_HAVE_AVX2 0
+#endif
+
+#define BLIT_WORD_BITS 16
+
+typedef void (*BlitFn)(uint32_t *dst, const int16_t *src, int count,
+                       BlitColors colors);
+
+/* Each pixel is off ^ (mask & (on ^ off)) where mask is all ones for a set
+ * bit, which selects a color without branching.
+ */
+static void blit_scalar(uint32_t *dst, const int16_t *src, int count,
+                        BlitColors colors)
+{
+    const uint32_t diff = colors.on ^ colors.off;
+
+    for (int i = 0; i < count; i++)
+    {
+        const uint16_t word = src[i];
+        for (int j = 0; j < BLIT_WORD_BITS; j++)
+        {
+            const uint32_t mask = -(uint32_t)((word >> j) & 1);
+            dst[j] = colors.off ^ (mask & diff);
+        }
+        dst += BLIT_WORD_BITS;
+    }
+}
+
+#ifdef __SSE2__
+
+/* The word is broadcast to every lane and each lane tests its own bit, so four
+ * registers of four pixels make up a word.
+ */
+static void blit_sse2(uint32_t *dst, const int16_t *src, int count,
+                      BlitColors colors)
+{
+    const __m128i bits[4] = {
+        _mm_setr_epi32(0x0001, 0x0002, 0x0004, 0x0008),
+        _mm_setr_epi32(0x0010, 0x0020, 0x0040, 0x0080),
+        _mm_setr_epi32(0x0100, 0x0200, 0x0400, 0x0800),
+        _mm_setr_epi32(0x1000, 0x2000, 0x4000, 0x8000)};
+    const __m128i off = _mm_set1_epi32(colors.off);
+    const __m128i diff = _mm_set1_epi32(colors.on ^ colors.off);
+
+    for (int i = 0; i < count; i++)
+    {
+        const __m128i word = _mm_set1_epi32((uint16_t)src[i]);
+        for (int j = 0; j < 4; j++)
+        {
+            const __m128i set =
+                _mm_cmpeq_epi32(_mm_and_si128(word, bits[j]), bits[j]);
+            const __m128i pixels =
+                _mm_xor_si128(off, _mm_and_si128(set, diff));
+            _mm_storeu_si128((__m128i *)(dst + 4 * j), pixels);
+        }
+        dst += BLIT_WORD_BITS;
+    }
+}
+
+#endif
+
+#if BLIT_HAVE_AVX2
+
+// Same as blit_sse2 with eight pixels per register
+__attribute__((target("avx2"))) static void
+blit_avx2(uint32_t *dst, const int16_t *src, int count, BlitColors colors)
+{
+    const __m256i low = _mm256_setr_epi32(0x0001, 0x0002, 0x0004, 0x0008,
+                                          0x0010, 0x0020, 0x0040, 0x0080);
+    const __m256i high = _mm256_slli_epi32(low, 8);
+    const __m256i off = _mm256_set1_epi32(colors.off);
+    const __m256i diff = _mm256_set1_epi32(colors.on ^ colors.off);
+
+    for (int i = 0; i < count; i++)
+    {
+        const __m256i word = _mm256_set1_epi32((uint16_t)src[i]);
+        const __m256i set_low =
+            _mm256_cmpeq_epi32(_mm256_and_si256(word, low), low);
+        const __m256i set_high =
+            _mm256_cmpeq_epi32(_mm256_and_si256(word, high), high);
+
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_xor_si256(off,
+                                             _mm256_and_si256(set_low, diff)));
+        _mm256_storeu_si256((__m256i *)(dst + 8),
+                            _mm256_xor_si256(off,
+                                             _mm256_and_si256(set_high, diff)));
+        dst += BLIT_WORD_BITS;
+    }
+}
+
+#endif
+
+// Implementation of each kernel, NULL if not compiled in
+static const BlitFn kernels[BLIT_NUM_KERNELS] = {
+    [BLIT_SCALAR] = blit_scalar,
+#ifdef __SSE2__
+    [BLIT_SSE2] = blit_sse2,
+#endif
+#if BLIT_HAVE_AVX2
+    [BLIT_AVX2] = blit_avx2,
+#endif
+};
+
+static const char *const kernel_names[BLIT_NUM_KERNELS] = {
+    [BLIT_SCALAR] = "scalar",
+    [BLIT_SSE2] = "sse2",
+    [BLIT_AVX2] = "avx2",
+};
+
+static BlitFn current_kernel = NULL;
+
+bool blit_kernel_supported(BLIT_KERNELS kernel)
+{
+    if (kernel >= BLIT_NUM_KERNELS || kernels[kernel] == NULL)
+    {
+        return false;
+    }
+
+#if BLIT_HAVE_AVX2
+    if (kernel == BLIT_AVX2)
+    {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+
+    return true;
+}
+
+const char *blit_kernel_name(BLIT_KERNELS kernel)
+{
+    return kernel < BLIT_NUM_KERNELS ? kernel_names[kernel] : "unknown";
+}
+
+bool blit_use_kernel(BLIT_KERNELS kernel)
+{
+    if (!blit_kernel_supported(kernel))
+    {
+        return false;
+    }
+
+    current_kernel = kernels[kernel];
+    return true;
+}
+
+void blit_words(uint32_t *dst, const int16_t *src, int count,
+                BlitColors colors)
+{
+    if (current_kernel == NULL)
+    {
+        int kernel = BLIT_NUM_KERNELS - 1;
+        while (!blit_use_kernel(kernel))
+        {
+            kernel--;
+        }
+    }
+
+    current_kernel(dst, src, count, colors);
+}
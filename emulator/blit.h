@@ -0,0 +1,46 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Expansion of the 1-bit Hack framebuffer into 32-bit pixels, shared by the
+ * emulators' displays.
+ *
+ * Each 16-bit screen word becomes 16 pixels, its least significant bit being
+ * the leftmost pixel. The expansion is done with SIMD compare masks where the
+ * host supports them and with a branch-free scalar loop otherwise.
+ */
+
+// Colors of set and cleared bits
+typedef struct BlitColors
+{
+    uint32_t on, off;
+} BlitColors;
+
+// Implementations of the expansion, from slowest to fastest
+typedef enum
+{
+    BLIT_SCALAR,
+    BLIT_SSE2,
+    BLIT_AVX2,
+    BLIT_NUM_KERNELS
+} BLIT_KERNELS;
+
+// Checks if a kernel can run on this host
+bool blit_kernel_supported(BLIT_KERNELS kernel);
+
+// Gets the name of a kernel
+const char *blit_kernel_name(BLIT_KERNELS kernel);
+
+/* Choose the kernel used by blit_words
+ * The fastest supported kernel is used until this is called.
+ * Returns false if the kernel cannot run on this host.
+ */
+bool blit_use_kernel(BLIT_KERNELS kernel);
+
+// Expand 'count' screen words from 'src' into 16 * count pixels at 'dst'
+void blit_words(uint32_t *dst, const int16_t *src, int count,
+                BlitColors colors);
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulib.h"
+#include "blit.h"
+
+// Frames converted by each kernel
+#define FRAMES 2000
+
+#define SCREEN_WORDS (KEYBD_ADDR - SCREEN_ADDR)
+
+// Gets the current time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Times a full 512x256 screen conversion with every kernel the host supports
+ * and checks that they all produce the same pixels as the scalar one.
+ */
+int main(void)
+{
+    static int16_t screen[SCREEN_WORDS];
+    static uint32_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    static uint32_t expected[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    const BlitColors colors = {0xFFFFFF, 0x000000};
+
+    srand(1);
+    for (int i = 0; i < SCREEN_WORDS; i++)
+    {
+        screen[i] = rand();
+    }
+
+    blit_use_kernel(BLIT_SCALAR);
+    blit_words(expected, screen, SCREEN_WORDS, colors);
+
+    for (int kernel = 0; kernel < BLIT_NUM_KERNELS; kernel++)
+    {
+        if (!blit_use_kernel(kernel))
+        {
+            printf("%-8s unsupported\n", blit_kernel_name(kernel));
+            continue;
+        }
+
+        memset(pixels, 0, sizeof(pixels));
+        blit_words(pixels, screen, SCREEN_WORDS, colors);
+        if (memcmp(pixels, expected, sizeof(pixels)) != 0)
+        {
+            printf("%-8s MISMATCH\n", blit_kernel_name(kernel));
+            return 1;
+        }
+
+        const double start = now();
+        for (int i = 0; i < FRAMES; i++)
+        {
+            // One row at a time like the displays do
+            for (int y = 0; y < DISPLAY_HEIGHT; y++)
+            {
+                blit_words(&pixels[y * DISPLAY_WIDTH],
+                           &screen[y * (DISPLAY_WIDTH / WORD_SIZE)],
+                           DISPLAY_WIDTH / WORD_SIZE, colors);
+            }
+        }
+        const double elapsed = now() - start;
+
+        printf("%-8s %10.0f frames/s\n", blit_kernel_name(kernel),
+               FRAMES / elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include "bus.h"
+
+_Static_assert((HACK_QUEUE_SIZE & (HACK_QUEUE_SIZE - 1)) == 0,
+               "HACK_QUEUE_SIZE must be a power of two");
+
+// Largest value the timer counts to before wrapping to 0
+#define HACK_TIMER_MAX 0x7FFF
+
+void hack_bus_init(HackBus *this, Hack *machine)
+{
+    this->machine = machine;
+    this->num_devices = 0;
+    this->cycles = 0;
+    this->lost = 0;
+}
+
+bool hack_bus_attach(HackBus *this, HackDevice *device)
+{
+    if (this->num_devices == HACK_BUS_MAX_DEVICES)
+    {
+        fprintf(stderr, "A bus can only hold %d devices.\n",
+                HACK_BUS_MAX_DEVICES);
+        return false;
+    }
+
+    if (device->start > device->end || device->end >= MEM_SIZE)
+    {
+        fprintf(stderr, "Invalid device addresses %d to %d.\n", device->start,
+                device->end);
+        return false;
+    }
+
+    for (int i = 0; i < this->num_devices; i++)
+    {
+        const HackDevice *other = this->devices[i];
+        if (device->start <= other->end && other->start <= device->end)
+        {
+            fprintf(stderr, "Device at %d overlaps the device at %d.\n",
+                    device->start, other->start);
+            return false;
+        }
+    }
+
+    this->devices[this->num_devices++] = device;
+    for (int row = device->start / HACK_ROW_WORDS;
+         row <= device->end / HACK_ROW_WORDS; row++)
+    {
+        this->machine->io_rows[row] = 1;
+    }
+
+    return true;
+}
+
+// Finds the device an address belongs to, if any
+static HackDevice *hack_bus_find(const HackBus *this, uint16_t addr)
+{
+    for (int i = 0; i < this->num_devices; i++)
+    {
+        HackDevice *device = this->devices[i];
+        if (addr >= device->start && addr <= device->end)
+        {
+            return device;
+        }
+    }
+
+    return NULL;
+}
+
+void hack_bus_update(HackBus *this, long cycles)
+{
+    Hack *machine = this->machine;
+    const uint32_t count = machine->io_count;
+
+    // Only the newest stores are left if the slice was too long
+    uint32_t first = 0;
+    if (count > HACK_IO_LOG_SIZE)
+    {
+        first = count - HACK_IO_LOG_SIZE;
+        this->lost += first;
+    }
+
+    /* Rows are shared with plain RAM and other devices, so a store logged
+     * does not necessarily belong to any device
+     */
+    for (uint32_t i = first; i < count; i++)
+    {
+        const uint32_t entry = machine->io_log[i % HACK_IO_LOG_SIZE];
+        const uint16_t addr = entry >> 16;
+
+        HackDevice *device = hack_bus_find(this, addr);
+        if (device != NULL && device->write != NULL)
+        {
+            device->write(device, machine, addr, (int16_t)(entry & 0xFFFF));
+        }
+    }
+    machine->io_count = 0;
+    this->cycles += cycles;
+
+    for (int i = 0; i < this->num_devices; i++)
+    {
+        HackDevice *device = this->devices[i];
+        if (device->tick != NULL)
+        {
+            device->tick(device, machine, cycles);
+        }
+    }
+}
+
+HACK_IDLE hack_bus_idle(const HackBus *this)
+{
+    HackIdleLoop loop;
+    if (!hack_find_idle_loop(this->machine, &loop))
+    {
+        return HACK_IDLE_BUSY;
+    }
+
+    HACK_IDLE idle = HACK_IDLE_HALTED;
+    for (int i = 0; i < loop.num_reads; i++)
+    {
+        const HackDevice *device = hack_bus_find(this, loop.reads[i]);
+        if (device == NULL || device->changes == HACK_CHANGES_NEVER)
+        {
+            continue;
+        }
+
+        // A loop waiting for time to pass is not idle
+        if (device->changes == HACK_CHANGES_OVER_TIME)
+        {
+            return HACK_IDLE_BUSY;
+        }
+        idle = HACK_IDLE_INPUT;
+    }
+
+    return idle;
+}
+
+long hack_bus_slice(const HackBus *this, long cycles)
+{
+    const long left = HACK_BUS_MAX_SLICE - this->cycles % HACK_BUS_MAX_SLICE;
+    return cycles < left ? cycles : left;
+}
+
+void hack_queue_init(HackQueue *this)
+{
+    atomic_init(&this->head, 0);
+    atomic_init(&this->tail, 0);
+}
+
+bool hack_queue_push(HackQueue *this, uint8_t byte)
+{
+    const size_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&this->head, memory_order_acquire);
+    if (tail - head == HACK_QUEUE_SIZE)
+    {
+        return false;
+    }
+
+    // The byte must be in place before the consumer can see the new tail
+    this->data[tail % HACK_QUEUE_SIZE] = byte;
+    atomic_store_explicit(&this->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool hack_queue_pop(HackQueue *this, uint8_t *byte)
+{
+    const size_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+    if (head == tail)
+    {
+        return false;
+    }
+
+    // The byte must be read before the producer can reuse its slot
+    *byte = this->data[head % HACK_QUEUE_SIZE];
+    atomic_store_explicit(&this->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Latches the key pressed into the keyboard register
+static void keyboard_tick(HackDevice *device, Hack *machine, long cycles)
+{
+    (void)cycles;
+    HackKeyboard *this = (HackKeyboard *)device;
+    machine->ram[KEYBD_ADDR] = atomic_load_explicit(&this->key,
+                                                    memory_order_relaxed);
+}
+
+void hack_keyboard_init(HackKeyboard *this)
+{
+    this->device = (HackDevice){KEYBD_ADDR, KEYBD_ADDR, HACK_CHANGES_ON_INPUT,
+                                NULL, keyboard_tick};
+    atomic_init(&this->key, 0);
+}
+
+void hack_keyboard_press(HackKeyboard *this, int key)
+{
+    atomic_store_explicit(&this->key, key, memory_order_relaxed);
+}
+
+int hack_keyboard_key(HackKeyboard *this)
+{
+    return atomic_load_explicit(&this->key, memory_order_relaxed);
+}
+
+// A value stored to the timer restarts it from there
+static void timer_write(HackDevice *device, Hack *machine, uint16_t addr,
+                        int16_t value)
+{
+    (void)machine;
+    (void)addr;
+    (void)value;
+    HackTimer *this = (HackTimer *)device;
+    this->elapsed = 0;
+}
+
+// Counts the ticks that went by during the slice
+static void timer_tick(HackDevice *device, Hack *machine, long cycles)
+{
+    HackTimer *this = (HackTimer *)device;
+    this->elapsed += cycles;
+
+    const long ticks = this->elapsed / this->period;
+    this->elapsed %= this->period;
+    machine->ram[HACK_TIMER_ADDR] =
+        (machine->ram[HACK_TIMER_ADDR] + ticks) & HACK_TIMER_MAX;
+}
+
+void hack_timer_init(HackTimer *this, long period)
+{
+    this->device =
+        (HackDevice){HACK_TIMER_ADDR, HACK_TIMER_ADDR, HACK_CHANGES_OVER_TIME,
+                     timer_write, timer_tick};
+    this->period = period > 0 ? period : 1;
+    this->elapsed = 0;
+}
+
+// Sends the character stored on to whoever reads the queue
+static void serial_write(HackDevice *device, Hack *machine, uint16_t addr,
+                         int16_t value)
+{
+    (void)machine;
+    (void)addr;
+    HackSerial *this = (HackSerial *)device;
+    if (!hack_queue_push(&this->output, (uint8_t)value))
+    {
+        this->dropped++;
+    }
+}
+
+long hack_timer_period(long hz)
+{
+    return hz > 0 ? hz / 1000 : HACK_TIMER_PERIOD;
+}
+
+void hack_serial_init(HackSerial *this)
+{
+    this->device = (HackDevice){HACK_SERIAL_ADDR, HACK_SERIAL_ADDR,
+                                HACK_CHANGES_NEVER, serial_write, NULL};
+    hack_queue_init(&this->output);
+    this->dropped = 0;
+}
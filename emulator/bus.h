@@ -0,0 +1,174 @@
+#ifndef BUS_H
+#define BUS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "emulib.h"
+
+/* Devices mapped into the machine's RAM.
+ *
+ * The CPU talks to devices with ordinary loads and stores. Every engine logs
+ * the stores made to rows of RAM a device is mapped into (see Hack.io_rows)
+ * and hack_bus_update hands them to their devices in order, so ordinary
+ * stores pay no more than a test of their row's flag that always goes the
+ * same way. Devices show values to the CPU by writing them into RAM, so loads
+ * cost nothing at all.
+ *
+ * Devices only run between slices of instructions, which must be no longer
+ * than HACK_BUS_MAX_SLICE for the log to hold every store of a slice. Sizing
+ * them with hack_bus_slice keeps updates on the same instructions from one run
+ * to the next, as long as the runner cuts its own slices the same way, which
+ * is what lets a recorded session be replayed exactly.
+ */
+
+// Timer and serial console, in addresses the Hack platform leaves unused
+#define HACK_TIMER_ADDR (KEYBD_ADDR + 1)
+#define HACK_SERIAL_ADDR (KEYBD_ADDR + 2)
+
+// Instructions per timer tick: a millisecond at the default rate of hackemu
+#define HACK_TIMER_PERIOD 10000
+
+// Longest slice of instructions to run between calls to hack_bus_update
+#define HACK_BUS_MAX_SLICE HACK_IO_LOG_SIZE
+
+#define HACK_BUS_MAX_DEVICES 8
+
+// Bytes a queue holds, a power of two
+#define HACK_QUEUE_SIZE 4096
+
+// How the RAM a device is mapped into changes other than by CPU stores
+typedef enum
+{
+    HACK_CHANGES_NEVER,
+    HACK_CHANGES_ON_INPUT, // When the user does something
+    HACK_CHANGES_OVER_TIME // As instructions execute
+} HACK_CHANGES;
+
+// What a machine is doing, as far as hack_bus_idle can tell
+typedef enum
+{
+    HACK_IDLE_BUSY,  // Not in a loop that changes nothing, or waiting on time
+    HACK_IDLE_INPUT, // Polling the keyboard or another input device
+    HACK_IDLE_HALTED // In a loop that nothing will ever get it out of
+} HACK_IDLE;
+
+/* A device, usually the first member of a struct holding its state
+ * Either callback may be NULL.
+ */
+typedef struct HackDevice HackDevice;
+struct HackDevice
+{
+    uint16_t start, end; // Addresses mapped, inclusive
+    uint8_t changes;     // One of HACK_CHANGES
+
+    // Called for each store the CPU made to the device's addresses, in order
+    void (*write)(HackDevice *this, Hack *machine, uint16_t addr,
+                  int16_t value);
+
+    // Called after each slice with the number of instructions it ran
+    void (*tick)(HackDevice *this, Hack *machine, long cycles);
+};
+
+typedef struct HackBus
+{
+    Hack *machine;
+    HackDevice *devices[HACK_BUS_MAX_DEVICES];
+    int num_devices;
+    long cycles; // Instructions run since the bus started
+    long lost; // Stores dropped by slices longer than HACK_BUS_MAX_SLICE
+} HackBus;
+
+/* A lock-free queue of bytes passed from one producer thread to one consumer
+ * thread, such as the CPU thread writing to a device and the thread showing
+ * what it wrote.
+ */
+typedef struct HackQueue
+{
+    uint8_t data[HACK_QUEUE_SIZE];
+    atomic_size_t head; // Next byte to pop, only moved by the consumer
+    atomic_size_t tail; // Next byte to push, only moved by the producer
+} HackQueue;
+
+// Keyboard, whose register holds the key currently pressed
+typedef struct HackKeyboard
+{
+    HackDevice device;
+    atomic_int key;
+} HackKeyboard;
+
+/* Timer, whose register counts up by one every 'period' instructions,
+ * wrapping to 0 after 32767, and which restarts from any value stored to it
+ */
+typedef struct HackTimer
+{
+    HackDevice device;
+    long period;
+    long elapsed; // Instructions since the last tick
+} HackTimer;
+
+// Serial console, sending every character stored to its register
+typedef struct HackSerial
+{
+    HackDevice device;
+    HackQueue output;
+    long dropped; // Characters lost to a full queue
+} HackSerial;
+
+// Start a bus with no devices for a machine
+void hack_bus_init(HackBus *this, Hack *machine);
+
+/* Map a device into the machine's RAM, which must be done after loading it
+ * Returns false (and prints why) if the bus is full or the device overlaps
+ * another.
+ */
+bool hack_bus_attach(HackBus *this, HackDevice *device);
+
+/* Pass every store logged since the last update on to its device, then tick
+ * every device with the 'cycles' instructions run in the meantime
+ */
+void hack_bus_update(HackBus *this, long cycles);
+
+/* Checks whether the machine is idle, polling devices in a loop that
+ * changes nothing (see hack_find_idle_loop)
+ * Addresses no device is mapped to never change, so polling only them, such
+ * as the keyboard when there is none, counts as halted.
+ */
+HACK_IDLE hack_bus_idle(const HackBus *this);
+
+/* Length of the next slice, at most 'cycles', ending on the next multiple of
+ * HACK_BUS_MAX_SLICE instructions since the bus started
+ */
+long hack_bus_slice(const HackBus *this, long cycles);
+
+// Empty a queue
+void hack_queue_init(HackQueue *this);
+
+// Push a byte, returning false if the queue is full
+bool hack_queue_push(HackQueue *this, uint8_t byte);
+
+// Pop a byte, returning false if the queue is empty
+bool hack_queue_pop(HackQueue *this, uint8_t *byte);
+
+// Create a keyboard at KEYBD_ADDR with no key pressed
+void hack_keyboard_init(HackKeyboard *this);
+
+/* Press a key, 0 releasing it, from any thread
+ * The machine sees it after the current slice.
+ */
+void hack_keyboard_press(HackKeyboard *this, int key);
+
+// Get the key pressed, 0 for none, from any thread
+int hack_keyboard_key(HackKeyboard *this);
+
+// Create a timer at HACK_TIMER_ADDR ticking every 'period' instructions
+void hack_timer_init(HackTimer *this, long period);
+
+/* Instructions per millisecond at 'hz' instructions per second, or
+ * HACK_TIMER_PERIOD if unlimited
+ */
+long hack_timer_period(long hz);
+
+// Create a serial console at HACK_SERIAL_ADDR
+void hack_serial_init(HackSerial *this);
+
+#endif
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "emujit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define HACK_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define HACK_JIT_SUPPORTED 0
+#endif
+
+// Size of the executable code cache
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+
+// Longest run of instructions compiled into a single block
+#define JIT_MAX_BLOCK 128
+
+// Upper bound of native code bytes for one Hack instruction
+#define JIT_MAX_INSTR_BYTES 128
+
+// Upper bound of native code bytes for a block's entry and exit
+#define JIT_MAX_FRAME_BYTES 64
+
+// Shift turning a RAM address into its index in dirty_rows
+#define JIT_ROW_SHIFT 5
+_Static_assert(HACK_ROW_WORDS == 1 << JIT_ROW_SHIFT, "JIT_ROW_SHIFT is stale");
+
+// io_count is kept modulo the log size with an and
+_Static_assert((HACK_IO_LOG_SIZE & (HACK_IO_LOG_SIZE - 1)) == 0,
+               "HACK_IO_LOG_SIZE must be a power of two");
+
+// x86-64 registers used by the generated code
+#define RAX 0
+#define RCX 1 // A register
+#define RDX 2 // D register
+#define RSI 6 // io_count
+#define R8 8  // Scratch
+#define R9 9  // Address in RAM of M
+#define R10 10 // Value of M
+#define R11 11 // Next program counter
+
+// Block states
+typedef enum
+{
+    JIT_BLOCK_NEW,
+    JIT_BLOCK_COMPILED,
+    JIT_BLOCK_UNSUPPORTED
+} JIT_BLOCK_STATES;
+
+// Compiled code for a block, called with the machine as its only argument
+typedef void (*JitBlockFn)(Hack *machine);
+
+typedef struct JitBlock
+{
+    JitBlockFn fn;
+    uint16_t length;
+    uint8_t state;
+} JitBlock;
+
+struct HackJit
+{
+    // Executable memory, writable only while a block is being compiled
+    uint8_t *code;
+    size_t used;
+
+    // Compiled blocks indexed by the ROM address they start at
+    JitBlock blocks[MEM_SIZE];
+};
+
+HackJit *hack_jit_create(void)
+{
+    HackJit *jit = calloc(1, sizeof(HackJit));
+    if (jit == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for JIT.\n");
+        return NULL;
+    }
+
+#if HACK_JIT_SUPPORTED
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        // Not fatal, everything will just be interpreted
+        jit->code = NULL;
+    }
+#endif
+
+    return jit;
+}
+
+void hack_jit_destroy(HackJit *jit)
+{
+    if (jit == NULL)
+    {
+        return;
+    }
+
+#if HACK_JIT_SUPPORTED
+    if (jit->code != NULL)
+    {
+        munmap(jit->code, JIT_CODE_SIZE);
+    }
+#endif
+
+    free(jit);
+}
+
+void hack_jit_flush(HackJit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    jit->used = 0;
+}
+
+#if HACK_JIT_SUPPORTED
+
+// Append a byte of code
+static inline void emit8(HackJit *jit, uint8_t byte)
+{
+    jit->code[jit->used++] = byte;
+}
+
+// Append a 32-bit immediate or displacement
+static inline void emit32(HackJit *jit, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        emit8(jit, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+// Emits 'op eax, reg' for a two operand instruction taking r/m32, r32
+static void emit_op_eax(HackJit *jit, uint8_t opcode, int reg)
+{
+    if (reg >= R8)
+    {
+        emit8(jit, 0x44); // REX.R
+    }
+    emit8(jit, opcode);
+    emit8(jit, 0xC0 | ((reg & 7) << 3));
+}
+
+// Emits 'mov eax, reg'
+static void emit_mov_eax(HackJit *jit, int reg)
+{
+    emit_op_eax(jit, 0x89, reg);
+}
+
+// Emits 'op eax, imm8' for an instruction of the 0x83 group
+static void emit_op_eax_imm8(HackJit *jit, uint8_t ext, int8_t imm)
+{
+    emit8(jit, 0x83);
+    emit8(jit, 0xC0 | (ext << 3));
+    emit8(jit, (uint8_t)imm);
+}
+
+// Emits 'mov word [rdi + offset], reg'
+static void emit_store_field(HackJit *jit, int reg, size_t offset)
+{
+    emit8(jit, 0x66);
+    if (reg >= R8)
+    {
+        emit8(jit, 0x44); // REX.R
+    }
+    emit8(jit, 0x89);
+    emit8(jit, 0x87 | ((reg & 7) << 3));
+    emit32(jit, offset);
+}
+
+// Emits 'movsx reg, word [rdi + offset]'
+static void emit_load_field(HackJit *jit, int reg, size_t offset)
+{
+    emit8(jit, 0x0F);
+    emit8(jit, 0xBF);
+    emit8(jit, 0x87 | ((reg & 7) << 3));
+    emit32(jit, offset);
+}
+
+// Computes the ALU operation into eax, with X in the given register
+static void emit_alu(HackJit *jit, uint8_t alu, int x)
+{
+    switch (alu)
+    {
+    case HACK_ALU_ZERO:
+        emit8(jit, 0x31); // xor eax, eax
+        emit8(jit, 0xC0);
+        break;
+    case HACK_ALU_ONE:
+        emit8(jit, 0xB8); // mov eax, 1
+        emit32(jit, 1);
+        break;
+    case HACK_ALU_NEG_ONE:
+        emit8(jit, 0xB8); // mov eax, -1
+        emit32(jit, 0xFFFFFFFF);
+        break;
+    case HACK_ALU_D:
+        emit_mov_eax(jit, RDX);
+        break;
+    case HACK_ALU_X:
+        emit_mov_eax(jit, x);
+        break;
+    case HACK_ALU_NOT_D:
+    case HACK_ALU_NOT_X:
+        emit_mov_eax(jit, alu == HACK_ALU_NOT_D ? RDX : x);
+        emit8(jit, 0xF7); // not eax
+        emit8(jit, 0xD0);
+        break;
+    case HACK_ALU_NEG_D:
+    case HACK_ALU_NEG_X:
+        emit_mov_eax(jit, alu == HACK_ALU_NEG_D ? RDX : x);
+        emit8(jit, 0xF7); // neg eax
+        emit8(jit, 0xD8);
+        break;
+    case HACK_ALU_D_PLUS_ONE:
+    case HACK_ALU_X_PLUS_ONE:
+        emit_mov_eax(jit, alu == HACK_ALU_D_PLUS_ONE ? RDX : x);
+        emit_op_eax_imm8(jit, 0, 1); // add eax, 1
+        break;
+    case HACK_ALU_D_MINUS_ONE:
+    case HACK_ALU_X_MINUS_ONE:
+        emit_mov_eax(jit, alu == HACK_ALU_D_MINUS_ONE ? RDX : x);
+        emit_op_eax_imm8(jit, 5, 1); // sub eax, 1
+        break;
+    case HACK_ALU_D_PLUS_X:
+        emit_mov_eax(jit, RDX);
+        emit_op_eax(jit, 0x01, x); // add eax, x
+        break;
+    case HACK_ALU_D_MINUS_X:
+        emit_mov_eax(jit, RDX);
+        emit_op_eax(jit, 0x29, x); // sub eax, x
+        break;
+    case HACK_ALU_X_MINUS_D:
+        emit_mov_eax(jit, x);
+        emit_op_eax(jit, 0x29, RDX); // sub eax, edx
+        break;
+    case HACK_ALU_D_AND_X:
+        emit_mov_eax(jit, RDX);
+        emit_op_eax(jit, 0x21, x); // and eax, x
+        break;
+    case HACK_ALU_D_OR_X:
+        emit_mov_eax(jit, RDX);
+        emit_op_eax(jit, 0x09, x); // or eax, x
+        break;
+    }
+}
+
+/* Compiles a single instruction
+ * Only the low 16 bits of the registers are meaningful, which is all that is
+ * ever stored or tested.
+ */
+static void emit_instruction(HackJit *jit, HackOp op, uint16_t instruction,
+                             uint16_t pc)
+{
+    const size_t ram = offsetof(Hack, ram);
+
+    if (op.alu == HACK_ALU_LOAD)
+    {
+        emit8(jit, 0xB8 + RCX); // mov ecx, imm32
+        emit32(jit, instruction);
+        return;
+    }
+
+    // r9d = A & (MEM_SIZE - 1)
+    if (op.src_m || (op.dest & HACK_DEST_M))
+    {
+        emit8(jit, 0x44); // movzx r9d, cx
+        emit8(jit, 0x0F);
+        emit8(jit, 0xB7);
+        emit8(jit, 0xC9);
+        emit8(jit, 0x41); // and r9d, imm32
+        emit8(jit, 0x81);
+        emit8(jit, 0xE1);
+        emit32(jit, MEM_SIZE - 1);
+    }
+
+    // r10d = M
+    if (op.src_m)
+    {
+        emit8(jit, 0x46); // movsx r10d, word [rdi + r9 * 2 + ram]
+        emit8(jit, 0x0F);
+        emit8(jit, 0xBF);
+        emit8(jit, 0x94);
+        emit8(jit, 0x4F);
+        emit32(jit, ram);
+    }
+
+    emit_alu(jit, op.alu, op.src_m ? R10 : RCX);
+
+    // Store to M before A possibly changes
+    if (op.dest & HACK_DEST_M)
+    {
+        emit8(jit, 0x66); // mov word [rdi + r9 * 2 + ram], ax
+        emit8(jit, 0x42);
+        emit8(jit, 0x89);
+        emit8(jit, 0x84);
+        emit8(jit, 0x4F);
+        emit32(jit, ram);
+
+        emit8(jit, 0x45); // mov r8d, r9d
+        emit8(jit, 0x89);
+        emit8(jit, 0xC8);
+        emit8(jit, 0x41); // shr r8d, JIT_ROW_SHIFT
+        emit8(jit, 0xC1);
+        emit8(jit, 0xE8);
+        emit8(jit, JIT_ROW_SHIFT);
+        emit8(jit, 0x42); // mov byte [rdi + r8 + dirty_rows], 1
+        emit8(jit, 0xC6);
+        emit8(jit, 0x84);
+        emit8(jit, 0x07);
+        emit32(jit, offsetof(Hack, dirty_rows));
+        emit8(jit, 1);
+
+        // Log the store if the row has a device mapped, which is rare
+        emit8(jit, 0x42); // test byte [rdi + r8 + io_rows], 1
+        emit8(jit, 0xF6);
+        emit8(jit, 0x84);
+        emit8(jit, 0x07);
+        emit32(jit, offsetof(Hack, io_rows));
+        emit8(jit, 1);
+        emit8(jit, 0x74); // jz past the logging
+        const size_t skip = jit->used;
+        emit8(jit, 0);
+
+        emit8(jit, 0x41); // shl r9d, 16
+        emit8(jit, 0xC1);
+        emit8(jit, 0xE1);
+        emit8(jit, 16);
+        emit8(jit, 0x66); // mov r9w, ax
+        emit8(jit, 0x41);
+        emit8(jit, 0x89);
+        emit8(jit, 0xC1);
+        emit8(jit, 0x41); // mov r10d, esi
+        emit8(jit, 0x89);
+        emit8(jit, 0xF2);
+        emit8(jit, 0x41); // and r10d, HACK_IO_LOG_SIZE - 1
+        emit8(jit, 0x81);
+        emit8(jit, 0xE2);
+        emit32(jit, HACK_IO_LOG_SIZE - 1);
+        emit8(jit, 0x46); // mov dword [rdi + r10 * 4 + io_log], r9d
+        emit8(jit, 0x89);
+        emit8(jit, 0x8C);
+        emit8(jit, 0x97);
+        emit32(jit, offsetof(Hack, io_log));
+        emit8(jit, 0xFF); // inc esi
+        emit8(jit, 0xC6);
+
+        jit->code[skip] = jit->used - (skip + 1);
+    }
+    if (op.dest & HACK_DEST_D)
+    {
+        emit8(jit, 0x89); // mov edx, eax
+        emit8(jit, 0xC2);
+    }
+    if (op.dest & HACK_DEST_A)
+    {
+        emit8(jit, 0x89); // mov ecx, eax
+        emit8(jit, 0xC1);
+    }
+
+    if (!op.jump)
+    {
+        return;
+    }
+
+    // Unconditional jumps simply take the A register as the next PC
+    if (op.jump == (HACK_JUMP_LT | HACK_JUMP_EQ | HACK_JUMP_GT))
+    {
+        emit8(jit, 0x44); // movzx r11d, cx
+        emit8(jit, 0x0F);
+        emit8(jit, 0xB7);
+        emit8(jit, 0xD9);
+        return;
+    }
+
+    // Condition codes of cmovcc indexed by the jump bits
+    static const uint8_t cmov[] = {0, 0x4F, 0x44, 0x4D, 0x4C, 0x45, 0x4E};
+
+    emit8(jit, 0x44); // movzx r8d, cx
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit8(jit, 0xC1);
+    emit8(jit, 0x41); // mov r11d, pc + 1
+    emit8(jit, 0xB8 + (R11 & 7));
+    emit32(jit, pc + 1);
+    emit8(jit, 0x66); // test ax, ax
+    emit8(jit, 0x85);
+    emit8(jit, 0xC0);
+    emit8(jit, 0x45); // cmovcc r11d, r8d
+    emit8(jit, 0x0F);
+    emit8(jit, cmov[op.jump]);
+    emit8(jit, 0xD8);
+}
+
+// Compile the block starting at pc
+static void jit_compile(HackJit *jit, const Hack *machine, uint16_t pc)
+{
+    JitBlock *block = &jit->blocks[pc];
+    block->state = JIT_BLOCK_UNSUPPORTED;
+
+    if (jit->code == NULL)
+    {
+        return;
+    }
+
+    // Start over with an empty cache once it fills up
+    const size_t worst = JIT_MAX_FRAME_BYTES + JIT_MAX_BLOCK * JIT_MAX_INSTR_BYTES;
+    if (jit->used + worst > JIT_CODE_SIZE)
+    {
+        hack_jit_flush(jit);
+        block->state = JIT_BLOCK_UNSUPPORTED;
+    }
+
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        return;
+    }
+
+    uint8_t *start = jit->code + jit->used;
+
+    // Find where the block ends and whether it stores to RAM at all
+    uint16_t end = pc;
+    bool jumped = false;
+    bool stores = false;
+    while (end < machine->program_size && end - pc < JIT_MAX_BLOCK && !jumped)
+    {
+        const HackOp op = machine->ops[end];
+        jumped = op.alu != HACK_ALU_LOAD && op.jump;
+        stores |= op.alu != HACK_ALU_LOAD && (op.dest & HACK_DEST_M);
+        end++;
+    }
+
+    // Load the A and D registers, and io_count if any store may log to it
+    emit_load_field(jit, RCX, offsetof(Hack, a_reg));
+    emit_load_field(jit, RDX, offsetof(Hack, d_reg));
+    if (stores)
+    {
+        emit8(jit, 0x8B); // mov esi, dword [rdi + io_count]
+        emit8(jit, 0x87 | (RSI << 3));
+        emit32(jit, offsetof(Hack, io_count));
+    }
+
+    uint16_t i;
+    for (i = pc; i < end; i++)
+    {
+        emit_instruction(jit, machine->ops[i], machine->rom[i], i);
+    }
+
+    // Blocks not ending in a jump continue with the following instruction
+    if (!jumped)
+    {
+        emit8(jit, 0x41); // mov r11d, imm32
+        emit8(jit, 0xB8 + (R11 & 7));
+        emit32(jit, i);
+    }
+
+    // Write back the registers
+    emit_store_field(jit, RCX, offsetof(Hack, a_reg));
+    emit_store_field(jit, RDX, offsetof(Hack, d_reg));
+    emit_store_field(jit, R11, offsetof(Hack, pc));
+    if (stores)
+    {
+        emit8(jit, 0x89); // mov dword [rdi + io_count], esi
+        emit8(jit, 0x87 | (RSI << 3));
+        emit32(jit, offsetof(Hack, io_count));
+    }
+    emit8(jit, 0xC3); // ret
+
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    {
+        return;
+    }
+
+    memcpy(&block->fn, &start, sizeof(block->fn));
+    block->length = i - pc;
+    block->state = JIT_BLOCK_COMPILED;
+}
+
+#else
+
+static void jit_compile(HackJit *jit, const Hack *machine, uint16_t pc)
+{
+    (void)machine;
+    jit->blocks[pc].state = JIT_BLOCK_UNSUPPORTED;
+}
+
+#endif
+
+long hack_jit_run(HackJit *jit, Hack *machine, long cycles)
+{
+    long executed = 0;
+
+    while (executed < cycles && machine->pc < machine->program_size)
+    {
+        JitBlock *block = &jit->blocks[machine->pc];
+
+        if (block->state == JIT_BLOCK_NEW)
+        {
+            jit_compile(jit, machine, machine->pc);
+        }
+
+        if (block->state != JIT_BLOCK_COMPILED)
+        {
+            hack_execute(machine);
+            executed++;
+        }
+        else if (block->length > cycles - executed)
+        {
+            // Not enough cycles left for the whole block
+            const long ran = hack_run(machine, cycles - executed);
+            executed += ran;
+            if (ran == 0)
+            {
+                break; // Stopped at a breakpoint or watchpoint
+            }
+        }
+        else
+        {
+            block->fn(machine);
+            executed += block->length;
+        }
+    }
+
+    return executed;
+}
@@ -0,0 +1,38 @@
+#ifndef EMUJIT_H
+#define EMUJIT_H
+
+#include "emulib.h"
+
+/* A just-in-time compiler translating basic blocks of the Hack ROM into
+ * native x86-64 code.
+ *
+ * A basic block is a run of instructions ending at the first C instruction
+ * with any jump bits set. Each block is compiled the first time execution
+ * reaches its first instruction and is reused from then on. Anything the JIT
+ * cannot handle (or any host other than x86-64) falls back to the
+ * interpreter so the JIT can always be used in place of hack_run.
+ */
+typedef struct HackJit HackJit;
+
+/* Create a JIT with an empty code cache
+ * Returns NULL if unable to allocate memory
+ */
+HackJit *hack_jit_create(void);
+
+// Free the JIT and all of its compiled code
+void hack_jit_destroy(HackJit *jit);
+
+/* Forget all compiled code
+ * Must be called whenever the ROM of the machine being run changes.
+ */
+void hack_jit_flush(HackJit *jit);
+
+/* Execute up to 'cycles' instructions, stopping early once the program
+ * counter leaves the program.
+ * Behaves exactly like calling hack_execute repeatedly, except that the last
+ * few instructions, which run on hack_run, may stop at its traps.
+ * Returns the number of instructions executed.
+ */
+long hack_jit_run(HackJit *jit, Hack *machine, long cycles);
+
+#endif
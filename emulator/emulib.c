@@ -1,18 +1,131 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // memfd_create
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "emulib.h"
 
-#define COMP_NUM_BITS 7
-#define COMP_START_BIT 3
-#define DEST_START_BIT 10
-#define JUMP_START_BIT 13
+#if defined(__unix__) || defined(__APPLE__)
+#define HACK_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define HACK_MMAP 0
+#endif
+
+// Snapshots are shared copy-on-write through an anonymous file on Linux
+#if HACK_MMAP && defined(__linux__)
+#define HACK_COW_SNAPSHOTS 1
+#else
+#define HACK_COW_SNAPSHOTS 0
+#endif
+
+// Shortest run of zeros in RAM that a saved state leaves out
+#define HACK_STATE_MIN_GAP 3
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define DEST_SHIFT 3
+#define COMP_SHIFT 6
+
+// Masks an A register value into a valid RAM address
+#define HACK_ADDR(a) ((uint16_t)(a) & (MEM_SIZE - 1))
+
+/* Threaded code handlers. The first two are special, followed by one per
+ * (comp, dest, jump) combination in the order generated by HACK_COMPS,
+ * HACK_DESTS and HACK_JUMPS below, then the fused handlers and the traps.
+ */
+#define HACK_THREAD_LOAD 0
+#define HACK_THREAD_EXIT 1
+#define HACK_THREAD_FIRST_C 2
+
+// Number of computations X is A for (the first entries in HACK_COMPS)
+#define HACK_THREAD_NUM_A_COMPS 18
 
-// Retrives the nth most significant bit of a number
-static inline bool get_bit(uint16_t num, int i)
+// Number of computations in HACK_COMPS
+#define HACK_THREAD_NUM_COMPS 28
+
+/* Fused handlers, each running a whole sequence of instructions that hackvm
+ * emits over and over as though they were executed one at a time
+ */
+#define HACK_THREAD_FIRST_FUSED                                                \
+    (HACK_THREAD_FIRST_C + (HACK_THREAD_NUM_COMPS << 6))
+#define HACK_THREAD_PUSH_CONST (HACK_THREAD_FIRST_FUSED + 0)
+#define HACK_THREAD_COMPARE (HACK_THREAD_FIRST_FUSED + 1)
+#define HACK_THREAD_POP_TOP (HACK_THREAD_FIRST_FUSED + 2)
+#define HACK_THREAD_POP (HACK_THREAD_FIRST_FUSED + 3)
+#define HACK_THREAD_PUSH (HACK_THREAD_FIRST_FUSED + 4)
+
+/* Traps, which stop hack_run before the instruction they replace: always for a
+ * breakpoint, only if it stores to a watched row for a watchpoint
+ */
+#define HACK_THREAD_BREAK (HACK_THREAD_FIRST_FUSED + 5)
+#define HACK_THREAD_WATCH (HACK_THREAD_FIRST_FUSED + 6)
+
+// Longest sequence of instructions a fused handler runs
+#define HACK_FUSE_MAX_LENGTH 14
+
+// Stands for any A instruction in a sequence to fuse
+#define HACK_FUSE_ANY_A 0xFFFF
+
+// Stands for 'D;JGT', 'D;JEQ', 'D;JLT' or any other jump on D in a sequence
+#define HACK_FUSE_D_JUMP 0xE3FF
+
+/* A sequence of instructions run by a fused handler, which must begin with an
+ * A instruction so that the handler can fall back to executing just that one
+ * when fewer cycles are left than the sequence takes.
+ */
+typedef struct HackFusion
 {
-    return ((num << i) & 0x8000);
-}
+    uint16_t thread;
+    int length;
+    uint16_t words[HACK_FUSE_MAX_LENGTH];
+} HackFusion;
+
+// Sequences to fuse, longest first so that they win over their own prefixes
+static const HackFusion HACK_FUSIONS[] = {
+    // push constant: @c D=A @SP M=M+1 A=M-1 M=D
+    {HACK_THREAD_PUSH_CONST,
+     6,
+     {HACK_FUSE_ANY_A, 0xEC10, HACK_FUSE_ANY_A, 0xFDC8, 0xFCA0, 0xE308}},
+    /* eq, gt and lt: @SP AM=M-1 D=M A=A-1 D=M-D @TRUE D;Jcc D=0 @END 0;JMP
+     * (TRUE) D=-1 (END) @SP A=M-1 M=D
+     */
+    {HACK_THREAD_COMPARE,
+     14,
+     {HACK_FUSE_ANY_A, 0xFCA8, 0xFC10, 0xECA0, 0xF1D0, HACK_FUSE_ANY_A,
+      HACK_FUSE_D_JUMP, 0xEA90, HACK_FUSE_ANY_A, 0xEA87, 0xEE90,
+      HACK_FUSE_ANY_A, 0xFCA0, 0xE308}},
+    // Pop into D and point A at the new top, as binary operations start
+    {HACK_THREAD_POP_TOP,
+     4,
+     {HACK_FUSE_ANY_A, 0xFCA8, 0xFC10, 0xECA0}},
+    // Pop into D: @SP AM=M-1 D=M
+    {HACK_THREAD_POP, 3, {HACK_FUSE_ANY_A, 0xFCA8, 0xFC10}},
+    // Push D: @SP M=M+1 A=M-1 M=D
+    {HACK_THREAD_PUSH, 4, {HACK_FUSE_ANY_A, 0xFDC8, 0xFCA0, 0xE308}},
+};
+
+// Index in HACK_COMPS of the computations where X is M
+static const uint8_t HACK_THREAD_M_COMPS[] = {
+    [HACK_ALU_X] = 18,
+    [HACK_ALU_NOT_X] = 19,
+    [HACK_ALU_NEG_X] = 20,
+    [HACK_ALU_X_PLUS_ONE] = 21,
+    [HACK_ALU_X_MINUS_ONE] = 22,
+    [HACK_ALU_D_PLUS_X] = 23,
+    [HACK_ALU_D_MINUS_X] = 24,
+    [HACK_ALU_X_MINUS_D] = 25,
+    [HACK_ALU_D_AND_X] = 26,
+    [HACK_ALU_D_OR_X] = 27,
+};
 
 // Clear the ROM
 static void hack_clear_rom(Hack *this)
@@ -30,169 +143,1696 @@ static void hack_clear_ram(Hack *this)
     {
         this->ram[i] = 0;
     }
+
+    // Whatever was shown before no longer matches the RAM
+    memset(this->dirty_rows, 1, sizeof(this->dirty_rows));
+}
+
+// Perform an ALU operation
+static inline int16_t hack_alu(uint8_t alu, int16_t D, int16_t X)
+{
+    switch (alu)
+    {
+    case HACK_ALU_ZERO:
+        return 0;
+    case HACK_ALU_ONE:
+        return 1;
+    case HACK_ALU_NEG_ONE:
+        return -1;
+    case HACK_ALU_D:
+        return D;
+    case HACK_ALU_X:
+        return X;
+    case HACK_ALU_NOT_D:
+        return ~D;
+    case HACK_ALU_NOT_X:
+        return ~X;
+    case HACK_ALU_NEG_D:
+        return -D;
+    case HACK_ALU_NEG_X:
+        return -X;
+    case HACK_ALU_D_PLUS_ONE:
+        return D + 1;
+    case HACK_ALU_X_PLUS_ONE:
+        return X + 1;
+    case HACK_ALU_D_MINUS_ONE:
+        return D - 1;
+    case HACK_ALU_X_MINUS_ONE:
+        return X - 1;
+    case HACK_ALU_D_PLUS_X:
+        return D + X;
+    case HACK_ALU_D_MINUS_X:
+        return D - X;
+    case HACK_ALU_X_MINUS_D:
+        return X - D;
+    case HACK_ALU_D_AND_X:
+        return D & X;
+    case HACK_ALU_D_OR_X:
+        return D | X;
+    default:
+        return 0;
+    }
+}
+
+// Gets the jump bit that a computed value satisfies
+static inline uint8_t hack_jump_flag(int16_t comp)
+{
+    if (comp < 0)
+    {
+        return HACK_JUMP_LT;
+    }
+
+    return comp ? HACK_JUMP_GT : HACK_JUMP_EQ;
+}
+
+void hack_get_coords(int *x, int *y, uint16_t addr)
+{
+    *x = addr % 32;
+    *y = (addr - SCREEN_ADDR) / 32;
+}
+
+void hack_init(Hack *this)
+{
+    this->program_size = 0;
+    this->pc = 0;
+    this->ram[KEYBD_ADDR] = 0;
+
+    // No devices are mapped until a bus maps them
+    memset(this->io_rows, 0, sizeof(this->io_rows));
+    this->io_count = 0;
+
+    memset(this->breakpoints, 0, sizeof(this->breakpoints));
+    memset(this->watch_rows, 0, sizeof(this->watch_rows));
+    this->num_watches = 0;
+
+#ifdef HACK_STATS
+    memset(&this->stats, 0, sizeof(this->stats));
+#endif
+
+    hack_clear_rom(this);
+    hack_clear_ram(this);
+    hack_decode_rom(this);
+}
+
+// Gets the handler hack_run executes a decoded instruction with
+static uint16_t hack_op_thread(HackOp op)
+{
+    if (op.alu == HACK_ALU_LOAD)
+    {
+        return HACK_THREAD_LOAD;
+    }
+
+    const int comp = op.src_m ? HACK_THREAD_M_COMPS[op.alu] : op.alu;
+    return HACK_THREAD_FIRST_C + (((comp << 3) | op.dest) << 3) + op.jump;
 }
 
-// Calculate comp value
-static int hack_calc_comp(const Hack *this, uint16_t instruction)
+HackOp hack_decode(uint16_t instruction)
 {
-    const int16_t A = this->a_reg;
-    const int16_t D = this->d_reg;
-    const int16_t M = this->ram[A];
+    HackOp op = {HACK_ALU_LOAD, HACK_DEST_A, 0, false, HACK_THREAD_LOAD};
+
+    // An A instruction simply loads itself into the A register
+    if (!(instruction & 0x8000))
+    {
+        return op;
+    }
 
-    /* The comp bit ends at the 7th LSB so we shift the other LSBs off and since
-     * the comp bit starts at 10th MSB (after shift) we mask all the preceding
-     * MSBs.
+    op.dest = (instruction >> DEST_SHIFT) & 0x7;
+    op.jump = instruction & 0x7;
+
+    /* The comp bits end at the 7th LSB so we shift the other LSBs off and
+     * since the comp bits start at the 10th MSB (after shift) we mask all the
+     * preceding MSBs.
      */
-    const uint16_t comp_bits = (instruction >> 6) & 0x007F;
+    const uint16_t comp_bits = (instruction >> COMP_SHIFT) & 0x007F;
+
+    // The 'a' bit selects M over A as the X operand
+    op.src_m = (comp_bits & 0x40) != 0;
 
     switch (comp_bits)
     {
     case 0x2A:
-        return 0;
+        op.alu = HACK_ALU_ZERO;
+        break;
     case 0x3F:
-        return 1;
+        op.alu = HACK_ALU_ONE;
+        break;
     case 0x3A:
-        return -1;
+        op.alu = HACK_ALU_NEG_ONE;
+        break;
     case 0x0C:
-        return D;
+        op.alu = HACK_ALU_D;
+        break;
     case 0x30:
-        return A;
+    case 0x70:
+        op.alu = HACK_ALU_X;
+        break;
     case 0x0D:
-        return ~D;
+        op.alu = HACK_ALU_NOT_D;
+        break;
     case 0x31:
-        return ~A;
+    case 0x71:
+        op.alu = HACK_ALU_NOT_X;
+        break;
     case 0x0F:
-        return -D;
+        op.alu = HACK_ALU_NEG_D;
+        break;
     case 0x33:
-        return -A;
+    case 0x73:
+        op.alu = HACK_ALU_NEG_X;
+        break;
     case 0x1F:
-        return D + 1;
+        op.alu = HACK_ALU_D_PLUS_ONE;
+        break;
     case 0x37:
-        return A + 1;
+    case 0x77:
+        op.alu = HACK_ALU_X_PLUS_ONE;
+        break;
     case 0x0E:
-        return D - 1;
+        op.alu = HACK_ALU_D_MINUS_ONE;
+        break;
     case 0x32:
-        return A - 1;
-    case 0x02:
-        return D + A;
-    case 0x13:
-        return D - A;
-    case 0x07:
-        return A - D;
-    case 0x00:
-        return D & A;
-    case 0x15:
-        return D | A;
-    case 0x70:
-        return M;
-    case 0x71:
-        return ~M;
-    case 0x73:
-        return -M;
-    case 0x77:
-        return M + 1;
     case 0x72:
-        return M - 1;
+        op.alu = HACK_ALU_X_MINUS_ONE;
+        break;
+    case 0x02:
     case 0x42:
-        return D + M;
+        op.alu = HACK_ALU_D_PLUS_X;
+        break;
+    case 0x13:
     case 0x53:
-        return D - M;
+        op.alu = HACK_ALU_D_MINUS_X;
+        break;
+    case 0x07:
     case 0x47:
-        return M - D;
+        op.alu = HACK_ALU_X_MINUS_D;
+        break;
+    case 0x00:
     case 0x40:
-        return D & M;
+        op.alu = HACK_ALU_D_AND_X;
+        break;
+    case 0x15:
     case 0x55:
-        return D | M;
+        op.alu = HACK_ALU_D_OR_X;
+        break;
     default:
-        return 0;
+        // Undefined computations always produce 0
+        op.alu = HACK_ALU_ZERO;
+        op.src_m = false;
+        break;
     }
-}
 
-void hack_get_coords(int *x, int *y, uint16_t addr)
-{
-    *x = addr % 32;
-    *y = (addr - SCREEN_ADDR) / 32;
+    op.thread = hack_op_thread(op);
+
+    return op;
 }
 
-void hack_init(Hack *this)
+// Checks if the program contains a sequence to fuse at an address
+static bool hack_fuse_matches(const Hack *this, int addr,
+                              const HackFusion *fusion)
 {
-    this->program_size = 0;
-    this->pc = 0;
-    this->ram[KEYBD_ADDR] = 0;
+    if (addr + fusion->length > this->program_size)
+    {
+        return false;
+    }
 
-    hack_clear_rom(this);
-    hack_clear_ram(this);
+    for (int i = 0; i < fusion->length; i++)
+    {
+        const uint16_t word = this->rom[addr + i];
+        switch (fusion->words[i])
+        {
+        case HACK_FUSE_ANY_A:
+            if (word & 0x8000)
+            {
+                return false;
+            }
+            break;
+        case HACK_FUSE_D_JUMP:
+            if ((word & ~0x7) != 0xE300 || !(word & 0x7))
+            {
+                return false;
+            }
+            break;
+        default:
+            if (word != fusion->words[i])
+            {
+                return false;
+            }
+            break;
+        }
+    }
+
+    // Comparisons must branch within themselves and use the same stack
+    if (fusion->thread == HACK_THREAD_COMPARE)
+    {
+        return this->rom[addr + 5] == addr + 10 &&
+               this->rom[addr + 8] == addr + 11 &&
+               this->rom[addr + 11] == this->rom[addr];
+    }
+
+    return true;
 }
 
-void hack_execute(Hack *this)
+// Checks if any instruction from 'start' to 'end' - 1 has a breakpoint
+static bool hack_has_breakpoint(const Hack *this, int start, int end)
 {
-    // Fetch instruction from ROM and increment program counter
-    uint16_t instruction = this->rom[this->pc++];
-    // Handle an A instruction
-    if (!get_bit(instruction, 0))
+    for (int addr = start; addr < end; addr++)
     {
-        this->a_reg = instruction;
+        if (hack_is_breakpoint(this, addr))
+        {
+            return true;
+        }
     }
 
-    // Handle a C instruction
-    else
+    return false;
+}
+
+/* Points every instruction of the program from 'start' to 'end' - 1 at its
+ * handler: a trap if it has one, else the fused handler of a sequence to fuse
+ * starting there, else its own.
+ * Only the first instruction of a sequence to fuse changes, so jumping into
+ * the middle of it still executes the rest one instruction at a time. Fused
+ * handlers run their whole sequence at once though, so sequences with a
+ * breakpoint past their first instruction are not fused, and neither is any
+ * while something is watched since they all store to RAM.
+ */
+static void hack_thread_rom(Hack *this, int start, int end)
+{
+    const int num_fusions = sizeof(HACK_FUSIONS) / sizeof(HACK_FUSIONS[0]);
+
+    start = start < 0 ? 0 : start;
+    end = end > this->program_size ? this->program_size : end;
+    for (int addr = start; addr < end; addr++)
     {
-        // Compute a value
-        const int comp = hack_calc_comp(this, instruction);
+        HackOp *op = &this->ops[addr];
+        op->thread = hack_op_thread(*op);
 
-        // Store computed value in appropriate destinations
-        if (get_bit(instruction, DEST_START_BIT + 2))
+        if (hack_is_breakpoint(this, addr))
         {
-            this->ram[this->a_reg] = comp;
+            op->thread = HACK_THREAD_BREAK;
+            continue;
         }
-        if (get_bit(instruction, DEST_START_BIT + 1))
+
+        if (this->num_watches > 0)
         {
-            this->d_reg = comp;
+            if (op->alu != HACK_ALU_LOAD && (op->dest & HACK_DEST_M))
+            {
+                op->thread = HACK_THREAD_WATCH;
+            }
+            continue;
         }
-        if (get_bit(instruction, DEST_START_BIT))
+
+        for (int i = 0; i < num_fusions; i++)
         {
-            this->a_reg = comp;
+            const HackFusion *fusion = &HACK_FUSIONS[i];
+            if (hack_fuse_matches(this, addr, fusion) &&
+                !hack_has_breakpoint(this, addr + 1, addr + fusion->length))
+            {
+                op->thread = fusion->thread;
+                break;
+            }
         }
+    }
+}
+
+void hack_decode_rom(Hack *this)
+{
+    for (int i = 0; i < MEM_SIZE; i++)
+    {
+        this->ops[i] = hack_decode(this->rom[i]);
 
-        // Decide if a jump should be performed
-        if ((get_bit(instruction, JUMP_START_BIT) && comp < 0) ||
-            (get_bit(instruction, JUMP_START_BIT + 1) && comp == 0) ||
-            (get_bit(instruction, JUMP_START_BIT + 2) && comp > 0))
+        // Threaded code stops as soon as it runs off the end of the program
+        if (i >= this->program_size)
         {
-            this->pc = this->a_reg;
+            this->ops[i].thread = HACK_THREAD_EXIT;
         }
     }
+
+    this->ops[MEM_SIZE] = hack_decode(0);
+    this->ops[MEM_SIZE].thread = HACK_THREAD_EXIT;
+
+    hack_thread_rom(this, 0, this->program_size);
 }
 
-bool hack_load_rom(Hack *this, const char *filepath)
+bool hack_set_breakpoint(Hack *this, uint16_t addr, bool set)
 {
-    if (strlen(filepath) > FILENAME_MAX)
+    if (addr >= this->program_size)
     {
-        fprintf(stderr, "Unable to open ROM because filename"
-                        " exceeds %d characters.\n",
-                FILENAME_MAX);
         return false;
     }
 
-    FILE *fp = fopen(filepath, "r");
-    if (fp == NULL)
+    if (set)
     {
-        fprintf(stderr, "Unable to open %s\n", filepath);
-        return false;
+        this->breakpoints[addr / 8] |= 1 << (addr % 8);
+    }
+    else
+    {
+        this->breakpoints[addr / 8] &= ~(1 << (addr % 8));
+    }
+
+    // Sequences fused before the address may now cover a breakpoint or not
+    hack_thread_rom(this, addr - (HACK_FUSE_MAX_LENGTH - 1), addr + 1);
+    return true;
+}
+
+bool hack_is_breakpoint(const Hack *this, uint16_t addr)
+{
+    return this->breakpoints[addr / 8] & (1 << (addr % 8));
+}
+
+void hack_set_watchpoint(Hack *this, uint16_t addr, bool set)
+{
+    uint8_t *row = &this->watch_rows[HACK_ADDR(addr) / HACK_ROW_WORDS];
+    if (set && *row < UINT8_MAX)
+    {
+        (*row)++;
+        this->num_watches++;
+    }
+    else if (!set && *row > 0)
+    {
+        (*row)--;
+        this->num_watches--;
+    }
+    else
+    {
+        return;
+    }
+
+    // Stores only need trapping while anything is watched
+    if (this->num_watches == (set ? 1 : 0))
+    {
+        hack_thread_rom(this, 0, this->program_size);
+    }
+}
+
+#ifdef HACK_STATS
+
+// Finds the region of RAM an address belongs to
+static HACK_REGIONS hack_region(uint16_t addr)
+{
+    if (addr < HACK_STATIC_ADDR)
+    {
+        return HACK_REGION_REGISTERS;
+    }
+    if (addr < HACK_STACK_ADDR)
+    {
+        return HACK_REGION_STATIC;
+    }
+    if (addr < HACK_HEAP_ADDR)
+    {
+        return HACK_REGION_STACK;
+    }
+    if (addr < SCREEN_ADDR)
+    {
+        return HACK_REGION_HEAP;
+    }
+    if (addr < KEYBD_ADDR)
+    {
+        return HACK_REGION_SCREEN;
+    }
+    return addr == KEYBD_ADDR ? HACK_REGION_KEYBOARD : HACK_REGION_DEVICES;
+}
+
+// Counts a C instruction about to access 'addr' and compute 'comp'
+static void hack_count(HackStats *stats, HackOp op, uint16_t addr,
+                       int16_t comp)
+{
+    stats->c_instructions++;
+    stats->comps[op.alu + op.src_m * HACK_ALU_LOAD]++;
+
+    if (op.src_m)
+    {
+        stats->reads[hack_region(addr)]++;
+    }
+    if (op.dest & HACK_DEST_M)
+    {
+        stats->writes[hack_region(addr)]++;
     }
 
-    /* A Hack ROM is an ASCII file with one instruction per line, so we convert
-     * each line to an actual number before storing in emulator ROM.
-     *
-     * Note: that trailing extra space could cause problems here.
-     * We only expect \r\n\0 at the maximum (+3) after the instruction.
+    if (op.jump & hack_jump_flag(comp))
+    {
+        stats->jumps_taken++;
+    }
+    else if (op.jump)
+    {
+        stats->jumps_not_taken++;
+    }
+}
+
+#endif
+
+void hack_execute(Hack *this)
+{
+    // Fetch decoded instruction and increment program counter
+    const uint16_t pc = this->pc++;
+    const HackOp op = this->ops[pc];
+
+    // Handle an A instruction
+    if (op.alu == HACK_ALU_LOAD)
+    {
+        this->a_reg = this->rom[pc];
+#ifdef HACK_STATS
+        this->stats.a_instructions++;
+#endif
+        return;
+    }
+
+    // Handle a C instruction
+    const int16_t X = op.src_m ? this->ram[HACK_ADDR(this->a_reg)]
+                               : this->a_reg;
+    const int16_t comp = hack_alu(op.alu, this->d_reg, X);
+#ifdef HACK_STATS
+    hack_count(&this->stats, op, HACK_ADDR(this->a_reg), comp);
+#endif
+
+    // Store computed value in appropriate destinations
+    if (op.dest & HACK_DEST_M)
+    {
+        const uint16_t addr = HACK_ADDR(this->a_reg);
+        this->ram[addr] = comp;
+        this->dirty_rows[addr / HACK_ROW_WORDS] = 1;
+        if (this->io_rows[addr / HACK_ROW_WORDS])
+        {
+            this->io_log[this->io_count++ % HACK_IO_LOG_SIZE] =
+                (uint32_t)addr << 16 | (uint16_t)comp;
+        }
+    }
+    if (op.dest & HACK_DEST_D)
+    {
+        this->d_reg = comp;
+    }
+    if (op.dest & HACK_DEST_A)
+    {
+        this->a_reg = comp;
+    }
+
+    // Decide if a jump should be performed
+    if (op.jump & hack_jump_flag(comp))
+    {
+        this->pc = this->a_reg;
+    }
+}
+
+/* Every computation of a C instruction along with its name.
+ * Computations where X is A come first, in HACK_ALU_OPS order, followed by
+ * those where X is M. HACK_M stands for M inside hack_run and HACK_STORE_M
+ * for a store to it.
+ */
+#define HACK_COMPS(F, G)                                                       \
+    F(ZERO, 0, G) F(ONE, 1, G) F(NEG_ONE, -1, G) F(D, D, G) F(A, A, G)         \
+    F(NOT_D, ~D, G) F(NOT_A, ~A, G) F(NEG_D, -D, G) F(NEG_A, -A, G)            \
+    F(D_PLUS_ONE, D + 1, G) F(A_PLUS_ONE, A + 1, G)                            \
+    F(D_MINUS_ONE, D - 1, G) F(A_MINUS_ONE, A - 1, G)                          \
+    F(D_PLUS_A, D + A, G) F(D_MINUS_A, D - A, G) F(A_MINUS_D, A - D, G)        \
+    F(D_AND_A, D & A, G) F(D_OR_A, D | A, G)                                   \
+    F(MEM, HACK_M, G) F(NOT_MEM, ~HACK_M, G) F(NEG_MEM, -HACK_M, G)            \
+    F(MEM_PLUS_ONE, HACK_M + 1, G) F(MEM_MINUS_ONE, HACK_M - 1, G)             \
+    F(D_PLUS_MEM, D + HACK_M, G) F(D_MINUS_MEM, D - HACK_M, G)                 \
+    F(MEM_MINUS_D, HACK_M - D, G)                                              \
+    F(D_AND_MEM, D & HACK_M, G) F(D_OR_MEM, D | HACK_M, G)
+
+// Every destination in order of its dest bits along with how to store to it
+#define HACK_DESTS(F, c, e, G)                                                 \
+    F(c, e, NONE, , G)                                                         \
+    F(c, e, M, HACK_STORE_M(v), G)                                             \
+    F(c, e, D, D = v;, G)                                                      \
+    F(c, e, MD, HACK_STORE_M(v) D = v;, G)                                     \
+    F(c, e, A, A = v;, G)                                                      \
+    F(c, e, AM, HACK_STORE_M(v) A = v;, G)                                     \
+    F(c, e, AD, D = v; A = v;, G)                                              \
+    F(c, e, AMD, HACK_STORE_M(v) D = v; A = v;, G)
+
+// Every jump in order of its jump bits along with its condition
+#define HACK_JUMPS(F, c, e, d, s)                                              \
+    F(c, e, d, s, NONE, 0)                                                     \
+    F(c, e, d, s, JGT, v > 0)                                                  \
+    F(c, e, d, s, JEQ, v == 0)                                                 \
+    F(c, e, d, s, JGE, v >= 0)                                                 \
+    F(c, e, d, s, JLT, v < 0)                                                  \
+    F(c, e, d, s, JNE, v != 0)                                                 \
+    F(c, e, d, s, JLE, v <= 0)                                                 \
+    F(c, e, d, s, JMP, 1)
+
+// Expands G(comp, expr, dest, store, jump, cond) for every C instruction
+#define HACK_EACH_DEST(c, e, G) HACK_DESTS(HACK_EACH_JUMP, c, e, G)
+#define HACK_EACH_JUMP(c, e, d, s, G) HACK_JUMPS(G, c, e, d, s)
+#define HACK_EACH_C_INSTRUCTION(G) HACK_COMPS(HACK_EACH_DEST, G)
+
+#if defined(__GNUC__)
+
+#define HACK_THREAD_LABEL(c, e, d, s, j, cond) &&c_##c##_##d##_##j,
+
+#define HACK_THREAD_HANDLER(c, e, d, s, j, cond)                               \
+    c_##c##_##d##_##j:                                                         \
+    {                                                                          \
+        const int16_t v = (e);                                                 \
+        (void)v;                                                               \
+        s                                                                      \
+        if (cond)                                                              \
+        {                                                                      \
+            pc = (uint16_t)A;                                                  \
+            if (pc >= MEM_SIZE)                                                \
+            {                                                                  \
+                budget--;                                                      \
+                goto done;                                                     \
+            }                                                                  \
+        }                                                                      \
+        else                                                                   \
+        {                                                                      \
+            pc++;                                                              \
+        }                                                                      \
+        HACK_THREAD_NEXT();                                                    \
+    }
+
+// Count the instruction just executed and go straight to the next handler
+#define HACK_THREAD_NEXT()                                                     \
+    do                                                                         \
+    {                                                                          \
+        if (--budget == 0)                                                     \
+        {                                                                      \
+            goto done;                                                         \
+        }                                                                      \
+        goto *handlers[ops[pc].thread];                                        \
+    } while (0)
+
+/* Start a fused handler for 'n' instructions, falling back to executing just
+ * its first instruction, which is always an A instruction, if fewer cycles are
+ * left than that.
+ */
+#define HACK_FUSED_BEGIN(n)                                                    \
+    if (budget < (n))                                                          \
+    {                                                                          \
+        goto load;                                                             \
+    }
+
+// Count the 'n' instructions a fused handler executed and go on to the next
+#define HACK_FUSED_NEXT(n)                                                     \
+    budget -= (n) - 1;                                                         \
+    HACK_THREAD_NEXT();
+
+// Labels as values and computed gotos are GNU extensions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+long hack_run(Hack *this, long cycles)
+{
+    static const void *const handlers[] = {
+        &&load,
+        &&done,
+        HACK_EACH_C_INSTRUCTION(HACK_THREAD_LABEL) &&push_const,
+        &&compare,
+        &&pop_top,
+        &&pop,
+        &&push,
+        &&done,
+        &&watch};
+
+    if (cycles <= 0)
+    {
+        return 0;
+    }
+
+    // Keep the machine state in locals so it can live in host registers
+    const HackOp *const ops = this->ops;
+    const uint16_t *const rom = this->rom;
+    int16_t *const ram = this->ram;
+    uint8_t *const dirty_rows = this->dirty_rows;
+    const uint8_t *const io_rows = this->io_rows;
+    const uint8_t *const watch_rows = this->watch_rows;
+    uint32_t *const io_log = this->io_log;
+    uint32_t io_count = this->io_count;
+    uint16_t pc = this->pc;
+    int16_t A = this->a_reg;
+    int16_t D = this->d_reg;
+    long budget = cycles;
+
+#define HACK_M ram[HACK_ADDR(A)]
+#define HACK_STORE_M(value)                                                    \
+    HACK_M = (value);                                                          \
+    dirty_rows[HACK_ADDR(A) / HACK_ROW_WORDS] = 1;                             \
+    if (__builtin_expect(io_rows[HACK_ADDR(A) / HACK_ROW_WORDS], 0))          \
+    {                                                                          \
+        io_log[io_count++ % HACK_IO_LOG_SIZE] =                                \
+            (uint32_t)HACK_ADDR(A) << 16 | (uint16_t)HACK_M;                   \
+    }
+
+    // Only jumps can leave the ROM so this is the one bounds check needed
+    if (pc >= MEM_SIZE)
+    {
+        return 0;
+    }
+    goto *handlers[ops[pc].thread];
+
+load:
+    A = rom[pc++];
+    HACK_THREAD_NEXT();
+
+    HACK_EACH_C_INSTRUCTION(HACK_THREAD_HANDLER)
+
+    /* The fused handlers, see HACK_FUSIONS. Each does exactly what its
+     * instructions do in turn, down to the values left in A and D.
      */
-    char line[WORD_SIZE + 3];
-    while (fgets(line, WORD_SIZE + 3, fp) != NULL)
+push_const:
+    HACK_FUSED_BEGIN(6)
+    D = rom[pc];
+    A = rom[pc + 2];
+    HACK_STORE_M(HACK_M + 1)
+    A = HACK_M - 1;
+    HACK_STORE_M(D)
+    pc += 6;
+    HACK_FUSED_NEXT(6)
+
+compare:
+{
+    HACK_FUSED_BEGIN(13)
+    A = rom[pc];
+    const int16_t sp = HACK_M - 1;
+    HACK_STORE_M(sp)
+    A = sp;
+    D = HACK_M;
+    A--;
+    D = HACK_M - D;
+
+    // Taking the branch skips 'D=0 @END 0;JMP'
+    const bool taken = ops[pc + 6].jump & hack_jump_flag(D);
+    D = taken ? -1 : 0;
+
+    A = rom[pc + 11];
+    A = HACK_M - 1;
+    HACK_STORE_M(D)
+    pc += 14;
+    if (taken)
     {
-        line[WORD_SIZE] = '\0';
-        this->rom[this->program_size++] = strtol(line, NULL, 2);
+        HACK_FUSED_NEXT(11)
+    }
+    HACK_FUSED_NEXT(13)
+}
+
+pop_top:
+    HACK_FUSED_BEGIN(4)
+    A = rom[pc];
+    HACK_STORE_M(HACK_M - 1)
+    A = HACK_M;
+    D = HACK_M;
+    A--;
+    pc += 4;
+    HACK_FUSED_NEXT(4)
+
+pop:
+    HACK_FUSED_BEGIN(3)
+    A = rom[pc];
+    HACK_STORE_M(HACK_M - 1)
+    A = HACK_M;
+    D = HACK_M;
+    pc += 3;
+    HACK_FUSED_NEXT(3)
+
+push:
+    HACK_FUSED_BEGIN(4)
+    A = rom[pc];
+    HACK_STORE_M(HACK_M + 1)
+    A = HACK_M - 1;
+    HACK_STORE_M(D)
+    pc += 4;
+    HACK_FUSED_NEXT(4)
+
+    /* A store to a watched row stops before it executes, any other store is
+     * executed by the instruction's own handler
+     */
+watch:
+    if (watch_rows[HACK_ADDR(A) / HACK_ROW_WORDS])
+    {
+        goto done;
+    }
+    goto *handlers[hack_op_thread(ops[pc])];
+
+#undef HACK_M
+#undef HACK_STORE_M
+
+done:
+    this->pc = pc;
+    this->a_reg = A;
+    this->d_reg = D;
+    this->io_count = io_count;
+
+    return cycles - budget;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+long hack_run(Hack *this, long cycles)
+{
+    long executed = 0;
+
+    while (executed < cycles && this->pc < this->program_size)
+    {
+        const uint16_t thread = this->ops[this->pc].thread;
+        if (thread == HACK_THREAD_BREAK ||
+            (thread == HACK_THREAD_WATCH &&
+             this->watch_rows[HACK_ADDR(this->a_reg) / HACK_ROW_WORDS]))
+        {
+            break;
+        }
+
+        hack_execute(this);
+        executed++;
+    }
+
+    return executed;
+}
+
+#endif
+
+// Checks if an instruction jumps unconditionally without storing anything
+static bool hack_is_plain_jump(HackOp op)
+{
+    return op.alu != HACK_ALU_LOAD && !op.dest &&
+           op.jump == (HACK_JUMP_LT | HACK_JUMP_EQ | HACK_JUMP_GT);
+}
+
+bool hack_is_halted(const Hack *this)
+{
+    const uint16_t pc = this->pc;
+    if (pc + 1 >= MEM_SIZE)
+    {
+        return false;
+    }
+
+    // About to load its own address and then jump to it
+    if (this->rom[pc] == pc && hack_is_plain_jump(this->ops[pc + 1]))
+    {
+        return true;
+    }
+
+    // About to jump back to the instruction that loaded the jump address
+    return pc > 0 && this->rom[pc - 1] == pc - 1 &&
+           (uint16_t)this->a_reg == pc - 1 && hack_is_plain_jump(this->ops[pc]);
+}
+
+/* The state of a machine followed by hack_find_idle_loop, which leaves the
+ * machine itself untouched: its registers, and the words it stored to on top
+ * of its RAM
+ */
+typedef struct HackProbe
+{
+    uint16_t pc;
+    int16_t a, d;
+    int num_stores;
+    uint16_t addrs[HACK_IDLE_MAX_STORES];
+    int16_t values[HACK_IDLE_MAX_STORES];
+} HackProbe;
+
+// Finds the store a probe made to an address, -1 if there is none
+static int hack_probe_find(const HackProbe *probe, uint16_t addr)
+{
+    for (int i = 0; i < probe->num_stores; i++)
+    {
+        if (probe->addrs[i] == addr)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Reads a word as the probe sees it
+static int16_t hack_probe_load(const Hack *this, const HackProbe *probe,
+                               uint16_t addr)
+{
+    const int i = hack_probe_find(probe, addr);
+    return i >= 0 ? probe->values[i] : this->ram[addr];
+}
+
+// Checks if two probes of a machine are in the same state
+static bool hack_probe_equal(const Hack *this, const HackProbe *probe,
+                             const HackProbe *seen)
+{
+    if (probe->pc != seen->pc || probe->a != seen->a || probe->d != seen->d)
+    {
+        return false;
+    }
+
+    // Probes only ever store to more words, so 'probe' covers all of 'seen'
+    for (int i = 0; i < probe->num_stores; i++)
+    {
+        if (probe->values[i] != hack_probe_load(this, seen, probe->addrs[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Remembers an address an idle loop polls, false if there are too many
+static bool hack_idle_read(HackIdleLoop *loop, uint16_t addr)
+{
+    for (int i = 0; i < loop->num_reads; i++)
+    {
+        if (loop->reads[i] == addr)
+        {
+            return true;
+        }
+    }
+
+    if (loop->num_reads == HACK_IDLE_MAX_READS)
+    {
+        return false;
+    }
+
+    loop->reads[loop->num_reads++] = addr;
+    return true;
+}
+
+bool hack_find_idle_loop(const Hack *this, HackIdleLoop *loop)
+{
+    /* The next state of a probe only depends on its current state, so Brent's
+     * algorithm finds the loop it ends up in: 'seen' jumps ahead to the
+     * current state every power of two instructions, until the current state
+     * comes back to it.
+     */
+    HackProbe probe = {this->pc, this->a_reg, this->d_reg, 0, {0}, {0}};
+    HackProbe seen = probe;
+    int power = 1;
+
+    loop->length = 0;
+    loop->num_reads = 0;
+    for (int step = 0; step < HACK_IDLE_MAX_STEPS; step++)
+    {
+        if (probe.pc >= this->program_size)
+        {
+            return false;
+        }
+
+        const HackOp op = this->ops[probe.pc];
+        if (op.alu == HACK_ALU_LOAD)
+        {
+            probe.a = this->rom[probe.pc++];
+        }
+        else
+        {
+            const uint16_t addr = HACK_ADDR(probe.a);
+            const bool device = addr == KEYBD_ADDR ||
+                                this->io_rows[addr / HACK_ROW_WORDS];
+
+            int16_t X = probe.a;
+            if (op.src_m)
+            {
+                X = hack_probe_load(this, &probe, addr);
+                if (device && !hack_idle_read(loop, addr))
+                {
+                    return false;
+                }
+            }
+
+            const int16_t comp = hack_alu(op.alu, probe.d, X);
+            if (op.dest & HACK_DEST_M)
+            {
+                // Devices may do something with stores to them
+                int i = hack_probe_find(&probe, addr);
+                if (device || (i < 0 && probe.num_stores ==
+                                            HACK_IDLE_MAX_STORES))
+                {
+                    return false;
+                }
+                if (i < 0)
+                {
+                    i = probe.num_stores++;
+                    probe.addrs[i] = addr;
+                }
+                probe.values[i] = comp;
+            }
+            if (op.dest & HACK_DEST_D)
+            {
+                probe.d = comp;
+            }
+            if (op.dest & HACK_DEST_A)
+            {
+                probe.a = comp;
+            }
+            probe.pc = op.jump & hack_jump_flag(comp) ? (uint16_t)probe.a
+                                                       : probe.pc + 1;
+        }
+
+        loop->length++;
+        if (hack_probe_equal(this, &probe, &seen))
+        {
+            return true;
+        }
+
+        if (loop->length == power)
+        {
+            seen = probe;
+            power *= 2;
+            loop->length = 0;
+        }
+    }
+
+    return false;
+}
+
+/* Maps a file into memory read-only
+ * Falls back to reading it into an allocated buffer where mmap is not
+ * available. Returns NULL if unable to open or read the file.
+ */
+static const char *hack_map_file(const char *filepath, size_t *size)
+{
+#if HACK_MMAP
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+
+    // Empty files cannot be mapped but are perfectly valid (empty) ROMs
+    const char *data = "";
+    if (*size > 0)
+    {
+        data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            data = NULL;
+        }
+    }
+
+    close(fd);
+    return data;
+#else
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *data = malloc(*size + 1);
+    if (data != NULL && fread(data, 1, *size, fp) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+    return data;
+#endif
+}
+
+// Releases a file mapped by hack_map_file
+static void hack_unmap_file(const char *data, size_t size)
+{
+#if HACK_MMAP
+    if (size > 0)
+    {
+        munmap((void *)data, size);
+    }
+#else
+    (void)size;
+    free((void *)data);
+#endif
+}
+
+// Reads a little-endian 16-bit word
+static uint16_t hack_read_word(const uint8_t *bytes)
+{
+    return bytes[0] | bytes[1] << 8;
+}
+
+// Writes a little-endian 16-bit word
+static void hack_write_word(FILE *fp, uint16_t word)
+{
+    fputc(word & 0xFF, fp);
+    fputc(word >> 8, fp);
+}
+
+// Reverses the order of the bits in a byte
+static uint8_t hack_reverse_byte(uint8_t byte)
+{
+    byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+    byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+    byte = (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+    return byte;
+}
+
+/* Converts 16 ASCII binary digits into a word, most significant bit first
+ * Returns false if any of the characters is not a binary digit.
+ */
+static bool hack_parse_word(const char *digits, uint16_t *word)
+{
+#if defined(__SSE2__)
+    const __m128i chars = _mm_loadu_si128((const __m128i *)digits);
+    const int ones = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('1')));
+    const int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('0')));
+
+    if ((ones | zeros) != 0xFFFF)
+    {
+        return false;
+    }
+
+    // The mask has the first character in its least significant bit
+    *word = hack_reverse_byte(ones & 0xFF) << 8 | hack_reverse_byte(ones >> 8);
+    return true;
+#else
+    *word = 0;
+    for (int i = 0; i < WORD_SIZE; i++)
+    {
+        if (digits[i] != '0' && digits[i] != '1')
+        {
+            return false;
+        }
+
+        *word = (*word << 1) | (digits[i] - '0');
+    }
+
+    return true;
+#endif
+}
+
+// Loads a packed binary ROM
+static bool hack_load_binary(Hack *this, const char *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    const int version = hack_read_word(bytes + 4);
+    const int count = hack_read_word(bytes + 6);
+
+    if (version != HACK_ROM_VERSION)
+    {
+        fprintf(stderr, "Unsupported binary ROM version %d.\n", version);
+        return false;
+    }
+    if (size < HACK_ROM_HEADER_SIZE + 2 * (size_t)count)
+    {
+        fprintf(stderr, "Binary ROM is truncated.\n");
+        return false;
+    }
+    if (this->program_size + count > MEM_SIZE)
+    {
+        fprintf(stderr, "ROM exceeds %d instructions.\n", MEM_SIZE);
+        return false;
+    }
+
+    bytes += HACK_ROM_HEADER_SIZE;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(this->rom + this->program_size, bytes, 2 * (size_t)count);
+#else
+    for (int i = 0; i < count; i++)
+    {
+        this->rom[this->program_size + i] = bytes[2 * i] | bytes[2 * i + 1] << 8;
+    }
+#endif
+
+    this->program_size += count;
+    return true;
+}
+
+// Checks if a line holds nothing but whitespace
+static bool hack_is_blank(const char *line, const char *eol)
+{
+    for (; line < eol; line++)
+    {
+        if (!isspace((unsigned char)*line))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Loads an ASCII ROM with one instruction per line
+ * Anything following the 16 binary digits of an instruction is ignored, as
+ * are blank lines.
+ */
+static bool hack_load_ascii(Hack *this, const char *data, size_t size)
+{
+    const char *p = data;
+    const char *end = data + size;
+
+    int line = 0;
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+        {
+            eol = end;
+        }
+        line++;
+
+        if (eol - p >= WORD_SIZE)
+        {
+            if (this->program_size == MEM_SIZE)
+            {
+                fprintf(stderr, "ROM exceeds %d instructions.\n", MEM_SIZE);
+                return false;
+            }
+
+            uint16_t word;
+            if (!hack_parse_word(p, &word))
+            {
+                fprintf(stderr, "Invalid instruction on line %d.\n", line);
+                return false;
+            }
+
+            this->rom[this->program_size++] = word;
+        }
+        else if (!hack_is_blank(p, eol))
+        {
+            fprintf(stderr, "Invalid instruction on line %d.\n", line);
+            return false;
+        }
+
+        p = eol + 1;
+    }
+
+    return true;
+}
+
+bool hack_load_rom(Hack *this, const char *filepath)
+{
+    if (strlen(filepath) > FILENAME_MAX)
+    {
+        fprintf(stderr, "Unable to open ROM because filename"
+                        " exceeds %d characters.\n",
+                FILENAME_MAX);
+        return false;
+    }
+
+    size_t size;
+    const char *data = hack_map_file(filepath, &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    /* A Hack ROM is either packed binary, recognized by its header, or an
+     * ASCII file with one instruction per line.
+     */
+    bool loaded;
+    if (size >= HACK_ROM_HEADER_SIZE &&
+        memcmp(data, HACK_ROM_MAGIC, strlen(HACK_ROM_MAGIC)) == 0)
+    {
+        loaded = hack_load_binary(this, data, size);
+    }
+    else
+    {
+        loaded = hack_load_ascii(this, data, size);
+    }
+
+    hack_unmap_file(data, size);
+
+    hack_decode_rom(this);
+    return loaded;
+}
+
+bool hack_save_rom(const Hack *this, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    fputs(HACK_ROM_MAGIC, fp);
+    hack_write_word(fp, HACK_ROM_VERSION);
+    hack_write_word(fp, this->program_size);
+
+    for (int i = 0; i < this->program_size; i++)
+    {
+        hack_write_word(fp, this->rom[i]);
+    }
+
+    const bool written = !ferror(fp);
+    if (fclose(fp) != 0 || !written)
+    {
+        fprintf(stderr, "Unable to write %s\n", filepath);
+        return false;
+    }
+    return true;
+}
+
+struct HackSnapshot
+{
+    const Hack *image; // The captured machine, read-only once captured
+    size_t size; // Bytes allocated for the image
+    int fd;      // Anonymous file holding the image for forks to map, or -1
+};
+
+#if HACK_COW_SNAPSHOTS
+// Writes a whole buffer to the start of a file
+static bool hack_write_all(int fd, const void *data, size_t size)
+{
+    const char *bytes = data;
+    size_t written = 0;
+    while (written < size)
+    {
+        const ssize_t n = pwrite(fd, bytes + written, size - written, written);
+        if (n <= 0)
+        {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+#endif
+
+// Bytes to allocate for a machine so that it can be mapped from a file
+static size_t hack_image_size(void)
+{
+#if HACK_COW_SNAPSHOTS
+    const size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(Hack) + page - 1) / page * page;
+#else
+    return sizeof(Hack);
+#endif
+}
+
+HackSnapshot *hack_snapshot(const Hack *this)
+{
+    HackSnapshot *snapshot = malloc(sizeof(HackSnapshot));
+    if (snapshot == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for snapshot.\n");
+        return NULL;
+    }
+
+    snapshot->size = hack_image_size();
+    snapshot->fd = -1;
+    snapshot->image = NULL;
+
+#if HACK_COW_SNAPSHOTS
+    /* Writing the file directly is much cheaper than faulting in a shared
+     * mapping of it page by page.
+     */
+    snapshot->fd = memfd_create("hack-snapshot", MFD_CLOEXEC);
+    if (snapshot->fd >= 0 && ftruncate(snapshot->fd, snapshot->size) == 0 &&
+        hack_write_all(snapshot->fd, this, sizeof(Hack)))
+    {
+        void *image = mmap(NULL, snapshot->size, PROT_READ, MAP_SHARED,
+                           snapshot->fd, 0);
+        snapshot->image = image == MAP_FAILED ? NULL : image;
+    }
+
+    if (snapshot->image != NULL)
+    {
+        return snapshot;
+    }
+
+    // Fall back to a plain copy on the heap
+    if (snapshot->fd >= 0)
+    {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+    }
+#endif
+
+    Hack *image = malloc(snapshot->size);
+    if (image == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for snapshot.\n");
+        free(snapshot);
+        return NULL;
+    }
+
+    memcpy(image, this, sizeof(Hack));
+    snapshot->image = image;
+    return snapshot;
+}
+
+void hack_snapshot_free(HackSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+    {
+        return;
+    }
+
+#if HACK_COW_SNAPSHOTS
+    if (snapshot->fd >= 0)
+    {
+        munmap((void *)snapshot->image, snapshot->size);
+        close(snapshot->fd);
+        free(snapshot);
+        return;
+    }
+#endif
+
+    free((void *)snapshot->image);
+    free(snapshot);
+}
+
+void hack_restore(Hack *this, const HackSnapshot *snapshot)
+{
+    const Hack *image = snapshot->image;
+
+    // Games restore far more often than they change ROM, so check first
+    if (this->program_size != image->program_size ||
+        memcmp(this->rom, image->rom,
+               image->program_size * sizeof(uint16_t)) != 0)
+    {
+        memcpy(this->rom, image->rom, sizeof(this->rom));
+        memcpy(this->ops, image->ops, sizeof(this->ops));
+        this->program_size = image->program_size;
+
+        // The image's ops are threaded for its traps rather than this machine's
+        hack_thread_rom(this, 0, this->program_size);
+    }
+
+    memcpy(this->ram, image->ram, sizeof(this->ram));
+    memset(this->dirty_rows, 1, sizeof(this->dirty_rows));
+    this->io_count = 0;
+    this->pc = image->pc;
+    this->a_reg = image->a_reg;
+    this->d_reg = image->d_reg;
+}
+
+Hack *hack_fork(const HackSnapshot *snapshot)
+{
+#if HACK_COW_SNAPSHOTS
+    if (snapshot->fd >= 0)
+    {
+        void *machine = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, snapshot->fd, 0);
+        if (machine == MAP_FAILED)
+        {
+            fprintf(stderr, "Unable to allocate memory for fork.\n");
+            return NULL;
+        }
+        return machine;
+    }
+#endif
+
+    // Without a file to map, every fork is a full copy
+#if HACK_COW_SNAPSHOTS
+    Hack *machine = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    machine = (void *)machine == MAP_FAILED ? NULL : machine;
+#else
+    Hack *machine = malloc(snapshot->size);
+#endif
+    if (machine == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for fork.\n");
+        return NULL;
+    }
+
+    memcpy(machine, snapshot->image, sizeof(Hack));
+    return machine;
+}
+
+void hack_fork_free(Hack *machine)
+{
+    if (machine == NULL)
+    {
+        return;
+    }
+
+#if HACK_COW_SNAPSHOTS
+    munmap(machine, hack_image_size());
+#else
+    free(machine);
+#endif
+}
+
+bool hack_save_state(const Hack *this, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    fputs(HACK_STATE_MAGIC, fp);
+    hack_write_word(fp, HACK_STATE_VERSION);
+    hack_write_word(fp, this->program_size);
+    hack_write_word(fp, this->pc);
+    hack_write_word(fp, this->a_reg);
+    hack_write_word(fp, this->d_reg);
+
+    for (int i = 0; i < this->program_size; i++)
+    {
+        hack_write_word(fp, this->rom[i]);
+    }
+
+    // Write every run of RAM not interrupted by HACK_STATE_MIN_GAP zeros
+    int i = 0;
+    while (i < MEM_SIZE)
+    {
+        if (this->ram[i] == 0)
+        {
+            i++;
+            continue;
+        }
+
+        int end = i + 1;
+        int zeros = 0;
+        while (end + zeros < MEM_SIZE && zeros < HACK_STATE_MIN_GAP)
+        {
+            if (this->ram[end + zeros] != 0)
+            {
+                end += zeros + 1;
+                zeros = 0;
+            }
+            else
+            {
+                zeros++;
+            }
+        }
+
+        hack_write_word(fp, i);
+        hack_write_word(fp, end - i);
+        for (; i < end; i++)
+        {
+            hack_write_word(fp, this->ram[i]);
+        }
+    }
+    hack_write_word(fp, 0);
+    hack_write_word(fp, 0);
+
+    fclose(fp);
+    return true;
+}
+
+// Restores a machine from a saved state held in memory
+static bool hack_parse_state(Hack *this, const uint8_t *bytes, size_t size)
+{
+    const uint8_t *end = bytes + size;
+
+    if (size < HACK_STATE_HEADER_SIZE)
+    {
+        fprintf(stderr, "Saved state is truncated.\n");
+        return false;
+    }
+
+    const int version = hack_read_word(bytes + 4);
+    const int program_size = hack_read_word(bytes + 6);
+    if (version != HACK_STATE_VERSION)
+    {
+        fprintf(stderr, "Unsupported saved state version %d.\n", version);
+        return false;
+    }
+    if (program_size > MEM_SIZE)
+    {
+        fprintf(stderr, "ROM exceeds %d instructions.\n", MEM_SIZE);
+        return false;
+    }
+
+    hack_init(this);
+    this->program_size = program_size;
+    this->pc = hack_read_word(bytes + 8);
+    this->a_reg = hack_read_word(bytes + 10);
+    this->d_reg = hack_read_word(bytes + 12);
+    bytes += HACK_STATE_HEADER_SIZE;
+
+    if ((size_t)(end - bytes) < 2 * (size_t)program_size)
+    {
+        fprintf(stderr, "Saved state is truncated.\n");
+        return false;
+    }
+    for (int i = 0; i < program_size; i++, bytes += 2)
+    {
+        this->rom[i] = hack_read_word(bytes);
+    }
+
+    for (;;)
+    {
+        if (end - bytes < 4)
+        {
+            fprintf(stderr, "Saved state is truncated.\n");
+            return false;
+        }
+
+        const int start = hack_read_word(bytes);
+        const int count = hack_read_word(bytes + 2);
+        bytes += 4;
+        if (count == 0)
+        {
+            break;
+        }
+
+        if (start + count > MEM_SIZE || end - bytes < 2 * count)
+        {
+            fprintf(stderr, "Saved state has an invalid RAM run.\n");
+            return false;
+        }
+        for (int i = start; i < start + count; i++, bytes += 2)
+        {
+            this->ram[i] = hack_read_word(bytes);
+        }
+    }
+
+    hack_decode_rom(this);
+    return true;
+}
+
+bool hack_load_state(Hack *this, const char *filepath)
+{
+    size_t size;
+    const char *data = hack_map_file(filepath, &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    bool loaded = false;
+    if (size >= strlen(HACK_STATE_MAGIC) &&
+        memcmp(data, HACK_STATE_MAGIC, strlen(HACK_STATE_MAGIC)) == 0)
+    {
+        loaded = hack_parse_state(this, (const uint8_t *)data, size);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not a saved state.\n", filepath);
+    }
+
+    hack_unmap_file(data, size);
+    return loaded;
+}
+
+bool hack_is_state_file(const char *filepath)
+{
+    char magic[sizeof(HACK_STATE_MAGIC)] = {0};
+
+    FILE *fp = fopen(filepath, "rb");
+    if (fp == NULL)
+    {
+        return false;
+    }
+
+    const size_t read = fread(magic, 1, strlen(HACK_STATE_MAGIC), fp);
+    fclose(fp);
+
+    return read == strlen(HACK_STATE_MAGIC) &&
+           memcmp(magic, HACK_STATE_MAGIC, read) == 0;
+}
+
+bool hack_get_stats(const Hack *this, HackStats *stats)
+{
+#ifdef HACK_STATS
+    *stats = this->stats;
+    stats->instructions = stats->a_instructions + stats->c_instructions;
+    return true;
+#else
+    (void)this;
+    memset(stats, 0, sizeof(*stats));
+    return false;
+#endif
+}
+
+// Computations in HACK_ALU_OPS order, with X standing for A or M
+static const char *const HACK_ALU_NAMES[HACK_ALU_LOAD] = {
+    "0",   "1",   "-1",  "D",   "X",   "!D",  "!X",  "-D",  "-X",
+    "D+1", "X+1", "D-1", "X-1", "D+X", "D-X", "X-D", "D&X", "D|X"};
+
+// Names of HACK_REGIONS in saved counters
+static const char *const HACK_REGION_NAMES[HACK_NUM_REGIONS] = {
+    "registers", "static", "stack", "heap", "screen", "keyboard", "devices"};
+
+// Writes counters by region as the members of a JSON object
+static void hack_write_regions(FILE *fp, const char *name,
+                               const uint64_t *counts)
+{
+    fprintf(fp, "  \"%s\": {", name);
+    for (int i = 0; i < HACK_NUM_REGIONS; i++)
+    {
+        fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", HACK_REGION_NAMES[i],
+                (unsigned long long)counts[i]);
+    }
+    fprintf(fp, "},\n");
+}
+
+bool hack_save_stats(const HackStats *stats, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"instructions\": %llu,\n",
+            (unsigned long long)stats->instructions);
+    fprintf(fp, "  \"a_instructions\": %llu,\n",
+            (unsigned long long)stats->a_instructions);
+    fprintf(fp, "  \"c_instructions\": %llu,\n",
+            (unsigned long long)stats->c_instructions);
+    fprintf(fp, "  \"jumps\": {\"taken\": %llu, \"not_taken\": %llu},\n",
+            (unsigned long long)stats->jumps_taken,
+            (unsigned long long)stats->jumps_not_taken);
+    hack_write_regions(fp, "reads", stats->reads);
+    hack_write_regions(fp, "writes", stats->writes);
+
+    /* Computations that ignore X are the same whichever the a bit selects,
+     * so those of M are counted as those of A
+     */
+    uint64_t comps[HACK_STATS_COMPS];
+    memcpy(comps, stats->comps, sizeof(comps));
+    for (int alu = 0; alu < HACK_ALU_LOAD; alu++)
+    {
+        if (strchr(HACK_ALU_NAMES[alu], 'X') == NULL)
+        {
+            comps[alu] += comps[HACK_ALU_LOAD + alu];
+            comps[HACK_ALU_LOAD + alu] = 0;
+        }
+    }
+
+    fprintf(fp, "  \"comps\": {");
+    bool first = true;
+    for (int i = 0; i < HACK_STATS_COMPS; i++)
+    {
+        if (comps[i] == 0)
+        {
+            continue;
+        }
+
+        fprintf(fp, "%s\"", first ? "" : ", ");
+        for (const char *c = HACK_ALU_NAMES[i % HACK_ALU_LOAD]; *c; c++)
+        {
+            fputc(*c != 'X' ? *c : i < HACK_ALU_LOAD ? 'A' : 'M', fp);
+        }
+        fprintf(fp, "\": %llu", (unsigned long long)comps[i]);
+        first = false;
     }
+    fprintf(fp, "}\n}\n");
 
     fclose(fp);
     return true;
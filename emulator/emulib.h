@@ -11,6 +11,28 @@
 #define DISPLAY_WIDTH 512
 #define DISPLAY_HEIGHT 256
 
+// Words in one row of the screen, which is also the granularity of dirty_rows
+#define HACK_ROW_WORDS (DISPLAY_WIDTH / WORD_SIZE)
+
+// Stores to device rows that io_log holds before the oldest are overwritten
+#define HACK_IO_LOG_SIZE 4096
+
+/* Packed binary ROM format: the magic string, a 16-bit version and a 16-bit
+ * instruction count, followed by the instructions. All little-endian.
+ */
+#define HACK_ROM_MAGIC "HACK"
+#define HACK_ROM_VERSION 1
+#define HACK_ROM_HEADER_SIZE 8
+
+/* Saved machine state format: the magic string, a 16-bit version, then the
+ * program size, PC, A and D as 16-bit words and the ROM. RAM follows as runs
+ * of a 16-bit start address, a 16-bit length and that many words, skipping
+ * long stretches of zeros, ended by a run of length 0. All little-endian.
+ */
+#define HACK_STATE_MAGIC "HKST"
+#define HACK_STATE_VERSION 1
+#define HACK_STATE_HEADER_SIZE 14
+
 typedef enum
 {
     HACK_KEY_BACKSPACE = 129,
@@ -28,6 +50,92 @@ typedef enum
     HACK_KEY_F
 } HACK_KEYS;
 
+// Operations the ALU can compute, where X is either the A register or M
+typedef enum
+{
+    HACK_ALU_ZERO,
+    HACK_ALU_ONE,
+    HACK_ALU_NEG_ONE,
+    HACK_ALU_D,
+    HACK_ALU_X,
+    HACK_ALU_NOT_D,
+    HACK_ALU_NOT_X,
+    HACK_ALU_NEG_D,
+    HACK_ALU_NEG_X,
+    HACK_ALU_D_PLUS_ONE,
+    HACK_ALU_X_PLUS_ONE,
+    HACK_ALU_D_MINUS_ONE,
+    HACK_ALU_X_MINUS_ONE,
+    HACK_ALU_D_PLUS_X,
+    HACK_ALU_D_MINUS_X,
+    HACK_ALU_X_MINUS_D,
+    HACK_ALU_D_AND_X,
+    HACK_ALU_D_OR_X,
+    HACK_ALU_LOAD // Not an ALU operation: an A instruction loading a constant
+} HACK_ALU_OPS;
+
+// Destination bits of a C instruction
+#define HACK_DEST_M 0x1
+#define HACK_DEST_D 0x2
+#define HACK_DEST_A 0x4
+
+// Jump bits of a C instruction
+#define HACK_JUMP_GT 0x1
+#define HACK_JUMP_EQ 0x2
+#define HACK_JUMP_LT 0x4
+
+/* An instruction decoded ahead of time so that executing it does not need to
+ * pick apart the instruction bits again.
+ */
+typedef struct HackOp
+{
+    uint8_t alu;   // One of HACK_ALU_OPS
+    uint8_t dest;  // Mask of HACK_DEST_* bits
+    uint8_t jump;  // Mask of HACK_JUMP_* bits
+    uint8_t src_m; // Whether X is M (true) or the A register (false)
+    uint16_t thread; // Handler used by the threaded code engine (hack_run)
+} HackOp;
+
+/* Regions of RAM told apart by the performance counters, in the layout the
+ * Hack VM and OS use. Addresses from KEYBD_ADDR + 1 up belong to devices.
+ */
+#define HACK_STATIC_ADDR 16
+#define HACK_STACK_ADDR 256
+#define HACK_HEAP_ADDR 2048
+
+typedef enum
+{
+    HACK_REGION_REGISTERS, // R0 to R15
+    HACK_REGION_STATIC,
+    HACK_REGION_STACK,
+    HACK_REGION_HEAP,
+    HACK_REGION_SCREEN,
+    HACK_REGION_KEYBOARD,
+    HACK_REGION_DEVICES,
+    HACK_NUM_REGIONS
+} HACK_REGIONS;
+
+// Entries of the computation histogram: every ALU operation of A, then of M
+#define HACK_STATS_COMPS (2 * HACK_ALU_LOAD)
+
+/* Performance counters, only kept by hack_execute and only when built with
+ * HACK_STATS defined, so that other builds pay nothing for them
+ */
+typedef struct HackStats
+{
+    uint64_t instructions; // Retired, both A and C instructions
+    uint64_t a_instructions, c_instructions;
+
+    // C instructions with jump bits, by whether they jumped
+    uint64_t jumps_taken, jumps_not_taken;
+
+    // Loads from M and stores to M, by HACK_REGIONS of the address
+    uint64_t reads[HACK_NUM_REGIONS], writes[HACK_NUM_REGIONS];
+
+    // C instructions by computation, at alu + src_m * HACK_ALU_LOAD
+    uint64_t comps[HACK_STATS_COMPS];
+} HackStats;
+
 /* Hack is a 16-bit computer.
  * Therefore, the smallest piece of addressable memory is not a byte but a
  * 16-bit word because the Hack platform offers no other means of addressing
@@ -45,28 +153,197 @@ typedef struct Hack
     uint16_t rom[MEM_SIZE];
     int program_size;
 
+    /* The ROM decoded one instruction at a time by hack_decode_rom, plus one
+     * entry to catch execution running off the end of a full ROM.
+     */
+    HackOp ops[MEM_SIZE + 1];
+
     // Random-access memory
     int16_t ram[MEM_SIZE];
 
+    /* One flag per HACK_ROW_WORDS words of RAM, set whenever the CPU stores
+     * to any of them. Rows of the screen start at SCREEN_ADDR / HACK_ROW_WORDS.
+     * Nothing ever clears a flag except whoever consumes them, such as the
+     * display, so that it only has to redraw rows that actually changed.
+     */
+    uint8_t dirty_rows[MEM_SIZE / HACK_ROW_WORDS];
+
+    /* One flag per HACK_ROW_WORDS words of RAM, like dirty_rows, set for the
+     * rows devices are mapped into. Stores the CPU makes to those rows are
+     * appended to io_log as their address << 16 | value for the bus to pass
+     * on, see bus.h. Ordinary stores only test their row's flag.
+     */
+    uint8_t io_rows[MEM_SIZE / HACK_ROW_WORDS];
+    uint32_t io_count; // Stores kept since io_log was last drained
+    uint32_t io_log[HACK_IO_LOG_SIZE];
+
+    /* Traps hack_run stops at, set with hack_set_breakpoint and
+     * hack_set_watchpoint. They are patched into the handlers of ops rather
+     * than checked as instructions run, so a machine without any runs exactly
+     * as fast as before.
+     */
+    uint8_t breakpoints[MEM_SIZE / 8]; // One bit per ROM address
+    uint8_t watch_rows[MEM_SIZE / HACK_ROW_WORDS]; // Words watched per row
+    int num_watches;
+
     // A (address), D, and program counter CPU registers
     uint16_t pc;
     int16_t a_reg, d_reg;
+
+#ifdef HACK_STATS
+    HackStats stats; // Counted since hack_init, see hack_get_stats
+#endif
 } Hack;
 
+// Most instructions hack_find_idle_loop follows looking for a loop
+#define HACK_IDLE_MAX_STEPS 2048
+
+// Most words a loop may store to and still be found idle
+#define HACK_IDLE_MAX_STORES 32
+
+// Most addresses an idle loop may poll
+#define HACK_IDLE_MAX_READS 4
+
+// A loop that changes nothing, found by hack_find_idle_loop
+typedef struct HackIdleLoop
+{
+    int length; // Instructions per iteration
+    int num_reads;
+    uint16_t reads[HACK_IDLE_MAX_READS]; // Addresses polled
+} HackIdleLoop;
+
+/* A frozen copy of a machine to restore or fork machines from
+ * Machines forked from a snapshot share its memory copy-on-write, so the ROM
+ * and decoded instructions exist only once no matter how many forks there are.
+ */
+typedef struct HackSnapshot HackSnapshot;
+
 // Gets an x and y coordinate from a screen address
 void hack_get_coords(int *x, int *y, uint16_t addr);
 
 // Initialize the machine
 void hack_init(Hack *this);
 
+// Decode a single instruction
+HackOp hack_decode(uint16_t instruction);
+
+/* Decode the entire ROM ahead of execution
+ * Must be called again whenever the ROM is modified other than through
+ * hack_load_rom.
+ */
+void hack_decode_rom(Hack *this);
+
 // Execute the instruction located by the program counter
 void hack_execute(Hack *this);
 
+/* Execute up to 'cycles' instructions using direct-threaded code, stopping
+ * early once the program counter leaves the program or reaches a trap (see
+ * hack_set_breakpoint and hack_set_watchpoint).
+ * Behaves exactly like calling hack_execute repeatedly, only much faster.
+ * The pushes, pops and comparisons hackvm emits are each run by a single
+ * handler, fused by hack_decode_rom.
+ * Returns the number of instructions executed.
+ */
+long hack_run(Hack *this, long cycles);
+
+/* Make hack_run stop before executing the instruction at 'addr' (set true),
+ * or no longer (set false)
+ * Other engines, hack_execute included, never stop at breakpoints, which is
+ * how a debugger steps past the one it stopped at.
+ * Returns false if the address is outside the program.
+ */
+bool hack_set_breakpoint(Hack *this, uint16_t addr, bool set);
+
+// Checks if hack_run stops before executing the instruction at 'addr'
+bool hack_is_breakpoint(const Hack *this, uint16_t addr);
+
+/* Make hack_run stop before executing any instruction that stores to the row
+ * of HACK_ROW_WORDS words 'addr' belongs to (set true), or undo that once
+ * (set false)
+ * A row stays watched until every address watched in it is unwatched, and
+ * which of its words are actually of interest is up to the caller to check.
+ * While anything is watched, every instruction storing to RAM runs a little
+ * slower and the stores hackvm emits are no longer fused.
+ */
+void hack_set_watchpoint(Hack *this, uint16_t addr, bool set);
+
+/* Checks if the machine is stuck in a loop it can never leave, such as the
+ * '(END) @END 0;JMP' that ends most programs.
+ */
+bool hack_is_halted(const Hack *this);
+
+/* Checks if the machine is in a loop that changes nothing, such as one
+ * polling the keyboard: from its current state it comes back to the same
+ * registers and RAM within HACK_IDLE_MAX_STEPS instructions. Such a loop runs
+ * forever unless something other than the CPU changes what it reads, so the
+ * addresses it reads that could change that way (the keyboard and rows
+ * devices are mapped into) are kept in 'loop'.
+ * Returns false if it is not in such a loop, if the loop stores to more than
+ * HACK_IDLE_MAX_STORES words or to devices, or reads more than
+ * HACK_IDLE_MAX_READS addresses that could change. Following the loop takes
+ * far longer than executing it, so this should not be called too often.
+ */
+bool hack_find_idle_loop(const Hack *this, HackIdleLoop *loop);
+
 /* Load a file into the machine's ROM
- * Returns false if unable to open file
+ * Accepts both ASCII and packed binary ROMs.
+ * Returns false if unable to open file or if it is not a valid ROM
  */
 bool hack_load_rom(Hack *this, const char *filepath);
 
+/* Save the machine's ROM as a packed binary ROM
+ * Returns false if unable to open file
+ */
+bool hack_save_rom(const Hack *this, const char *filepath);
+
+/* Capture the complete state of a machine
+ * Returns NULL if unable to allocate memory.
+ */
+HackSnapshot *hack_snapshot(const Hack *this);
+
+// Free a snapshot, which must outlive nothing forked from it
+void hack_snapshot_free(HackSnapshot *snapshot);
+
+/* Put a machine back into the state captured by a snapshot
+ * The ROM is only copied if it differs from the machine's, in which case any
+ * JIT running the machine must be flushed. Breakpoints and watchpoints are
+ * the machine's own and outlast the restore.
+ */
+void hack_restore(Hack *this, const HackSnapshot *snapshot);
+
+/* Create a new machine in the state captured by a snapshot
+ * Only the pages of RAM the new machine writes to are ever copied.
+ * Returns NULL if unable to allocate memory.
+ */
+Hack *hack_fork(const HackSnapshot *snapshot);
+
+// Free a machine created by hack_fork
+void hack_fork_free(Hack *machine);
+
+/* Save the complete state of a machine to a file
+ * Returns false if unable to open file
+ */
+bool hack_save_state(const Hack *this, const char *filepath);
+
+/* Load a state saved by hack_save_state, replacing the whole machine
+ * Returns false if unable to open file or if it is not a valid state
+ */
+bool hack_load_state(Hack *this, const char *filepath);
+
+// Checks if a file starts like a state saved by hack_save_state
+bool hack_is_state_file(const char *filepath);
+
+/* Get the performance counters hack_execute kept since the machine was
+ * initialized
+ * Returns false, zeroing 'stats', if they were not built in (see HackStats).
+ */
+bool hack_get_stats(const Hack *this, HackStats *stats);
+
+/* Save performance counters as a JSON object
+ * Returns false if unable to open file
+ */
+bool hack_save_stats(const HackStats *stats, const char *filepath);
+
 // Prints the contents of the machine's ROM one instruction per line
 void hack_print_rom(const Hack *this);
 
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <string.h>
+#include "engine.h"
+
+bool parse_engine(const char *name, ENGINES *engine)
+{
+    if (strcmp(name, "step") == 0)
+    {
+        *engine = ENGINE_STEP;
+    }
+    else if (strcmp(name, "thread") == 0)
+    {
+        *engine = ENGINE_THREAD;
+    }
+    else if (strcmp(name, "jit") == 0)
+    {
+        *engine = ENGINE_JIT;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown engine: %s\n", name);
+        return false;
+    }
+
+    return true;
+}
+
+bool load_machine(Hack *machine, const char *filepath)
+{
+    if (hack_is_state_file(filepath))
+    {
+        return hack_load_state(machine, filepath);
+    }
+
+    return hack_load_rom(machine, filepath);
+}
+
+long run_engine(Hack *machine, HackJit *jit, ENGINES engine, long cycles)
+{
+    switch (engine)
+    {
+    case ENGINE_STEP:
+    {
+        long executed = 0;
+        while (executed < cycles && machine->pc < machine->program_size)
+        {
+            hack_execute(machine);
+            executed++;
+        }
+        return executed;
+    }
+    case ENGINE_THREAD:
+        return hack_run(machine, cycles);
+    case ENGINE_JIT:
+    default:
+        return hack_jit_run(jit, machine, cycles);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "emulib.h"
+#include "emujit.h"
+
+// Ways of executing a machine, all with the same results
+typedef enum
+{
+    ENGINE_STEP,   // hack_execute, one instruction at a time
+    ENGINE_THREAD, // hack_run
+    ENGINE_JIT     // hack_jit_run
+} ENGINES;
+
+/* Parses an engine name: step, thread or jit
+ * Returns false (and prints why) if it is not one.
+ */
+bool parse_engine(const char *name, ENGINES *engine);
+
+/* Loads a ROM, or a state saved by hack_save_state, into the machine
+ * Returns false (and prints why) if unable to.
+ */
+bool load_machine(Hack *machine, const char *filepath);
+
+/* Runs the machine for up to 'cycles' instructions on the given engine
+ * 'jit' is only used by ENGINE_JIT.
+ * Returns the number of instructions executed.
+ */
+long run_engine(Hack *machine, HackJit *jit, ENGINES engine, long cycles);
+
+#endif
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "engine.h"
+
+// Instructions executed between checks for a halted machine
+#define SLICE_CYCLES (1L << 20)
+
+// Most threads that can be asked for
+#define MAX_THREADS 256
+
+// Characters separating the words of a job file
+#define JOB_DELIM " \t\r\n"
+
+typedef enum
+{
+    JOB_HALTED,
+    JOB_FINISHED,
+    JOB_STOPPED
+} JOB_STATUSES;
+
+// The keyboard reads 'key' from instruction 'cycle' of a run on
+typedef struct KeyEvent
+{
+    long cycle;
+    int16_t key;
+} KeyEvent;
+
+// A RAM register set before a run starts
+typedef struct RamWrite
+{
+    uint16_t addr;
+    int16_t value;
+} RamWrite;
+
+// A RAM register whose value differs at the end of a run
+typedef struct RamDiff
+{
+    uint16_t addr;
+    int16_t before, after;
+} RamDiff;
+
+// A dynamically sized array of elements of any one type
+typedef struct Array
+{
+    void *data;
+    int count, capacity;
+} Array;
+
+// One run of the ROM, read from a job file
+typedef struct Job
+{
+    const char *path;
+    Array writes; // RamWrite
+    Array keys;   // KeyEvent, by increasing cycle
+
+    // Filled in by whichever worker runs the job
+    JOB_STATUSES status;
+    long cycles;
+    uint16_t pc;
+    Array diffs; // RamDiff, by increasing address
+} Job;
+
+/* Indices of jobs a worker has yet to run.
+ * The worker takes from the tail while idle workers steal from the head, so
+ * an owner and a thief rarely want the same job.
+ */
+typedef struct Deque
+{
+    pthread_mutex_t lock;
+    int *jobs;
+    int head, tail;
+} Deque;
+
+// Everything the workers share
+typedef struct Pool
+{
+    const HackSnapshot *base; // The loaded machine, restored for each job
+    Job *jobs;
+    Deque *deques;
+    int num_workers;
+    ENGINES engine;
+    long max_cycles;
+} Pool;
+
+typedef struct Worker
+{
+    Pool *pool;
+    int id;
+    pthread_t thread;
+    bool ok;
+} Worker;
+
+// Prints usage information
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./hackbatch [options] <rom-or-state> <job-file>...\n"
+            "  -c <cycles>      Stop each run after this many instructions\n"
+            "  -e <engine>      Execution engine: step, thread or jit"
+            " (default jit)\n"
+            "  -j <threads>     Worker threads (default one per core)\n"
+            "\n"
+            "Each line of a job file is one of:\n"
+            "  ram <addr> <value>...   Set RAM from addr on before the run\n"
+            "  key <cycle> <code>      Have the keyboard read code from that"
+            " instruction on\n"
+            "Lines starting with # are ignored.\n");
+}
+
+// Appends an element to an array, returning false if out of memory
+bool array_push(Array *array, const void *element, size_t size)
+{
+    if (array->count == array->capacity)
+    {
+        const int capacity = array->capacity ? array->capacity * 2 : 16;
+        void *data = realloc(array->data, capacity * size);
+        if (data == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory.\n");
+            return false;
+        }
+        array->data = data;
+        array->capacity = capacity;
+    }
+
+    memcpy((char *)array->data + array->count * size, element, size);
+    array->count++;
+    return true;
+}
+
+// Parses a whole number, returning false if 'str' is anything else
+bool parse_long(const char *str, long *value)
+{
+    char *end;
+    if (str == NULL)
+    {
+        return false;
+    }
+    *value = strtol(str, &end, 0);
+    return end != str && *end == '\0';
+}
+
+// Reads a job file, returning false (and printing why) if it is invalid
+bool read_job(Job *job)
+{
+    FILE *fp = fopen(job->path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", job->path);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    int line_num = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &size, fp) != -1)
+    {
+        line_num++;
+
+        char *save;
+        const char *cmd = strtok_r(line, JOB_DELIM, &save);
+        if (cmd == NULL || cmd[0] == '#')
+        {
+            continue;
+        }
+
+        long a, b = 0;
+        if (strcmp(cmd, "ram") == 0 &&
+            parse_long(strtok_r(NULL, JOB_DELIM, &save), &a))
+        {
+            const char *value = strtok_r(NULL, JOB_DELIM, &save);
+            ok = value != NULL;
+            for (; ok && value != NULL;
+                 value = strtok_r(NULL, JOB_DELIM, &save), a++)
+            {
+                // Values are words, written signed or unsigned
+                ok = a >= 0 && a < MEM_SIZE && parse_long(value, &b) &&
+                     b >= INT16_MIN && b <= UINT16_MAX;
+
+                const RamWrite write = {a, b};
+                ok = ok && array_push(&job->writes, &write, sizeof(write));
+            }
+        }
+        else if (strcmp(cmd, "key") == 0 &&
+                 parse_long(strtok_r(NULL, JOB_DELIM, &save), &a) &&
+                 parse_long(strtok_r(NULL, JOB_DELIM, &save), &b) &&
+                 strtok_r(NULL, JOB_DELIM, &save) == NULL)
+        {
+            const KeyEvent *keys = job->keys.data;
+            const KeyEvent event = {a, b};
+            ok = a >= 0 &&
+                 (job->keys.count == 0 ||
+                  a >= keys[job->keys.count - 1].cycle) &&
+                 array_push(&job->keys, &event, sizeof(event));
+        }
+        else
+        {
+            ok = false;
+        }
+
+        if (!ok)
+        {
+            fprintf(stderr, "%s: invalid line %d.\n", job->path, line_num);
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    return ok;
+}
+
+/* Runs a job on the worker's machine
+ * 'initial' is scratch space for the RAM as it was when the run started.
+ */
+bool run_job(const Pool *pool, Job *job, Hack *machine, HackJit *jit,
+             int16_t *initial)
+{
+    hack_restore(machine, pool->base);
+
+    const RamWrite *writes = job->writes.data;
+    for (int i = 0; i < job->writes.count; i++)
+    {
+        machine->ram[writes[i].addr] = writes[i].value;
+    }
+    memcpy(initial, machine->ram, sizeof(machine->ram));
+
+    // Run in slices that end at every key event, checking if the run is done
+    const KeyEvent *keys = job->keys.data;
+    int next_key = 0;
+    long cycles = 0;
+    bool halted = false;
+    while (!halted && machine->pc < machine->program_size &&
+           (pool->max_cycles < 0 || cycles < pool->max_cycles))
+    {
+        while (next_key < job->keys.count && keys[next_key].cycle <= cycles)
+        {
+            machine->ram[KEYBD_ADDR] = keys[next_key++].key;
+        }
+
+        long slice = SLICE_CYCLES;
+        if (pool->max_cycles >= 0 && pool->max_cycles - cycles < slice)
+        {
+            slice = pool->max_cycles - cycles;
+        }
+        if (next_key < job->keys.count && keys[next_key].cycle - cycles < slice)
+        {
+            slice = keys[next_key].cycle - cycles;
+        }
+
+        cycles += run_engine(machine, jit, pool->engine, slice);
+
+        // Polling the keyboard only ends the run once no keys are left
+        HackIdleLoop loop;
+        halted = hack_is_halted(machine) ||
+                 (hack_find_idle_loop(machine, &loop) &&
+                  (loop.num_reads == 0 || next_key == job->keys.count));
+    }
+
+    if (halted)
+    {
+        job->status = JOB_HALTED;
+    }
+    else if (machine->pc >= machine->program_size)
+    {
+        job->status = JOB_FINISHED;
+    }
+    else
+    {
+        job->status = JOB_STOPPED;
+    }
+    job->cycles = cycles;
+    job->pc = machine->pc;
+
+    for (int i = 0; i < MEM_SIZE; i++)
+    {
+        const RamDiff diff = {i, initial[i], machine->ram[i]};
+        if (diff.before != diff.after &&
+            !array_push(&job->diffs, &diff, sizeof(diff)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Takes the newest job of a worker's own deque, or -1 if it is empty
+int deque_pop(Deque *this)
+{
+    pthread_mutex_lock(&this->lock);
+    const int job = this->head < this->tail ? this->jobs[--this->tail] : -1;
+    pthread_mutex_unlock(&this->lock);
+    return job;
+}
+
+// Takes the oldest job of another worker's deque, or -1 if it is empty
+int deque_steal(Deque *this)
+{
+    pthread_mutex_lock(&this->lock);
+    const int job = this->head < this->tail ? this->jobs[this->head++] : -1;
+    pthread_mutex_unlock(&this->lock);
+    return job;
+}
+
+/* Runs jobs until there are none left anywhere
+ * No job is ever added once the workers start, so finding every deque empty
+ * means the worker is done.
+ */
+void *run_worker(void *data)
+{
+    Worker *worker = data;
+    Pool *pool = worker->pool;
+
+    Hack *machine = hack_fork(pool->base);
+    int16_t *initial = malloc(MEM_SIZE * sizeof(int16_t));
+    HackJit *jit = pool->engine == ENGINE_JIT ? hack_jit_create() : NULL;
+    worker->ok = machine != NULL && initial != NULL &&
+                 (pool->engine != ENGINE_JIT || jit != NULL);
+    if (!worker->ok)
+    {
+        fprintf(stderr, "Unable to allocate memory for worker %d.\n",
+                worker->id);
+    }
+
+    while (worker->ok)
+    {
+        int job = deque_pop(&pool->deques[worker->id]);
+        for (int i = 1; job < 0 && i < pool->num_workers; i++)
+        {
+            job = deque_steal(
+                &pool->deques[(worker->id + i) % pool->num_workers]);
+        }
+        if (job < 0)
+        {
+            break;
+        }
+
+        worker->ok = run_job(pool, &pool->jobs[job], machine, jit, initial);
+    }
+
+    hack_jit_destroy(jit);
+    free(initial);
+    hack_fork_free(machine);
+    return NULL;
+}
+
+// Prints the outcome of a job
+void print_job(const Job *job)
+{
+    static const char *const statuses[] = {
+        [JOB_HALTED] = "halted",
+        [JOB_FINISHED] = "finished",
+        [JOB_STOPPED] = "stopped",
+    };
+
+    printf("%s: %s after %ld cycles at %d, %d registers changed\n", job->path,
+           statuses[job->status], job->cycles, job->pc, job->diffs.count);
+
+    const RamDiff *diffs = job->diffs.data;
+    for (int i = 0; i < job->diffs.count; i++)
+    {
+        printf("  %d: %d -> %d\n", diffs[i].addr, diffs[i].before,
+               diffs[i].after);
+    }
+}
+
+// Gets the current time in seconds
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    Pool pool = {.engine = ENGINE_JIT, .max_cycles = -1};
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1)
+    {
+        num_workers = 1;
+    }
+    else if (num_workers > MAX_THREADS)
+    {
+        num_workers = MAX_THREADS;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:e:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            pool.max_cycles = strtol(optarg, NULL, 0);
+            break;
+        case 'e':
+            if (!parse_engine(optarg, &pool.engine))
+            {
+                return 1;
+            }
+            break;
+        case 'j':
+            if (!parse_long(optarg, &num_workers) || num_workers < 1 ||
+                num_workers > MAX_THREADS)
+            {
+                fprintf(stderr, "Threads must be between 1 and %d.\n",
+                        MAX_THREADS);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    static Hack machine;
+    hack_init(&machine);
+    if (!load_machine(&machine, argv[optind]))
+    {
+        return 1;
+    }
+
+    HackSnapshot *base = hack_snapshot(&machine);
+    if (base == NULL)
+    {
+        return 1;
+    }
+
+    const int num_jobs = argc - optind - 1;
+    Job *jobs = calloc(num_jobs, sizeof(Job));
+    if (jobs == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory.\n");
+        return 1;
+    }
+    for (int i = 0; i < num_jobs; i++)
+    {
+        jobs[i].path = argv[optind + 1 + i];
+        if (!read_job(&jobs[i]))
+        {
+            return 1;
+        }
+    }
+
+    if (num_workers > num_jobs)
+    {
+        num_workers = num_jobs;
+    }
+
+    pool.base = base;
+    pool.jobs = jobs;
+    pool.num_workers = num_workers;
+    pool.deques = calloc(num_workers, sizeof(Deque));
+    Worker *workers = calloc(num_workers, sizeof(Worker));
+    if (pool.deques == NULL || workers == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory.\n");
+        return 1;
+    }
+
+    // Deal the jobs out in contiguous blocks, leaving the balancing to stealing
+    for (int i = 0; i < num_workers; i++)
+    {
+        Deque *deque = &pool.deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs = malloc(num_jobs * sizeof(int));
+        if (deque->jobs == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory.\n");
+            return 1;
+        }
+
+        for (int job = num_jobs * i / num_workers;
+             job < num_jobs * (i + 1) / num_workers; job++)
+        {
+            deque->jobs[deque->tail++] = job;
+        }
+    }
+
+    const double start = now();
+    int started = 0;
+    for (; started < num_workers; started++)
+    {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        if (pthread_create(&workers[started].thread, NULL, run_worker,
+                           &workers[started]) != 0)
+        {
+            fprintf(stderr, "Unable to create worker thread.\n");
+            break;
+        }
+    }
+
+    bool ok = started == num_workers;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        ok = ok && workers[i].ok;
+    }
+    const double elapsed = now() - start;
+
+    if (!ok)
+    {
+        return 1;
+    }
+
+    long total = 0;
+    for (int i = 0; i < num_jobs; i++)
+    {
+        print_job(&jobs[i]);
+        total += jobs[i].cycles;
+    }
+
+    fprintf(stderr, "%d jobs, %ld instructions in %.3fs on %ld threads\n",
+            num_jobs, total, elapsed, num_workers);
+
+    return 0;
+}
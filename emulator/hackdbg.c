@@ -0,0 +1,863 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "engine.h"
+
+// Instructions executed between checks for a halted machine
+#define SLICE_CYCLES (1L << 20)
+
+// Maximum number of breakpoints and watchpoints together
+#define MAX_TRAPS 64
+
+// Longest command line and label read
+#define MAX_LINE 256
+#define MAX_LABEL 64
+
+// Registers the Hack VM gives names to, in RAM
+static const char *const REGISTER_NAMES[] = {"SP", "LCL", "ARG", "THIS",
+                                             "THAT"};
+
+// A label from a symbol map
+typedef struct Label
+{
+    uint16_t addr;
+    char name[MAX_LABEL];
+} Label;
+
+// What an operand of a condition reads
+typedef enum
+{
+    OPERAND_CONST,
+    OPERAND_A,
+    OPERAND_D,
+    OPERAND_M,
+    OPERAND_PC,
+    OPERAND_RAM
+} OPERANDS;
+
+typedef struct Operand
+{
+    OPERANDS type;
+    int value; // The constant, or the address for OPERAND_RAM
+} Operand;
+
+typedef enum
+{
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE
+} COMPARES;
+
+static const char *const COMPARE_NAMES[] = {"==", "!=", "<", "<=", ">",
+                                            ">="};
+
+// A condition such as 'D == 5' or 'RAM[256] > M'
+typedef struct Condition
+{
+    bool set; // Whether there is one, otherwise it always holds
+    Operand left, right;
+    COMPARES compare;
+} Condition;
+
+// A breakpoint on a ROM address or a watchpoint on a RAM address
+typedef struct Trap
+{
+    bool used;
+    bool watch;
+    uint16_t addr;
+    Condition condition;
+    long hits;
+} Trap;
+
+typedef struct Debugger
+{
+    Hack *machine;
+    long cycles; // Instructions executed since the program was loaded
+
+    Label *labels; // Sorted by address
+    int num_labels;
+
+    Trap traps[MAX_TRAPS];
+} Debugger;
+
+// Prints usage information
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./hackdbg [options] <rom-or-state>\n"
+            "  -s <file.sym>    Use the labels in a symbol map\n");
+}
+
+// Prints the commands understood
+void help(void)
+{
+    printf("break <addr> [if <cond>]  Stop before executing a ROM address\n"
+           "watch <addr> [if <cond>]  Stop after storing to a RAM address\n"
+           "delete <n>                Delete a breakpoint or watchpoint\n"
+           "info                      List breakpoints and watchpoints\n"
+           "continue [<cycles>]       Run until a trap, the end or a limit\n"
+           "step [<n>]                Execute n instructions (default 1)\n"
+           "regs                      Print the registers\n"
+           "print <start>[:<end>]     Print RAM from start to end\n"
+           "set <reg-or-addr> <value> Change A, D, PC or a RAM address\n"
+           "quit                      Exit\n"
+           "ROM addresses may be labels, RAM addresses R0-R15, SP, LCL, ARG,"
+           " THIS,\nTHAT, SCREEN or KBD. Conditions compare two of A, D, M,"
+           " PC, RAM[<addr>]\nor a number with ==, !=, <, <=, > or >=.\n");
+}
+
+// Orders labels by address
+int compare_labels(const void *a, const void *b)
+{
+    return ((const Label *)a)->addr - ((const Label *)b)->addr;
+}
+
+/* Reads the labels of a symbol map written by hackasm
+ * Returns false (and prints why) if unable to.
+ */
+bool load_labels(Debugger *this, const char *sym_path)
+{
+    FILE *fp = fopen(sym_path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", sym_path);
+        return false;
+    }
+
+    int max_labels = 0;
+    int addr;
+    char name[MAX_LABEL];
+    while (fscanf(fp, "%d %63s", &addr, name) == 2)
+    {
+        if (addr < 0 || addr >= MEM_SIZE)
+        {
+            fprintf(stderr, "Invalid address %d in %s\n", addr, sym_path);
+            fclose(fp);
+            return false;
+        }
+
+        if (this->num_labels == max_labels)
+        {
+            max_labels = max_labels ? max_labels * 2 : 256;
+            Label *labels = realloc(this->labels, max_labels * sizeof(Label));
+            if (labels == NULL)
+            {
+                fprintf(stderr, "Unable to allocate memory for symbols.\n");
+                fclose(fp);
+                return false;
+            }
+            this->labels = labels;
+        }
+
+        Label *label = &this->labels[this->num_labels++];
+        label->addr = addr;
+        strcpy(label->name, name);
+    }
+
+    const bool valid = feof(fp);
+    fclose(fp);
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid symbol map: %s\n", sym_path);
+        return false;
+    }
+
+    qsort(this->labels, this->num_labels, sizeof(Label), compare_labels);
+    return true;
+}
+
+// Finds the nearest label at or before a ROM address, NULL if there is none
+const Label *find_label(const Debugger *this, uint16_t addr)
+{
+    const Label *found = NULL;
+    for (int i = 0; i < this->num_labels && this->labels[i].addr <= addr; i++)
+    {
+        found = &this->labels[i];
+    }
+
+    return found;
+}
+
+// Prints a ROM address along with the label it falls under
+void print_rom_addr(const Debugger *this, uint16_t addr)
+{
+    const Label *label = find_label(this, addr);
+    if (label == NULL)
+    {
+        printf("%d", addr);
+    }
+    else if (label->addr == addr)
+    {
+        printf("%d (%s)", addr, label->name);
+    }
+    else
+    {
+        printf("%d (%s+%d)", addr, label->name, addr - label->addr);
+    }
+}
+
+// Parses a ROM address or label
+bool parse_rom_addr(const Debugger *this, const char *str, uint16_t *addr)
+{
+    for (int i = 0; i < this->num_labels; i++)
+    {
+        if (strcmp(this->labels[i].name, str) == 0)
+        {
+            *addr = this->labels[i].addr;
+            return true;
+        }
+    }
+
+    char *end;
+    const long value = strtol(str, &end, 0);
+    if (*str == '\0' || *end != '\0' || value < 0 || value >= MEM_SIZE)
+    {
+        printf("Invalid ROM address: %s\n", str);
+        return false;
+    }
+
+    *addr = value;
+    return true;
+}
+
+// Parses a RAM address or one of the names the Hack platform gives them
+bool parse_ram_addr(const char *str, uint16_t *addr)
+{
+    const int num_names = sizeof(REGISTER_NAMES) / sizeof(REGISTER_NAMES[0]);
+    for (int i = 0; i < num_names; i++)
+    {
+        if (strcmp(REGISTER_NAMES[i], str) == 0)
+        {
+            *addr = i;
+            return true;
+        }
+    }
+
+    char *end;
+    long value;
+    if (strcmp(str, "SCREEN") == 0)
+    {
+        value = SCREEN_ADDR;
+    }
+    else if (strcmp(str, "KBD") == 0)
+    {
+        value = KEYBD_ADDR;
+    }
+    else if (str[0] == 'R' && isdigit((unsigned char)str[1]))
+    {
+        value = strtol(str + 1, &end, 10);
+        value = *end == '\0' && value < 16 ? value : -1;
+    }
+    else
+    {
+        value = strtol(str, &end, 0);
+        value = *str != '\0' && *end == '\0' ? value : -1;
+    }
+
+    if (value < 0 || value >= MEM_SIZE)
+    {
+        printf("Invalid RAM address: %s\n", str);
+        return false;
+    }
+
+    *addr = value;
+    return true;
+}
+
+// Parses an operand of a condition
+bool parse_operand(const char *str, Operand *operand)
+{
+    static const char *const names[] = {
+        [OPERAND_A] = "A", [OPERAND_D] = "D", [OPERAND_M] = "M",
+        [OPERAND_PC] = "PC"};
+
+    for (int i = OPERAND_A; i <= OPERAND_PC; i++)
+    {
+        if (strcmp(names[i], str) == 0)
+        {
+            operand->type = i;
+            return true;
+        }
+    }
+
+    const size_t len = strlen(str);
+    if (strncmp(str, "RAM[", 4) == 0 && len > 5 && str[len - 1] == ']')
+    {
+        char addr[MAX_LINE];
+        snprintf(addr, sizeof(addr), "%.*s", (int)(len - 5), str + 4);
+
+        uint16_t value;
+        if (!parse_ram_addr(addr, &value))
+        {
+            return false;
+        }
+        operand->type = OPERAND_RAM;
+        operand->value = value;
+        return true;
+    }
+
+    char *end;
+    operand->type = OPERAND_CONST;
+    operand->value = strtol(str, &end, 0);
+    if (*str == '\0' || *end != '\0')
+    {
+        printf("Invalid operand: %s\n", str);
+        return false;
+    }
+
+    return true;
+}
+
+/* Parses what follows 'if' in a command, three words separated by spaces
+ * Returns false (and prints why) if it is not a condition.
+ */
+bool parse_condition(char *words, Condition *condition)
+{
+    char *left = strtok(words, " \t\n");
+    char *compare = strtok(NULL, " \t\n");
+    char *right = strtok(NULL, " \t\n");
+    if (right == NULL || strtok(NULL, " \t\n") != NULL)
+    {
+        printf("A condition is <operand> <comparison> <operand>.\n");
+        return false;
+    }
+
+    const int num_compares = sizeof(COMPARE_NAMES) / sizeof(COMPARE_NAMES[0]);
+    int i = 0;
+    while (i < num_compares && strcmp(COMPARE_NAMES[i], compare) != 0)
+    {
+        i++;
+    }
+    if (i == num_compares)
+    {
+        printf("Invalid comparison: %s\n", compare);
+        return false;
+    }
+
+    condition->set = true;
+    condition->compare = i;
+    return parse_operand(left, &condition->left) &&
+           parse_operand(right, &condition->right);
+}
+
+// Gets the value of an operand on the machine as it is now
+int16_t operand_value(const Hack *machine, Operand operand)
+{
+    switch (operand.type)
+    {
+    case OPERAND_A:
+        return machine->a_reg;
+    case OPERAND_D:
+        return machine->d_reg;
+    case OPERAND_M:
+        return machine->ram[(uint16_t)machine->a_reg % MEM_SIZE];
+    case OPERAND_PC:
+        return machine->pc;
+    case OPERAND_RAM:
+        return machine->ram[operand.value];
+    case OPERAND_CONST:
+    default:
+        return operand.value;
+    }
+}
+
+// Checks if a condition holds on the machine as it is now
+bool condition_holds(const Hack *machine, const Condition *condition)
+{
+    if (!condition->set)
+    {
+        return true;
+    }
+
+    const int left = operand_value(machine, condition->left);
+    const int right = operand_value(machine, condition->right);
+    switch (condition->compare)
+    {
+    case COMPARE_EQ:
+        return left == right;
+    case COMPARE_NE:
+        return left != right;
+    case COMPARE_LT:
+        return left < right;
+    case COMPARE_LE:
+        return left <= right;
+    case COMPARE_GT:
+        return left > right;
+    case COMPARE_GE:
+    default:
+        return left >= right;
+    }
+}
+
+// Prints an operand the way it is parsed
+void print_operand(Operand operand)
+{
+    switch (operand.type)
+    {
+    case OPERAND_A:
+        printf("A");
+        break;
+    case OPERAND_D:
+        printf("D");
+        break;
+    case OPERAND_M:
+        printf("M");
+        break;
+    case OPERAND_PC:
+        printf("PC");
+        break;
+    case OPERAND_RAM:
+        printf("RAM[%d]", operand.value);
+        break;
+    case OPERAND_CONST:
+    default:
+        printf("%d", operand.value);
+        break;
+    }
+}
+
+// Prints a trap the way 'info' lists it
+void print_trap(const Debugger *this, int n)
+{
+    const Trap *trap = &this->traps[n];
+    if (trap->watch)
+    {
+        printf("%d: watch RAM[%d]", n, trap->addr);
+    }
+    else
+    {
+        printf("%d: break at ", n);
+        print_rom_addr(this, trap->addr);
+    }
+
+    if (trap->condition.set)
+    {
+        printf(" if ");
+        print_operand(trap->condition.left);
+        printf(" %s ", COMPARE_NAMES[trap->condition.compare]);
+        print_operand(trap->condition.right);
+    }
+    printf(", hit %ld times\n", trap->hits);
+}
+
+// Prints the registers and where the program is
+void print_registers(const Debugger *this)
+{
+    const Hack *machine = this->machine;
+    printf("PC ");
+    print_rom_addr(this, machine->pc);
+    printf(" [0x%04X]  A %d  D %d  M %d  after %ld cycles\n",
+           machine->rom[machine->pc % MEM_SIZE], machine->a_reg,
+           machine->d_reg, operand_value(machine, (Operand){OPERAND_M, 0}),
+           this->cycles);
+}
+
+/* Adds a breakpoint or watchpoint from the rest of a command:
+ * <addr> [if <cond>]
+ */
+void add_trap(Debugger *this, bool watch, char *args)
+{
+    char *addr_str = strtok(args, " \t\n");
+    char *rest = strtok(NULL, "\n");
+    if (addr_str == NULL)
+    {
+        printf("Missing address.\n");
+        return;
+    }
+
+    Trap trap = {true, watch, 0, {false}, 0};
+    if (watch ? !parse_ram_addr(addr_str, &trap.addr)
+              : !parse_rom_addr(this, addr_str, &trap.addr))
+    {
+        return;
+    }
+
+    if (rest != NULL)
+    {
+        while (isspace((unsigned char)*rest))
+        {
+            rest++;
+        }
+        if (strncmp(rest, "if", 2) != 0 ||
+            !isspace((unsigned char)rest[2]) ||
+            !parse_condition(rest + 3, &trap.condition))
+        {
+            printf("Expected 'if <cond>' after the address.\n");
+            return;
+        }
+    }
+
+    int n = 0;
+    while (n < MAX_TRAPS && this->traps[n].used)
+    {
+        n++;
+    }
+    if (n == MAX_TRAPS)
+    {
+        printf("At most %d breakpoints and watchpoints can be set.\n",
+               MAX_TRAPS);
+        return;
+    }
+
+    if (watch)
+    {
+        hack_set_watchpoint(this->machine, trap.addr, true);
+    }
+    else if (!hack_set_breakpoint(this->machine, trap.addr, true))
+    {
+        printf("Address %d is outside the program.\n", trap.addr);
+        return;
+    }
+
+    this->traps[n] = trap;
+    print_trap(this, n);
+}
+
+// Deletes a breakpoint or watchpoint by the number 'info' lists it with
+void delete_trap(Debugger *this, int n)
+{
+    if (n < 0 || n >= MAX_TRAPS || !this->traps[n].used)
+    {
+        printf("No breakpoint or watchpoint %d.\n", n);
+        return;
+    }
+
+    Trap *trap = &this->traps[n];
+    trap->used = false;
+    if (trap->watch)
+    {
+        hack_set_watchpoint(this->machine, trap->addr, false);
+        return;
+    }
+
+    // Other breakpoints may be on the same address
+    for (int i = 0; i < MAX_TRAPS; i++)
+    {
+        if (this->traps[i].used && !this->traps[i].watch &&
+            this->traps[i].addr == trap->addr)
+        {
+            return;
+        }
+    }
+    hack_set_breakpoint(this->machine, trap->addr, false);
+}
+
+/* Executes a single instruction, ignoring breakpoints
+ * Returns true if it stored to a watched address and the watchpoint's
+ * condition held, which stops the program.
+ */
+bool step(Debugger *this)
+{
+    Hack *machine = this->machine;
+    const HackOp op = machine->ops[machine->pc];
+    const uint16_t addr = (uint16_t)machine->a_reg % MEM_SIZE;
+    const int16_t old = machine->ram[addr];
+    const bool stores = op.alu != HACK_ALU_LOAD && (op.dest & HACK_DEST_M);
+
+    hack_execute(machine);
+    this->cycles++;
+
+    bool stopped = false;
+    for (int i = 0; stores && i < MAX_TRAPS; i++)
+    {
+        Trap *trap = &this->traps[i];
+        if (trap->used && trap->watch && trap->addr == addr &&
+            condition_holds(machine, &trap->condition))
+        {
+            trap->hits++;
+            printf("Watchpoint %d: RAM[%d] %d -> %d\n", i, addr, old,
+                   machine->ram[addr]);
+            stopped = true;
+        }
+    }
+
+    return stopped;
+}
+
+/* Checks whether a breakpoint whose condition holds is at the PC
+ * hack_run stops there whatever the conditions, so this decides whether to
+ * stay stopped.
+ */
+bool at_breakpoint(Debugger *this)
+{
+    bool stopped = false;
+    for (int i = 0; i < MAX_TRAPS; i++)
+    {
+        Trap *trap = &this->traps[i];
+        if (trap->used && !trap->watch && trap->addr == this->machine->pc &&
+            condition_holds(this->machine, &trap->condition))
+        {
+            trap->hits++;
+            printf("Breakpoint %d at ", i);
+            print_rom_addr(this, trap->addr);
+            printf("\n");
+            stopped = true;
+        }
+    }
+
+    return stopped;
+}
+
+/* Runs at full speed until a trap whose condition holds, the program halts
+ * or leaves the ROM, or 'cycles' instructions have executed (unless negative)
+ * The first instruction is stepped so that the program leaves the
+ * breakpoint it may be stopped at.
+ */
+void run(Debugger *this, long cycles)
+{
+    Hack *machine = this->machine;
+    const long start = this->cycles;
+    bool stopped = false;
+
+    while (!stopped && machine->pc < machine->program_size &&
+           (cycles < 0 || this->cycles - start < cycles))
+    {
+        if (this->cycles == start)
+        {
+            stopped = step(this);
+            continue;
+        }
+
+        long slice = SLICE_CYCLES;
+        if (cycles >= 0 && cycles - (this->cycles - start) < slice)
+        {
+            slice = cycles - (this->cycles - start);
+        }
+
+        const long executed = hack_run(machine, slice);
+        this->cycles += executed;
+        if (machine->pc >= machine->program_size)
+        {
+            break;
+        }
+
+        if (executed < slice)
+        {
+            // Stopped at a breakpoint or before storing to a watched row
+            stopped = at_breakpoint(this) || step(this);
+        }
+        else if (hack_is_halted(machine))
+        {
+            printf("Halted\n");
+            break;
+        }
+    }
+
+    if (machine->pc >= machine->program_size)
+    {
+        printf("Finished\n");
+    }
+    print_registers(this);
+}
+
+// Prints RAM from the rest of a command: <start>[:<end>]
+void print_ram(const Debugger *this, char *args)
+{
+    char *start_str = strtok(args, " \t\n:");
+    char *end_str = strtok(NULL, " \t\n");
+    uint16_t start, end;
+    if (start_str == NULL)
+    {
+        printf("Missing address.\n");
+        return;
+    }
+    if (!parse_ram_addr(start_str, &start))
+    {
+        return;
+    }
+    end = start;
+    if (end_str != NULL && !parse_ram_addr(end_str, &end))
+    {
+        return;
+    }
+
+    for (int i = start; i <= end; i++)
+    {
+        printf("%d: %d\n", i, this->machine->ram[i]);
+    }
+}
+
+// Changes a register or RAM address from the rest of a command
+void set_value(Debugger *this, char *args)
+{
+    Hack *machine = this->machine;
+    char *target = strtok(args, " \t\n");
+    char *value_str = strtok(NULL, " \t\n");
+    char *end;
+    const long value = value_str != NULL ? strtol(value_str, &end, 0) : 0;
+    if (value_str == NULL || *end != '\0')
+    {
+        printf("Usage: set <reg-or-addr> <value>\n");
+        return;
+    }
+
+    uint16_t addr;
+    if (strcmp(target, "A") == 0)
+    {
+        machine->a_reg = value;
+    }
+    else if (strcmp(target, "D") == 0)
+    {
+        machine->d_reg = value;
+    }
+    else if (strcmp(target, "PC") == 0)
+    {
+        machine->pc = value;
+    }
+    else if (parse_ram_addr(target, &addr))
+    {
+        machine->ram[addr] = value;
+        machine->dirty_rows[addr / HACK_ROW_WORDS] = 1;
+    }
+}
+
+/* Runs one command line
+ * Returns false once the debugger is to exit.
+ */
+bool command(Debugger *this, char *line)
+{
+    char *name = strtok(line, " \t\n");
+    char *args = strtok(NULL, "\n");
+    if (args == NULL)
+    {
+        args = "";
+    }
+
+    if (name == NULL)
+    {
+        return true;
+    }
+
+    // Commands may be abbreviated to any prefix, checked in this order
+    const size_t len = strlen(name);
+    if (strncmp(name, "break", len) == 0)
+    {
+        add_trap(this, false, args);
+    }
+    else if (strncmp(name, "continue", len) == 0)
+    {
+        run(this, *args ? strtol(args, NULL, 0) : -1);
+    }
+    else if (strncmp(name, "delete", len) == 0)
+    {
+        delete_trap(this, *args ? strtol(args, NULL, 0) : -1);
+    }
+    else if (strncmp(name, "help", len) == 0)
+    {
+        help();
+    }
+    else if (strncmp(name, "info", len) == 0)
+    {
+        for (int i = 0; i < MAX_TRAPS; i++)
+        {
+            if (this->traps[i].used)
+            {
+                print_trap(this, i);
+            }
+        }
+    }
+    else if (strncmp(name, "print", len) == 0)
+    {
+        print_ram(this, args);
+    }
+    else if (strncmp(name, "quit", len) == 0)
+    {
+        return false;
+    }
+    else if (strncmp(name, "regs", len) == 0)
+    {
+        print_registers(this);
+    }
+    else if (strncmp(name, "step", len) == 0)
+    {
+        const Hack *machine = this->machine;
+        const long n = *args ? strtol(args, NULL, 0) : 1;
+        for (long i = 0; i < n && machine->pc < machine->program_size; i++)
+        {
+            if (step(this))
+            {
+                break;
+            }
+        }
+        print_registers(this);
+    }
+    else if (strncmp(name, "set", len) == 0)
+    {
+        set_value(this, args);
+    }
+    else if (strncmp(name, "watch", len) == 0)
+    {
+        add_trap(this, true, args);
+    }
+    else
+    {
+        printf("Unknown command: %s (try help)\n", name);
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *symbols_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            symbols_path = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage();
+        return 1;
+    }
+
+    // Too large for the stack, see hackrun
+    static Hack machine;
+    hack_init(&machine);
+    if (!load_machine(&machine, argv[optind]))
+    {
+        return 1;
+    }
+
+    static Debugger debugger;
+    debugger.machine = &machine;
+    if (symbols_path != NULL && !load_labels(&debugger, symbols_path))
+    {
+        return 1;
+    }
+
+    // Commands come from a terminal or a script piped in
+    const bool interactive = isatty(STDIN_FILENO);
+    char line[MAX_LINE];
+    print_registers(&debugger);
+    do
+    {
+        if (interactive)
+        {
+            printf("(hackdbg) ");
+            fflush(stdout);
+        }
+        if (fgets(line, sizeof(line), stdin) == NULL)
+        {
+            break;
+        }
+    } while (command(&debugger, line));
+
+    free(debugger.labels);
+    return 0;
+}
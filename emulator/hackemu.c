@@ -1,14 +1,80 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <SDL2/SDL.h>
 #include "emulib.h"
+#include "emujit.h"
+#include "blit.h"
+#include "bus.h"
+#include "journal.h"
+#include "pace.h"
 
 #define TITLE "Hack Emulator"
 #define FRAME_RATE 60
-#define CPU_FREQ 100
+#define CPU_FREQ 10000000 // Default instructions per second, 0 for unlimited
 #define ON_COLOR 0xFFFFFF
 #define OFF_COLOR 0x000000
 
+#define SCREEN_WORDS (KEYBD_ADDR - SCREEN_ADDR)
+
+// Bits of FrameBuffer.latest
+#define FRAME_INDEX 0x3
+#define FRAME_FRESH 0x4
+
+// A copy of the screen published by the CPU thread
+typedef struct Frame
+{
+    int16_t screen[SCREEN_WORDS];
+
+    // Rows the CPU stored to since this copy was last updated
+    uint8_t stale[DISPLAY_HEIGHT];
+} Frame;
+
+/* Triple buffer of frames shared by the CPU and display threads.
+ * One frame is being filled by the CPU thread, one is being drawn by the
+ * display thread and the third holds the latest frame published, so that
+ * neither thread ever waits for the other.
+ */
+typedef struct FrameBuffer
+{
+    Frame frames[3];
+    SDL_atomic_t latest; // Index of the latest frame, FRAME_FRESH until taken
+    int back;            // Owned by the CPU thread
+    int front;           // Owned by the display thread
+} FrameBuffer;
+
+// Everything shared between the CPU and display threads
+typedef struct Emulator
+{
+    Hack machine;   // Owned by the CPU thread once it starts
+    HackJit *jit;
+    long hz; // Instructions per second, 0 for unlimited
+    FrameBuffer frames;
+
+    // Devices, updated by the CPU thread between slices
+    HackBus bus;
+    HackKeyboard keyboard; // Pressed by the display thread
+    HackTimer timer;
+    HackSerial serial; // Printed by the display thread
+    Journal *journal;  // Keys recorded by the CPU thread, NULL if not recording
+
+    SDL_atomic_t quit; // Set by the display thread to stop the CPU thread
+    SDL_atomic_t done; // Set by the CPU thread once the program is over
+} Emulator;
+
+// Prints usage information
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./hackemu [options] <path-to-file>\n"
+            "  -f <hz>          Instructions per second, e.g. 500k or 4M,"
+            " 0 for unlimited\n"
+            "                   (default %d)\n"
+            "  -j <file>        Record the keys pressed to a journal that"
+            " hackrun can replay\n",
+            CPU_FREQ);
+}
+
 // Initializes SDL
 bool init_SDL(void)
 {
@@ -39,31 +105,182 @@ SDL_Window *create_window(void)
     return new_window;
 }
 
-// Sets a pixel of the SDL surface to a certain color
-void set_pixel(SDL_Surface *surface, int x, int y, long color)
+/* Makes the physical screen match a frame
+ * 'shown' holds what is currently on the screen. Only rows that differ from it
+ * are converted, and each run of consecutive changed rows is pushed to the
+ * window as a single rectangle.
+ */
+void draw_display(const Frame *frame, int16_t *shown, SDL_Window *window,
+                  SDL_Surface *surface)
 {
-    Uint32 *pixels = (Uint32 *)surface->pixels;
-    pixels[(y * surface->w) + x] = color;
+    static const BlitColors colors = {ON_COLOR, OFF_COLOR};
+    const size_t row_size = HACK_ROW_WORDS * sizeof(int16_t);
+    SDL_Rect rects[DISPLAY_HEIGHT];
+    int num_rects = 0;
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        const int16_t *row = &frame->screen[y * HACK_ROW_WORDS];
+        int16_t *shown_row = &shown[y * HACK_ROW_WORDS];
+        if (memcmp(row, shown_row, row_size) == 0)
+        {
+            continue;
+        }
+        memcpy(shown_row, row, row_size);
+
+        Uint32 *pixels = (Uint32 *)((Uint8 *)surface->pixels +
+                                    y * surface->pitch);
+        blit_words(pixels, row, HACK_ROW_WORDS, colors);
+
+        // Extend the rectangle of the row above if it changed too
+        if (num_rects > 0 &&
+            rects[num_rects - 1].y + rects[num_rects - 1].h == y)
+        {
+            rects[num_rects - 1].h++;
+        }
+        else
+        {
+            rects[num_rects++] = (SDL_Rect){0, y, DISPLAY_WIDTH, 1};
+        }
+    }
+
+    if (num_rects > 0)
+    {
+        SDL_UpdateWindowSurfaceRects(window, rects, num_rects);
+    }
 }
 
-// Makes the physical screen match the emulator display
-void draw_display(const Hack *machine, SDL_Window *window, SDL_Surface *surface)
+// Gives each thread its own frame, with the third holding nothing yet
+void init_frames(FrameBuffer *this)
 {
-    for (int i = SCREEN_ADDR; i < KEYBD_ADDR; i++)
+    this->back = 0;
+    this->front = 1;
+    SDL_AtomicSet(&this->latest, 2);
+}
+
+/* Copies the screen into the back frame and makes it the latest one
+ * Only rows stored to since the back frame was last filled are copied.
+ */
+void publish_frame(FrameBuffer *this, Hack *machine)
+{
+    uint8_t *dirty = &machine->dirty_rows[SCREEN_ADDR / HACK_ROW_WORDS];
+    for (int i = 0; i < 3; i++)
     {
-        int x, y;
-        hack_get_coords(&x, &y, i);
+        for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        {
+            this->frames[i].stale[y] |= dirty[y];
+        }
+    }
+    memset(dirty, 0, DISPLAY_HEIGHT);
 
-        for (int j = 0; j < WORD_SIZE; j++)
+    Frame *frame = &this->frames[this->back];
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        if (frame->stale[y])
         {
-            int newx = (WORD_SIZE * x) + j;
+            memcpy(&frame->screen[y * HACK_ROW_WORDS],
+                   &machine->ram[SCREEN_ADDR + y * HACK_ROW_WORDS],
+                   HACK_ROW_WORDS * sizeof(int16_t));
+            frame->stale[y] = 0;
+        }
+    }
+
+    // The frame must be complete before the display thread can take it
+    SDL_MemoryBarrierRelease();
+    this->back = SDL_AtomicSet(&this->latest, this->back | FRAME_FRESH) &
+                 FRAME_INDEX;
+}
 
-            long color = ((machine->ram[i] >> j) & 1) ? ON_COLOR : OFF_COLOR;
-            set_pixel(surface, newx, y, color);
+/* Swaps the front frame for the latest one
+ * Returns false if nothing was published since the last call.
+ */
+bool take_frame(FrameBuffer *this)
+{
+    if (!(SDL_AtomicGet(&this->latest) & FRAME_FRESH))
+    {
+        return false;
+    }
+
+    this->front = SDL_AtomicSet(&this->latest, this->front) & FRAME_INDEX;
+    SDL_MemoryBarrierAcquire();
+    return true;
+}
+
+/* Sleeps until the key pressed changes or the emulator quits, for a machine
+ * that would otherwise spin in a loop until one of them happens
+ */
+void wait_for_key(Emulator *emu)
+{
+    const int key = emu->machine.ram[KEYBD_ADDR];
+    while (!SDL_AtomicGet(&emu->quit) &&
+           hack_keyboard_key(&emu->keyboard) == key)
+    {
+        SDL_Delay(1000 / FRAME_RATE);
+    }
+}
+
+/* Runs the CPU at the requested rate, publishing a frame every 1/FRAME_RATE
+ * seconds
+ * Input only ever reaches the machine between slices, where the bus latches
+ * the pressed key into the keyboard register, so the machine is never touched
+ * by two threads at once. That is also where it is journaled, stamped with the
+ * instructions run so far.
+ * A machine polling the keyboard or halted does not run at all until a key
+ * changes, so it leaves the host idle.
+ */
+int run_cpu(void *data)
+{
+    Emulator *emu = data;
+    Hack *machine = &emu->machine;
+    const Uint32 frame_ms = 1000 / FRAME_RATE;
+    Uint32 next_frame = SDL_GetTicks();
+
+    Pacer pacer;
+    pacer_init(&pacer, emu->hz);
+
+    while (!SDL_AtomicGet(&emu->quit) && machine->pc < machine->program_size)
+    {
+        // Devices must be updated at least every HACK_BUS_MAX_SLICE cycles
+        long cycles = 0;
+        while (cycles < pacer.slice && machine->pc < machine->program_size)
+        {
+            const long chunk = hack_bus_slice(&emu->bus, pacer.slice - cycles);
+            const long executed = hack_jit_run(emu->jit, machine, chunk);
+            hack_bus_update(&emu->bus, executed);
+            cycles += executed;
+
+            if (emu->journal != NULL)
+            {
+                journal_write(emu->journal, emu->bus.cycles,
+                              machine->ram[KEYBD_ADDR]);
+            }
         }
+
+        const Uint32 now = SDL_GetTicks();
+        if ((Sint32)(now - next_frame) >= 0)
+        {
+            publish_frame(&emu->frames, machine);
+            next_frame = now + frame_ms;
+
+            // Looking for an idle loop is slow, so only once a frame
+            if (hack_bus_idle(&emu->bus) != HACK_IDLE_BUSY)
+            {
+                wait_for_key(emu);
+
+                // Pace from now on rather than catching up on the time slept
+                pacer_init(&pacer, emu->hz);
+                next_frame = SDL_GetTicks();
+                continue;
+            }
+        }
+
+        pacer_wait(&pacer, cycles);
     }
 
-    SDL_UpdateWindowSurface(window);
+    // Show the final state of the screen
+    publish_frame(&emu->frames, machine);
+    SDL_AtomicSet(&emu->done, 1);
+    return 0;
 }
 
 // Returns the proper key for the emulator to handle
@@ -113,7 +330,7 @@ int get_key(SDL_KeyCode key)
 }
 
 // Checks for key presses/releases and a quit event.
-bool handle_input(Hack *machine, SDL_Event *e)
+bool handle_input(HackKeyboard *keyboard, SDL_Event *e)
 {
     while (SDL_PollEvent(e))
     {
@@ -124,11 +341,11 @@ bool handle_input(Hack *machine, SDL_Event *e)
             break;
         case SDL_KEYDOWN:
         {
-            machine->ram[KEYBD_ADDR] = get_key(e->key.keysym.sym);
+            hack_keyboard_press(keyboard, get_key(e->key.keysym.sym));
             break;
         }
         case SDL_KEYUP:
-            machine->ram[KEYBD_ADDR] = 0;
+            hack_keyboard_press(keyboard, 0);
             break;
         }
     }
@@ -136,6 +353,23 @@ bool handle_input(Hack *machine, SDL_Event *e)
     return true;
 }
 
+// Prints whatever the program sent to the serial console
+void print_serial(HackSerial *serial)
+{
+    uint8_t c;
+    bool printed = false;
+    while (hack_queue_pop(&serial->output, &c))
+    {
+        putchar(c);
+        printed = true;
+    }
+
+    if (printed)
+    {
+        fflush(stdout);
+    }
+}
+
 // Frees all resources and exits.
 void clean_exit(SDL_Window *window, SDL_Surface *surface, int status)
 {
@@ -159,15 +393,38 @@ void clean_exit(SDL_Window *window, SDL_Surface *surface, int status)
 int main(int argc, char **argv)
 {
     char rom_path[FILENAME_MAX];
+    long hz = CPU_FREQ;
+    const char *journal_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            if (!pacer_parse_hz(optarg, &hz))
+            {
+                fprintf(stderr, "Invalid clock rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
 
-    if (argc != 2)
+    if (optind != argc - 1)
     {
-        fprintf(stderr, "Usage: ./hackemu <path-to-file>\n");
+        usage();
         return 1;
     }
     else
     {
-        strncpy(rom_path, argv[1], FILENAME_MAX);
+        strncpy(rom_path, argv[optind], FILENAME_MAX);
         rom_path[FILENAME_MAX - 1] = '\0';
     }
 
@@ -189,31 +446,89 @@ int main(int argc, char **argv)
         clean_exit(window, NULL, 1);
     }
 
-    Hack machine;
-    hack_init(&machine);
+    /* The machine is too large to comfortably live on the stack and the
+     * emulator as a whole must outlive the CPU thread.
+     */
+    static Emulator emu;
+    static int16_t shown[SCREEN_WORDS];
+    hack_init(&emu.machine);
+    emu.hz = hz;
 
-    if (!hack_load_rom(&machine, rom_path))
+    if (!hack_load_rom(&emu.machine, rom_path))
     {
         clean_exit(window, surface, 1);
     }
 
+    emu.jit = hack_jit_create();
+    if (emu.jit == NULL)
+    {
+        clean_exit(window, surface, 1);
+    }
+
+    // The timer ticks every millisecond the program would take on hardware
+    hack_bus_init(&emu.bus, &emu.machine);
+    hack_keyboard_init(&emu.keyboard);
+    hack_timer_init(&emu.timer, hack_timer_period(hz));
+    hack_serial_init(&emu.serial);
+    if (!hack_bus_attach(&emu.bus, &emu.keyboard.device) ||
+        !hack_bus_attach(&emu.bus, &emu.timer.device) ||
+        !hack_bus_attach(&emu.bus, &emu.serial.device))
+    {
+        hack_jit_destroy(emu.jit);
+        clean_exit(window, surface, 1);
+    }
+
+    if (journal_path != NULL)
+    {
+        emu.journal = journal_record(journal_path, hz);
+        if (emu.journal == NULL)
+        {
+            hack_jit_destroy(emu.jit);
+            clean_exit(window, surface, 1);
+        }
+    }
+
+    init_frames(&emu.frames);
+    SDL_Thread *cpu = SDL_CreateThread(run_cpu, "cpu", &emu);
+    if (cpu == NULL)
+    {
+        fprintf(stderr, "Could not create CPU thread: %s\n", SDL_GetError());
+        journal_close(emu.journal, 0);
+        hack_jit_destroy(emu.jit);
+        clean_exit(window, surface, 1);
+    }
+
+    // Start from a blank screen, which is what 'shown' holds
+    SDL_FillRect(surface, NULL, OFF_COLOR);
+    SDL_UpdateWindowSurface(window);
+
     SDL_Event e;
     bool quit = false;
-    while (!quit && machine.pc < machine.program_size)
+    while (!quit && !SDL_AtomicGet(&emu.done))
     {
-        // Cap execution speed
-        if (SDL_GetTicks() % (1000 / CPU_FREQ) <= 1)
+        const Uint32 start = SDL_GetTicks();
+
+        quit = !handle_input(&emu.keyboard, &e);
+        print_serial(&emu.serial);
+        if (take_frame(&emu.frames))
         {
-            hack_execute(&machine);
+            draw_display(&emu.frames.frames[emu.frames.front], shown, window,
+                         surface);
         }
 
         // Cap input/draw rate
-        if (SDL_GetTicks() % (1000 / FRAME_RATE) <= 1)
+        const Uint32 elapsed = SDL_GetTicks() - start;
+        if (elapsed < 1000 / FRAME_RATE)
         {
-            quit = !handle_input(&machine, &e);
-            draw_display(&machine, window, surface);
+            SDL_Delay(1000 / FRAME_RATE - elapsed);
         }
     }
 
-    clean_exit(window, surface, 0);
+    SDL_AtomicSet(&emu.quit, 1);
+    SDL_WaitThread(cpu, NULL);
+    print_serial(&emu.serial);
+    hack_jit_destroy(emu.jit);
+
+    const bool written = journal_close(emu.journal, emu.bus.cycles);
+    clean_exit(window, surface, written ? 0 : 1);
 }
@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bus.h"
+#include "engine.h"
+#include "journal.h"
+#include "pace.h"
+#include "profile.h"
+#include "rewind.h"
+#include "trace.h"
+
+// Instructions executed between checks for a halted machine and devices
+#define SLICE_CYCLES HACK_BUS_MAX_SLICE
+
+// Instructions executed between checks for a machine polling in an idle loop
+#define IDLE_CYCLES (1L << 18)
+
+// Size of the history kept when the run is to be rewound
+#define REWIND_BYTES (256L << 20)
+
+// Maximum number of RAM ranges that can be dumped
+#define MAX_RANGES 32
+
+// A range of RAM addresses to print once the run is over
+typedef struct RamRange
+{
+    int start, end;
+} RamRange;
+
+// Prints usage information
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./hackrun [options] <rom-or-state>\n"
+            "  -b <cycles>      Step back this many instructions once the run"
+            " is over\n"
+            "                   (records history, which is slower)\n"
+            "  -c <cycles>      Stop after this many instructions\n"
+            "  -e <engine>      Execution engine: step, thread or jit"
+            " (default jit)\n"
+            "  -g <file>        With -p, save the call stacks profiled for"
+            " flamegraph.pl\n"
+            "  -j <file>        Replay the keys journaled by hackemu -j,"
+            " stopping where\n"
+            "                   the session did unless -c is given\n"
+            "  -m <file.json>   Save the performance counters as JSON once the"
+            " run is over\n"
+            "                   (needs make hackrun_stats, runs the step"
+            " engine)\n"
+            "  -r <start:end>   Print RAM from start to end (inclusive)\n"
+            "  -o <file>        Save the machine state once the run is over\n"
+            "  -p <file.sym>    Profile the run using the labels in a symbol"
+            " map\n"
+            "                   (steps one instruction at a time, which is"
+            " slower)\n"
+            "  -s <file.pbm>    Save the screen as a PBM image\n"
+            "  -t <file>        Trace every instruction to a file for"
+            " hacktrace\n"
+            "                   (steps one instruction at a time, which is"
+            " slower)\n"
+            "  -w <file>        Write the ROM as a packed binary ROM and"
+            " exit\n");
+}
+
+// Parses a RAM range in the form start:end, or a single address
+bool parse_range(const char *str, RamRange *range)
+{
+    char *end;
+    range->start = strtol(str, &end, 0);
+    range->end = *end == ':' ? strtol(end + 1, &end, 0) : range->start;
+
+    if (*end != '\0' || range->start < 0 || range->end >= MEM_SIZE ||
+        range->start > range->end)
+    {
+        fprintf(stderr, "Invalid RAM range: %s\n", str);
+        return false;
+    }
+
+    return true;
+}
+
+/* Saves the screen as a binary PBM image.
+ * PBM pixels are 1 for black just like the Hack screen, but are packed most
+ * significant bit first, whereas the leftmost Hack pixel is the least
+ * significant bit of a word.
+ */
+bool save_screen(const Hack *machine, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    fprintf(fp, "P4\n%d %d\n", DISPLAY_WIDTH, DISPLAY_HEIGHT);
+
+    for (int i = SCREEN_ADDR; i < KEYBD_ADDR; i++)
+    {
+        const uint16_t word = machine->ram[i];
+
+        for (int j = 0; j < WORD_SIZE; j += 8)
+        {
+            uint8_t byte = 0;
+            for (int k = 0; k < 8; k++)
+            {
+                byte |= ((word >> (j + k)) & 1) << (7 - k);
+            }
+            fputc(byte, fp);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    long max_cycles = -1;
+    long back_cycles = 0;
+    ENGINES engine = ENGINE_JIT;
+    RamRange ranges[MAX_RANGES];
+    int num_ranges = 0;
+    const char *screen_path = NULL;
+    const char *binary_path = NULL;
+    const char *state_path = NULL;
+    const char *symbols_path = NULL;
+    const char *stacks_path = NULL;
+    const char *journal_path = NULL;
+    const char *stats_path = NULL;
+    const char *trace_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:e:g:j:m:o:p:r:s:t:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            back_cycles = strtol(optarg, NULL, 0);
+            break;
+        case 'c':
+            max_cycles = strtol(optarg, NULL, 0);
+            break;
+        case 'e':
+            if (!parse_engine(optarg, &engine))
+            {
+                return 1;
+            }
+            break;
+        case 'g':
+            stacks_path = optarg;
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'o':
+            state_path = optarg;
+            break;
+        case 'p':
+            symbols_path = optarg;
+            break;
+        case 'r':
+            if (num_ranges == MAX_RANGES)
+            {
+                fprintf(stderr, "At most %d RAM ranges can be printed.\n",
+                        MAX_RANGES);
+                return 1;
+            }
+            if (!parse_range(optarg, &ranges[num_ranges++]))
+            {
+                return 1;
+            }
+            break;
+        case 's':
+            screen_path = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'w':
+            binary_path = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage();
+        return 1;
+    }
+
+    if (symbols_path != NULL && back_cycles > 0)
+    {
+        fprintf(stderr, "A run cannot be both profiled and stepped back.\n");
+        return 1;
+    }
+
+    if (trace_path != NULL && (symbols_path != NULL || back_cycles > 0))
+    {
+        fprintf(stderr, "A traced run cannot also be profiled or stepped"
+                        " back.\n");
+        return 1;
+    }
+
+    if (stacks_path != NULL && symbols_path == NULL)
+    {
+        fprintf(stderr, "Call stacks can only be saved when profiling.\n");
+        return 1;
+    }
+
+    // Only hack_execute keeps performance counters, and only if built to
+    if (stats_path != NULL)
+    {
+#ifndef HACK_STATS
+        fprintf(stderr, "Performance counters are not built in, use"
+                        " make hackrun_stats.\n");
+        return 1;
+#endif
+        engine = ENGINE_STEP;
+    }
+
+    /* The machine is too large to comfortably live on the stack and keeping
+     * it static makes sure RAM starts zeroed either way.
+     */
+    static Hack machine;
+    hack_init(&machine);
+
+    if (!load_machine(&machine, argv[optind]))
+    {
+        return 1;
+    }
+
+    if (binary_path != NULL)
+    {
+        return hack_save_rom(&machine, binary_path) ? 0 : 1;
+    }
+
+    Journal *journal = NULL;
+    if (journal_path != NULL)
+    {
+        journal = journal_replay(journal_path);
+        if (journal == NULL)
+        {
+            return 1;
+        }
+
+        if (max_cycles < 0)
+        {
+            max_cycles = journal_length(journal);
+        }
+    }
+
+    /* Devices are updated every SLICE_CYCLES, and replays also update them at
+     * the end of each slice hackemu's pacer ran, just as hackemu did
+     */
+    long pace_cycles = SLICE_CYCLES;
+    if (journal != NULL)
+    {
+        Pacer pacer;
+        pacer_init(&pacer, journal_hz(journal));
+        pace_cycles = pacer.slice;
+    }
+
+    /* Headless runs have a timer and print whatever is sent to the console
+     * Replays also have a keyboard and a timer ticking as it did in hackemu.
+     */
+    HackBus bus;
+    HackKeyboard keyboard;
+    HackTimer timer;
+    HackSerial serial;
+    hack_bus_init(&bus, &machine);
+    hack_keyboard_init(&keyboard);
+    hack_timer_init(&timer, journal != NULL
+                                ? hack_timer_period(journal_hz(journal))
+                                : HACK_TIMER_PERIOD);
+    hack_serial_init(&serial);
+    if ((journal != NULL && !hack_bus_attach(&bus, &keyboard.device)) ||
+        !hack_bus_attach(&bus, &timer.device) ||
+        !hack_bus_attach(&bus, &serial.device))
+    {
+        return 1;
+    }
+
+    long key_cycle;
+    int key;
+    bool key_pending = journal != NULL && journal_read(journal, &key_cycle,
+                                                       &key);
+
+    HackJit *jit = NULL;
+    if (engine == ENGINE_JIT)
+    {
+        jit = hack_jit_create();
+        if (jit == NULL)
+        {
+            return 1;
+        }
+    }
+
+    HackRewind *rewind = NULL;
+    if (back_cycles > 0)
+    {
+        rewind = hack_rewind_create(REWIND_BYTES);
+        if (rewind == NULL)
+        {
+            return 1;
+        }
+    }
+
+    HackProfile *profile = NULL;
+    if (symbols_path != NULL)
+    {
+        profile = hack_profile_create(symbols_path);
+        if (profile == NULL)
+        {
+            return 1;
+        }
+    }
+
+    HackTrace *trace = NULL;
+    if (trace_path != NULL)
+    {
+        trace = hack_trace_record(trace_path, &machine);
+        if (trace == NULL)
+        {
+            return 1;
+        }
+    }
+
+    // Run in slices, checking between them whether the program is done
+    long cycles = 0;
+    long idle_cycle = IDLE_CYCLES;
+    bool halted = false;
+    while (!halted && machine.pc < machine.program_size &&
+           (max_cycles < 0 || cycles < max_cycles))
+    {
+        long slice = hack_bus_slice(&bus, pace_cycles - cycles % pace_cycles);
+        if (max_cycles >= 0 && max_cycles - cycles < slice)
+        {
+            slice = max_cycles - cycles;
+        }
+        if (key_pending && key_cycle > cycles && key_cycle - cycles < slice)
+        {
+            slice = key_cycle - cycles;
+        }
+
+        long executed;
+        if (rewind != NULL)
+        {
+            executed = hack_rewind_run(rewind, &machine, slice);
+        }
+        else if (profile != NULL)
+        {
+            executed = hack_profile_run(profile, &machine, slice);
+        }
+        else if (trace != NULL)
+        {
+            executed = hack_trace_run(trace, &machine, slice);
+        }
+        else
+        {
+            executed = run_engine(&machine, jit, engine, slice);
+        }
+        cycles += executed;
+
+        // Keys reach the machine in the update ending where they were pressed
+        while (key_pending && key_cycle <= cycles)
+        {
+            hack_keyboard_press(&keyboard, key);
+            key_pending = journal_read(journal, &key_cycle, &key);
+        }
+
+        hack_bus_update(&bus, executed);
+        uint8_t c;
+        while (hack_queue_pop(&serial.output, &c))
+        {
+            putchar(c);
+        }
+
+        halted = hack_is_halted(&machine);
+        if (!halted && cycles >= idle_cycle)
+        {
+            // Polling for keys the journal does not have goes on forever
+            const HACK_IDLE idle = hack_bus_idle(&bus);
+            halted = idle == HACK_IDLE_HALTED ||
+                     (idle == HACK_IDLE_INPUT && !key_pending);
+            idle_cycle = cycles + IDLE_CYCLES;
+        }
+    }
+
+    if (halted)
+    {
+        printf("halted after %ld cycles at %d\n", cycles, machine.pc);
+    }
+    else if (machine.pc >= machine.program_size)
+    {
+        printf("finished after %ld cycles\n", cycles);
+    }
+    else
+    {
+        printf("stopped after %ld cycles at %d\n", cycles, machine.pc);
+    }
+
+    if (!hack_trace_close(trace))
+    {
+        return 1;
+    }
+
+    if (rewind != NULL)
+    {
+        const long undone = hack_rewind_back(rewind, &machine, back_cycles);
+        printf("stepped back %ld cycles to %d\n", undone, machine.pc);
+        hack_rewind_destroy(rewind);
+    }
+
+    if (profile != NULL)
+    {
+        hack_profile_print(profile, stdout);
+        if (stacks_path != NULL &&
+            !hack_profile_save_stacks(profile, stacks_path))
+        {
+            return 1;
+        }
+        hack_profile_destroy(profile);
+    }
+
+    for (int i = 0; i < num_ranges; i++)
+    {
+        for (int addr = ranges[i].start; addr <= ranges[i].end; addr++)
+        {
+            printf("%d: %d\n", addr, machine.ram[addr]);
+        }
+    }
+
+    hack_jit_destroy(jit);
+    journal_close(journal, 0);
+
+    if (screen_path != NULL && !save_screen(&machine, screen_path))
+    {
+        return 1;
+    }
+
+    if (state_path != NULL && !hack_save_state(&machine, state_path))
+    {
+        return 1;
+    }
+
+    HackStats stats;
+    if (stats_path != NULL && (!hack_get_stats(&machine, &stats) ||
+                               !hack_save_stats(&stats, stats_path)))
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+// Exit statuses, like those of diff
+#define TRACES_SAME 0
+#define TRACES_DIFFER 1
+#define TRACES_TROUBLE 2
+
+// Prints usage information
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./hacktrace [options] <trace> [<other-trace>]\n"
+            "Prints a trace written by hackrun -t, or compares two and"
+            " reports the\nfirst step where they diverge.\n"
+            "  -s               Only compare the stores to RAM, for programs"
+            " that\n"
+            "                   compute the same results differently\n");
+}
+
+// Prints a step as one line, starting with 'prefix'
+void print_step(const char *prefix, const HackTraceStep *step)
+{
+    printf("%s%ld: %d [0x%04X] A=%d D=%d", prefix, step->cycle, step->pc,
+           step->instruction, step->a, step->d);
+    if (step->stored)
+    {
+        printf(" RAM[%d]=%d", step->addr, step->value);
+    }
+    printf("\n");
+}
+
+// Reads the next step of a trace, skipping steps that do not store if asked
+bool next_step(HackTrace *trace, HackTraceStep *step, bool stores_only)
+{
+    while (hack_trace_read(trace, step))
+    {
+        if (!stores_only || step->stored)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Checks if two steps did the same, which for stores only is what they stored
+bool same_step(const HackTraceStep *a, const HackTraceStep *b,
+               bool stores_only)
+{
+    const bool same_store = a->addr == b->addr && a->value == b->value;
+    if (stores_only)
+    {
+        return same_store;
+    }
+
+    return a->pc == b->pc && a->instruction == b->instruction &&
+           a->a == b->a && a->d == b->d && a->stored == b->stored &&
+           (!a->stored || same_store);
+}
+
+// Prints every step of a trace
+int print_trace(HackTrace *trace, bool stores_only)
+{
+    HackTraceStep step;
+    while (next_step(trace, &step, stores_only))
+    {
+        print_step("", &step);
+    }
+
+    return hack_trace_close(trace) ? TRACES_SAME : TRACES_TROUBLE;
+}
+
+// Compares two traces step by step, reporting the first difference
+int diff_traces(HackTrace *first, HackTrace *second, bool stores_only)
+{
+    HackTraceStep a, b;
+    long compared = 0;
+    int status = TRACES_SAME;
+
+    while (status == TRACES_SAME)
+    {
+        const bool has_a = next_step(first, &a, stores_only);
+        const bool has_b = next_step(second, &b, stores_only);
+        if (!has_a && !has_b)
+        {
+            break;
+        }
+
+        status = TRACES_DIFFER;
+        if (!has_a || !has_b)
+        {
+            printf("%s trace ends after %ld %s, the other goes on:\n",
+                   has_a ? "Second" : "First", compared,
+                   stores_only ? "stores" : "steps");
+            print_step(has_a ? "< " : "> ", has_a ? &a : &b);
+        }
+        else if (!same_step(&a, &b, stores_only))
+        {
+            printf("Traces diverge after %ld %s:\n", compared,
+                   stores_only ? "stores" : "steps");
+            print_step("< ", &a);
+            print_step("> ", &b);
+        }
+        else
+        {
+            status = TRACES_SAME;
+            compared++;
+        }
+    }
+
+    // Either trace being corrupt up to where they were compared is trouble
+    const bool valid_first = hack_trace_close(first);
+    const bool valid_second = hack_trace_close(second);
+    if (!valid_first || !valid_second)
+    {
+        return TRACES_TROUBLE;
+    }
+
+    if (status == TRACES_SAME)
+    {
+        printf("Traces match over %ld %s\n", compared,
+               stores_only ? "stores" : "steps");
+    }
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    bool stores_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            stores_only = true;
+            break;
+        default:
+            usage();
+            return TRACES_TROUBLE;
+        }
+    }
+
+    const int num_traces = argc - optind;
+    if (num_traces != 1 && num_traces != 2)
+    {
+        usage();
+        return TRACES_TROUBLE;
+    }
+
+    HackTrace *first = hack_trace_open(argv[optind]);
+    if (first == NULL)
+    {
+        return TRACES_TROUBLE;
+    }
+
+    if (num_traces == 1)
+    {
+        return print_trace(first, stores_only);
+    }
+
+    HackTrace *second = hack_trace_open(argv[optind + 1]);
+    if (second == NULL)
+    {
+        hack_trace_close(first);
+        return TRACES_TROUBLE;
+    }
+
+    return diff_traces(first, second, stores_only);
+}
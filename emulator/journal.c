@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC_LEN (sizeof(JOURNAL_MAGIC) - 1)
+
+// A change of the keyboard register loaded from a journal
+typedef struct JournalEvent
+{
+    long cycle;
+    int key;
+} JournalEvent;
+
+struct Journal
+{
+    FILE *fp; // File being recorded to, NULL when replaying
+    long hz;
+    long last_cycle; // Instructions before the last change recorded
+    int last_key;
+
+    // Changes of a replayed session and the next one to be read
+    JournalEvent *events;
+    long num_events, next;
+    long length;
+};
+
+// Writes an unsigned LEB128 varint
+static void write_varint(FILE *fp, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        fputc((value & 0x7F) | 0x80, fp);
+        value >>= 7;
+    }
+    fputc(value, fp);
+}
+
+// Reads an unsigned LEB128 varint, returning false if the file ends first
+static bool read_varint(FILE *fp, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        const int byte = fgetc(fp);
+        if (byte == EOF)
+        {
+            return false;
+        }
+
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Journal *journal_record(const char *path, long hz)
+{
+    Journal *journal = calloc(1, sizeof(Journal));
+    if (journal == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for journal.\n");
+        return NULL;
+    }
+
+    journal->fp = fopen(path, "wb");
+    if (journal->fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        free(journal);
+        return NULL;
+    }
+
+    fwrite(JOURNAL_MAGIC, 1, JOURNAL_MAGIC_LEN, journal->fp);
+    write_varint(journal->fp, hz);
+    journal->hz = hz;
+    return journal;
+}
+
+void journal_write(Journal *this, long cycle, int key)
+{
+    if (key == this->last_key)
+    {
+        return;
+    }
+
+    write_varint(this->fp, cycle - this->last_cycle);
+    write_varint(this->fp, (uint64_t)key + 1);
+    this->last_cycle = cycle;
+    this->last_key = key;
+}
+
+Journal *journal_replay(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return NULL;
+    }
+
+    Journal *journal = calloc(1, sizeof(Journal));
+    if (journal == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for journal.\n");
+        fclose(fp);
+        return NULL;
+    }
+
+    char magic[JOURNAL_MAGIC_LEN];
+    uint64_t hz = 0;
+    bool valid = fread(magic, 1, JOURNAL_MAGIC_LEN, fp) == JOURNAL_MAGIC_LEN &&
+                 memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) == 0 &&
+                 read_varint(fp, &hz);
+    journal->hz = hz;
+
+    // Read changes up to the end marker, which every complete journal has
+    long max_events = 0;
+    long cycle = 0;
+    while (valid)
+    {
+        uint64_t delta, key;
+        if (!read_varint(fp, &delta) || !read_varint(fp, &key))
+        {
+            valid = false;
+            break;
+        }
+
+        cycle += delta;
+        if (key == 0)
+        {
+            journal->length = cycle;
+            break;
+        }
+
+        if (journal->num_events == max_events)
+        {
+            max_events = max_events ? max_events * 2 : 256;
+            JournalEvent *events =
+                realloc(journal->events, max_events * sizeof(JournalEvent));
+            if (events == NULL)
+            {
+                fprintf(stderr, "Unable to allocate memory for journal.\n");
+                fclose(fp);
+                journal_close(journal, 0);
+                return NULL;
+            }
+            journal->events = events;
+        }
+        journal->events[journal->num_events++] =
+            (JournalEvent){cycle, (int)(key - 1)};
+    }
+
+    fclose(fp);
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid input journal: %s\n", path);
+        journal_close(journal, 0);
+        return NULL;
+    }
+
+    return journal;
+}
+
+long journal_hz(const Journal *this)
+{
+    return this->hz;
+}
+
+long journal_length(const Journal *this)
+{
+    return this->length;
+}
+
+bool journal_read(Journal *this, long *cycle, int *key)
+{
+    if (this->next == this->num_events)
+    {
+        return false;
+    }
+
+    *cycle = this->events[this->next].cycle;
+    *key = this->events[this->next].key;
+    this->next++;
+    return true;
+}
+
+bool journal_close(Journal *this, long cycle)
+{
+    if (this == NULL)
+    {
+        return true;
+    }
+
+    bool written = true;
+    if (this->fp != NULL)
+    {
+        write_varint(this->fp, cycle - this->last_cycle);
+        write_varint(this->fp, 0);
+        written = !ferror(this->fp);
+        written = fclose(this->fp) == 0 && written;
+        if (!written)
+        {
+            fprintf(stderr, "Unable to write the input journal.\n");
+        }
+    }
+
+    free(this->events);
+    free(this);
+    return written;
+}
@@ -0,0 +1,57 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+
+/* A journal of the keys pressed during a session, for replaying it exactly.
+ *
+ * Every change to the keyboard register is recorded along with the number of
+ * instructions executed before it, so a replay feeding the same keys at the
+ * same instructions runs the program the same way, only without a window and
+ * as fast as the host allows.
+ *
+ * The file starts with JOURNAL_MAGIC and the clock rate of the session, then
+ * holds one entry per change: the instructions since the previous change and
+ * the new key plus one, both as LEB128 varints. An entry whose key is 0 marks
+ * the end of the session. Most entries take 3 or 4 bytes.
+ */
+#define JOURNAL_MAGIC "HKJ1"
+
+typedef struct Journal Journal;
+
+/* Start recording to a file a session running at 'hz' instructions per second
+ * (0 for unlimited)
+ * Returns NULL (and prints why) if the file cannot be opened.
+ */
+Journal *journal_record(const char *path, long hz);
+
+/* Record the key, 0 for none and never negative, held in the keyboard
+ * register after 'cycle' instructions
+ * Keys that did not change since the last call are not recorded.
+ */
+void journal_write(Journal *journal, long cycle, int key);
+
+/* Load a recorded session to replay
+ * Returns NULL (and prints why) if it cannot be read.
+ */
+Journal *journal_replay(const char *path);
+
+// Clock rate of a replayed session, 0 if it was unlimited
+long journal_hz(const Journal *journal);
+
+// Instructions a replayed session ran for
+long journal_length(const Journal *journal);
+
+/* Take the next change of a replayed session: 'key' is to be in the keyboard
+ * register once 'cycle' instructions have executed
+ * Returns false once there are none left.
+ */
+bool journal_read(Journal *journal, long *cycle, int *key);
+
+/* Free a journal, ending the session being recorded after 'cycle'
+ * instructions, which replays ignore
+ * Returns false (and prints why) if the recording could not be written.
+ */
+bool journal_close(Journal *journal, long cycle);
+
+#endif
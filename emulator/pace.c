@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <stdlib.h>
+#include "pace.h"
+
+#define NSEC_PER_SEC 1000000000L
+
+// How far behind the CPU may fall before pacing starts over from now
+#define PACE_MAX_LAG_NSEC (NSEC_PER_SEC / 10)
+
+// Advance a time by some nanoseconds
+static void timespec_add(struct timespec *ts, long nsec)
+{
+    ts->tv_sec += nsec / NSEC_PER_SEC;
+    ts->tv_nsec += nsec % NSEC_PER_SEC;
+    if (ts->tv_nsec >= NSEC_PER_SEC)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= NSEC_PER_SEC;
+    }
+}
+
+// Nanoseconds from a to b
+static long long timespec_diff(const struct timespec *a,
+                               const struct timespec *b)
+{
+    return (long long)(b->tv_sec - a->tv_sec) * NSEC_PER_SEC +
+           (b->tv_nsec - a->tv_nsec);
+}
+
+// Sleep until an absolute time on the monotonic clock
+static void sleep_until(const struct timespec *deadline)
+{
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) ==
+           EINTR)
+    {
+    }
+#else
+    // No clock_nanosleep on macOS, so sleep for what is left instead
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const long long left = timespec_diff(&now, deadline);
+    if (left > 0)
+    {
+        struct timespec ts = {left / NSEC_PER_SEC, left % NSEC_PER_SEC};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        {
+        }
+    }
+#endif
+}
+
+void pacer_init(Pacer *this, long hz)
+{
+    this->hz = hz;
+    this->slice = PACE_UNLIMITED_SLICE;
+    this->remainder = 0;
+    clock_gettime(CLOCK_MONOTONIC, &this->deadline);
+
+    if (hz > 0)
+    {
+        this->slice = hz / PACE_SLICES_PER_SECOND;
+        if (this->slice < 1)
+        {
+            this->slice = 1;
+        }
+    }
+}
+
+void pacer_wait(Pacer *this, long cycles)
+{
+    if (this->hz <= 0)
+    {
+        return;
+    }
+
+    /* Carry the fraction of a nanosecond over to the next slice so the rate
+     * stays exact no matter how it divides into a second.
+     */
+    const long long owed = (long long)cycles * NSEC_PER_SEC + this->remainder;
+    timespec_add(&this->deadline, owed / this->hz);
+    this->remainder = owed % this->hz;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (timespec_diff(&this->deadline, &now) > PACE_MAX_LAG_NSEC)
+    {
+        this->deadline = now;
+        this->remainder = 0;
+        return;
+    }
+
+    sleep_until(&this->deadline);
+}
+
+bool pacer_parse_hz(const char *str, long *hz)
+{
+    char *end;
+    const double value = strtod(str, &end);
+
+    double scale = 1;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        scale = 1e3;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        scale = 1e6;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        scale = 1e9;
+        end++;
+        break;
+    }
+
+    if (end == str || *end != '\0' || value < 0 || value * scale > 1e12)
+    {
+        return false;
+    }
+
+    *hz = (long)(value * scale);
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/* Paces an emulated CPU to a target clock rate.
+ *
+ * The CPU runs in slices of instructions and the pacer sleeps until the wall
+ * clock time at which the last slice would have ended on real hardware, so an
+ * idle emulator costs next to no host CPU. A rate of 0 runs unthrottled.
+ */
+
+// Slices run per second of emulated time when a rate is set
+#define PACE_SLICES_PER_SECOND 1000
+
+// Instructions per slice when running unthrottled
+#define PACE_UNLIMITED_SLICE 65536
+
+typedef struct Pacer
+{
+    long hz;     // Target instructions per second, 0 for unlimited
+    long slice;  // Instructions to run before the next call to pacer_wait
+    long remainder;           // Nanoseconds owed times hz, below one ns
+    struct timespec deadline; // When the slices run so far are due
+} Pacer;
+
+// Start pacing at 'hz' instructions per second from now
+void pacer_init(Pacer *this, long hz);
+
+/* Sleep until the instructions run since the last call are due
+ * If the CPU fell more than a moment behind, the deadline is moved up to now
+ * instead of letting it race to catch up.
+ */
+void pacer_wait(Pacer *this, long cycles);
+
+/* Parse a rate given on the command line, such as 100, 4k, 10M or 0 for
+ * unlimited
+ * Returns false if it is not a valid rate.
+ */
+bool pacer_parse_hz(const char *str, long *hz);
+
+#endif
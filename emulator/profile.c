@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+// Longest label name kept, the same limit as hackasm's
+#define PROFILE_MAX_NAME 64
+
+// Name given to the code before the first label
+#define PROFILE_START_LABEL "(start)"
+
+// Labels that mark the frame saving and restoring code hackvm emits
+#define PROFILE_SAVE_LABEL "SAVE"
+#define PROFILE_RESTORE_LABEL "RESTORE"
+
+// Jumps from entering SAVE until landing on the function called
+#define PROFILE_CALL_JUMPS 2
+
+// A label from the symbol map
+typedef struct Label
+{
+    int addr;
+    char name[PROFILE_MAX_NAME];
+} Label;
+
+/* A node of the call tree: either a function called from its parent, or a
+ * leaf counting the instructions executed under one label of the function its
+ * parent is a call of.
+ */
+typedef struct Node
+{
+    int parent; // -1 for the root
+    int label;
+    bool leaf;
+    long cycles;
+} Node;
+
+struct HackProfile
+{
+    Label *labels;
+    int num_labels;
+    int label_of[MEM_SIZE]; // Label each ROM address belongs to
+    long counts[MEM_SIZE];  // Times each ROM address executed
+
+    int save_addr, restore_addr; // -1 if the program has no such label
+
+    // Call tree, with a hash table finding a node from its parent and label
+    Node *nodes;
+    int num_nodes, max_nodes;
+    int *table;
+    int table_size;
+
+    // Function nodes of the current call stack, the innermost last
+    int *stack;
+    int depth, max_depth;
+
+    int leaf;       // Leaf node of the current label
+    int leaf_label; // Label of that node, -1 to look it up again
+    int call_jumps; // Jumps until the function being called is reached
+    bool returning; // Whether the next jump returns from a function
+};
+
+// Orders labels by address, keeping the order of the file for equal ones
+static int compare_labels(const void *a, const void *b)
+{
+    const Label *la = a, *lb = b;
+    if (la->addr != lb->addr)
+    {
+        return la->addr - lb->addr;
+    }
+    return la < lb ? -1 : la > lb;
+}
+
+// Reads the symbol map, adding PROFILE_START_LABEL if nothing starts at 0
+static bool profile_load_labels(HackProfile *this, const char *sym_path)
+{
+    FILE *fp = fopen(sym_path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", sym_path);
+        return false;
+    }
+
+    int max_labels = 64;
+    this->labels = malloc(max_labels * sizeof(Label));
+    this->num_labels = 1;
+    if (this->labels == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for symbols.\n");
+        fclose(fp);
+        return false;
+    }
+    this->labels[0].addr = 0;
+    strcpy(this->labels[0].name, PROFILE_START_LABEL);
+
+    int addr;
+    char name[PROFILE_MAX_NAME];
+    int read;
+    while ((read = fscanf(fp, "%d %63s", &addr, name)) == 2)
+    {
+        if (addr < 0 || addr >= MEM_SIZE)
+        {
+            fprintf(stderr, "Invalid address %d in %s\n", addr, sym_path);
+            fclose(fp);
+            return false;
+        }
+
+        if (this->num_labels == max_labels)
+        {
+            max_labels *= 2;
+            Label *labels = realloc(this->labels, max_labels * sizeof(Label));
+            if (labels == NULL)
+            {
+                fprintf(stderr, "Unable to allocate memory for symbols.\n");
+                fclose(fp);
+                return false;
+            }
+            this->labels = labels;
+        }
+
+        Label *label = &this->labels[this->num_labels++];
+        label->addr = addr;
+        strcpy(label->name, name);
+    }
+
+    fclose(fp);
+    if (read != EOF)
+    {
+        fprintf(stderr, "Invalid symbol map: %s\n", sym_path);
+        return false;
+    }
+
+    qsort(this->labels, this->num_labels, sizeof(Label), compare_labels);
+
+    // Where several labels share an address, the last one names its code
+    for (int i = 0; i < this->num_labels; i++)
+    {
+        const int end = i + 1 < this->num_labels ? this->labels[i + 1].addr
+                                                 : MEM_SIZE;
+        for (int addr = this->labels[i].addr; addr < end; addr++)
+        {
+            this->label_of[addr] = i;
+        }
+    }
+
+    this->save_addr = this->restore_addr = -1;
+    for (int i = 0; i < this->num_labels; i++)
+    {
+        if (strcmp(this->labels[i].name, PROFILE_SAVE_LABEL) == 0)
+        {
+            this->save_addr = this->labels[i].addr;
+        }
+        else if (strcmp(this->labels[i].name, PROFILE_RESTORE_LABEL) == 0)
+        {
+            this->restore_addr = this->labels[i].addr;
+        }
+    }
+
+    return true;
+}
+
+HackProfile *hack_profile_create(const char *sym_path)
+{
+    HackProfile *profile = calloc(1, sizeof(HackProfile));
+    if (profile == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for profile.\n");
+        return NULL;
+    }
+
+    if (!profile_load_labels(profile, sym_path))
+    {
+        hack_profile_destroy(profile);
+        return NULL;
+    }
+
+    profile->leaf_label = -1;
+    return profile;
+}
+
+void hack_profile_destroy(HackProfile *profile)
+{
+    if (profile == NULL)
+    {
+        return;
+    }
+
+    free(profile->labels);
+    free(profile->nodes);
+    free(profile->table);
+    free(profile->stack);
+    free(profile);
+}
+
+// Slot of the hash table where a node belongs or would belong
+static int profile_slot(const HackProfile *this, int parent, int label,
+                        bool leaf)
+{
+    const unsigned hash = ((unsigned)parent * 31 + label) * 2 + leaf;
+    int slot = (hash * 2654435761u) & (this->table_size - 1);
+
+    while (this->table[slot] >= 0)
+    {
+        const Node *node = &this->nodes[this->table[slot]];
+        if (node->parent == parent && node->label == label &&
+            node->leaf == leaf)
+        {
+            break;
+        }
+        slot = (slot + 1) & (this->table_size - 1);
+    }
+
+    return slot;
+}
+
+// Doubles the hash table, keeping it at most half full
+static void profile_grow_table(HackProfile *this)
+{
+    free(this->table);
+    this->table_size = this->table_size ? this->table_size * 2 : 1024;
+    this->table = malloc(this->table_size * sizeof(int));
+    if (this->table == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for profile.\n");
+        exit(1);
+    }
+
+    memset(this->table, -1, this->table_size * sizeof(int));
+    for (int i = 0; i < this->num_nodes; i++)
+    {
+        const Node *node = &this->nodes[i];
+        this->table[profile_slot(this, node->parent, node->label,
+                                 node->leaf)] = i;
+    }
+}
+
+// Finds the node for a label under a parent, adding it if there is none yet
+static int profile_node(HackProfile *this, int parent, int label, bool leaf)
+{
+    if (this->num_nodes * 2 >= this->table_size)
+    {
+        profile_grow_table(this);
+    }
+
+    const int slot = profile_slot(this, parent, label, leaf);
+    if (this->table[slot] >= 0)
+    {
+        return this->table[slot];
+    }
+
+    if (this->num_nodes == this->max_nodes)
+    {
+        this->max_nodes = this->max_nodes ? this->max_nodes * 2 : 1024;
+        this->nodes = realloc(this->nodes, this->max_nodes * sizeof(Node));
+        if (this->nodes == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory for profile.\n");
+            exit(1);
+        }
+    }
+
+    this->nodes[this->num_nodes] = (Node){parent, label, leaf, 0};
+    this->table[slot] = this->num_nodes;
+    return this->num_nodes++;
+}
+
+// Enters a call of the function whose code starts at the given label
+static void profile_push(HackProfile *this, int label)
+{
+    if (this->depth == this->max_depth)
+    {
+        this->max_depth = this->max_depth ? this->max_depth * 2 : 256;
+        this->stack = realloc(this->stack, this->max_depth * sizeof(int));
+        if (this->stack == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory for profile.\n");
+            exit(1);
+        }
+    }
+
+    const int parent = this->depth ? this->stack[this->depth - 1] : -1;
+    this->stack[this->depth++] = profile_node(this, parent, label, false);
+    this->leaf_label = -1;
+}
+
+// Follows the call convention across a jump that landed on 'target'
+static void profile_jump(HackProfile *this, int target)
+{
+    if (this->returning)
+    {
+        this->returning = false;
+        if (this->depth > 1)
+        {
+            this->depth--;
+            this->leaf_label = -1;
+        }
+    }
+
+    if (this->call_jumps > 0 && --this->call_jumps == 0 && target < MEM_SIZE)
+    {
+        profile_push(this, this->label_of[target]);
+    }
+
+    if (target == this->save_addr)
+    {
+        this->call_jumps = PROFILE_CALL_JUMPS;
+    }
+    else if (target == this->restore_addr)
+    {
+        this->returning = true;
+    }
+}
+
+long hack_profile_run(HackProfile *this, Hack *machine, long cycles)
+{
+    long executed = 0;
+
+    // Whatever runs first is the root of the call tree
+    if (this->depth == 0 && machine->pc < machine->program_size)
+    {
+        profile_push(this, this->label_of[machine->pc]);
+    }
+
+    while (executed < cycles && machine->pc < machine->program_size)
+    {
+        const uint16_t pc = machine->pc;
+        const int label = this->label_of[pc];
+
+        this->counts[pc]++;
+        if (label != this->leaf_label)
+        {
+            this->leaf = profile_node(this, this->stack[this->depth - 1],
+                                      label, true);
+            this->leaf_label = label;
+        }
+        this->nodes[this->leaf].cycles++;
+
+        hack_execute(machine);
+        executed++;
+
+        if (machine->pc != (uint16_t)(pc + 1))
+        {
+            profile_jump(this, machine->pc);
+        }
+    }
+
+    return executed;
+}
+
+// Labels with their totals, for sorting the flat profile
+typedef struct LabelTotal
+{
+    int label;
+    long cycles;
+} LabelTotal;
+
+// Orders totals from most to least executed, then by address
+static int compare_totals(const void *a, const void *b)
+{
+    const LabelTotal *ta = a, *tb = b;
+    if (ta->cycles != tb->cycles)
+    {
+        return ta->cycles < tb->cycles ? 1 : -1;
+    }
+    return ta->label - tb->label;
+}
+
+void hack_profile_print(const HackProfile *this, FILE *fp)
+{
+    LabelTotal *totals = calloc(this->num_labels, sizeof(LabelTotal));
+    if (totals == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for profile.\n");
+        return;
+    }
+
+    long total = 0;
+    for (int i = 0; i < this->num_labels; i++)
+    {
+        totals[i].label = i;
+    }
+    for (int addr = 0; addr < MEM_SIZE; addr++)
+    {
+        totals[this->label_of[addr]].cycles += this->counts[addr];
+        total += this->counts[addr];
+    }
+
+    qsort(totals, this->num_labels, sizeof(LabelTotal), compare_totals);
+
+    fprintf(fp, "%14s %7s  %-6s %s\n", "cycles", "%", "addr", "label");
+    for (int i = 0; i < this->num_labels && totals[i].cycles > 0; i++)
+    {
+        const Label *label = &this->labels[totals[i].label];
+        fprintf(fp, "%14ld %6.2f%%  %-6d %s\n", totals[i].cycles,
+                100.0 * totals[i].cycles / total, label->addr, label->name);
+    }
+
+    free(totals);
+}
+
+bool hack_profile_save_stacks(const HackProfile *this, const char *filepath)
+{
+    FILE *fp = fopen(filepath, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", filepath);
+        return false;
+    }
+
+    int max_path = 64;
+    int *path = malloc(max_path * sizeof(int));
+    if (path == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for profile.\n");
+        fclose(fp);
+        return false;
+    }
+
+    for (int i = 0; i < this->num_nodes; i++)
+    {
+        const Node *leaf = &this->nodes[i];
+        if (!leaf->leaf || leaf->cycles == 0)
+        {
+            continue;
+        }
+
+        // Collect the labels from the leaf up to the root
+        int length = 0;
+        for (int n = i; n >= 0; n = this->nodes[n].parent)
+        {
+            if (length == max_path)
+            {
+                max_path *= 2;
+                int *longer = realloc(path, max_path * sizeof(int));
+                if (longer == NULL)
+                {
+                    fprintf(stderr, "Unable to allocate memory for profile.\n");
+                    free(path);
+                    fclose(fp);
+                    return false;
+                }
+                path = longer;
+            }
+            path[length++] = this->nodes[n].label;
+        }
+
+        // A leaf named after its own function adds nothing to the stack
+        const int skip = length > 1 && path[0] == path[1];
+        for (int j = length - 1; j >= skip; j--)
+        {
+            fprintf(fp, "%s%c", this->labels[path[j]].name,
+                    j > skip ? ';' : ' ');
+        }
+        fprintf(fp, "%ld\n", leaf->cycles);
+    }
+
+    free(path);
+    fclose(fp);
+    return true;
+}
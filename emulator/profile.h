@@ -0,0 +1,44 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "emulib.h"
+
+/* Counts how many times each ROM address executes and maps the counts back
+ * to the labels of the assembly, using the symbol map hackasm writes next to
+ * its output (out.sym: one "<address> <label>" per line).
+ *
+ * Every address belongs to the nearest label at or before it. Calls are
+ * inferred from the convention hackvm emits: a jump to SAVE starts a call and
+ * the second jump after it lands on the function called, while a jump to
+ * RESTORE returns from it on the jump that ends RESTORE. Programs without
+ * those labels are simply profiled as a single frame.
+ */
+typedef struct HackProfile HackProfile;
+
+/* Create an empty profile for the labels in a symbol map
+ * Returns NULL (and prints why) if unable to read it or allocate memory.
+ */
+HackProfile *hack_profile_create(const char *sym_path);
+
+// Free a profile
+void hack_profile_destroy(HackProfile *profile);
+
+/* Execute up to 'cycles' instructions like hack_execute, counting each one,
+ * stopping early once the program counter leaves the program.
+ * Returns the number of instructions executed.
+ */
+long hack_profile_run(HackProfile *profile, Hack *machine, long cycles);
+
+// Print the instructions executed under each label, most executed first
+void hack_profile_print(const HackProfile *profile, FILE *fp);
+
+/* Save the instructions executed under each call stack in the collapsed
+ * format read by flamegraph.pl and similar tools, one "caller;...;callee
+ * count" per line, where the last frame is the label within the function.
+ * Returns false if unable to open file.
+ */
+bool hack_profile_save_stacks(const HackProfile *profile,
+                              const char *filepath);
+
+#endif
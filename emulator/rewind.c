@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+
+// What an entry holds, in this order between its two copies of the flags
+#define REWIND_A 0x1  // Old A register
+#define REWIND_D 0x2  // Old D register
+#define REWIND_M 0x4  // Address and old value of the RAM word stored to
+#define REWIND_PC 0x8 // Old PC, only when it did not simply move on by one
+
+// Largest entry: both copies of the flags and every field
+#define REWIND_MAX_ENTRY 12
+
+/* Entries are stored back to back in a ring of bytes, each one starting and
+ * ending with its flags so it can be found from either end: from the oldest
+ * when making room and from the newest when stepping back.
+ */
+struct HackRewind
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t head; // Where the next entry goes
+    size_t used; // Bytes of entries, which end at head
+    long count;  // Number of entries
+};
+
+// Size in bytes of an entry with the given flags
+static size_t rewind_entry_size(uint8_t flags)
+{
+    return 2 + ((flags & REWIND_A) ? 2 : 0) + ((flags & REWIND_D) ? 2 : 0) +
+           ((flags & REWIND_M) ? 4 : 0) + ((flags & REWIND_PC) ? 2 : 0);
+}
+
+// Appends a 16-bit value to an entry being built
+static uint8_t *rewind_put(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+    return p + 2;
+}
+
+// Reads a 16-bit value from an entry being undone
+static const uint8_t *rewind_get(const uint8_t *p, uint16_t *value)
+{
+    *value = p[0] | p[1] << 8;
+    return p + 2;
+}
+
+HackRewind *hack_rewind_create(size_t bytes)
+{
+    if (bytes < REWIND_MAX_ENTRY)
+    {
+        bytes = REWIND_MAX_ENTRY;
+    }
+
+    HackRewind *rewind = calloc(1, sizeof(HackRewind));
+    if (rewind != NULL)
+    {
+        rewind->buffer = malloc(bytes);
+    }
+    if (rewind == NULL || rewind->buffer == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for rewind history.\n");
+        free(rewind);
+        return NULL;
+    }
+
+    rewind->size = bytes;
+    return rewind;
+}
+
+void hack_rewind_destroy(HackRewind *rewind)
+{
+    if (rewind == NULL)
+    {
+        return;
+    }
+
+    free(rewind->buffer);
+    free(rewind);
+}
+
+void hack_rewind_clear(HackRewind *rewind)
+{
+    rewind->head = 0;
+    rewind->used = 0;
+    rewind->count = 0;
+}
+
+long hack_rewind_available(const HackRewind *rewind)
+{
+    return rewind->count;
+}
+
+// Appends an entry, forgetting the oldest ones to make room for it
+static void rewind_push(HackRewind *this, const uint8_t *entry, size_t size)
+{
+    while (this->used + size > this->size)
+    {
+        const size_t oldest = (this->head + this->size - this->used) %
+                              this->size;
+        this->used -= rewind_entry_size(this->buffer[oldest]);
+        this->count--;
+    }
+
+    // The entry may wrap around the end of the buffer
+    const size_t room = this->size - this->head;
+    const size_t first = size < room ? size : room;
+    memcpy(this->buffer + this->head, entry, first);
+    memcpy(this->buffer, entry + first, size - first);
+
+    this->head = (this->head + size) % this->size;
+    this->used += size;
+    this->count++;
+}
+
+// Removes the newest entry into 'entry', returning its size
+static size_t rewind_pop(HackRewind *this, uint8_t *entry)
+{
+    const uint8_t flags = this->buffer[(this->head + this->size - 1) %
+                                       this->size];
+    const size_t size = rewind_entry_size(flags);
+    const size_t start = (this->head + this->size - size) % this->size;
+
+    const size_t room = this->size - start;
+    const size_t first = size < room ? size : room;
+    memcpy(entry, this->buffer + start, first);
+    memcpy(entry + first, this->buffer, size - first);
+
+    this->head = start;
+    this->used -= size;
+    this->count--;
+    return size;
+}
+
+long hack_rewind_run(HackRewind *rewind, Hack *machine, long cycles)
+{
+    long executed = 0;
+
+    while (executed < cycles && machine->pc < machine->program_size)
+    {
+        const uint16_t pc = machine->pc;
+        const int16_t a = machine->a_reg;
+        const int16_t d = machine->d_reg;
+        const uint16_t addr = (uint16_t)a & (MEM_SIZE - 1);
+        const int16_t m = machine->ram[addr];
+
+        hack_execute(machine);
+        executed++;
+
+        uint8_t flags = 0;
+        flags |= machine->a_reg != a ? REWIND_A : 0;
+        flags |= machine->d_reg != d ? REWIND_D : 0;
+        flags |= machine->ram[addr] != m ? REWIND_M : 0;
+        flags |= machine->pc != (uint16_t)(pc + 1) ? REWIND_PC : 0;
+
+        uint8_t entry[REWIND_MAX_ENTRY];
+        uint8_t *p = entry;
+        *p++ = flags;
+        if (flags & REWIND_A)
+        {
+            p = rewind_put(p, a);
+        }
+        if (flags & REWIND_D)
+        {
+            p = rewind_put(p, d);
+        }
+        if (flags & REWIND_M)
+        {
+            p = rewind_put(p, addr);
+            p = rewind_put(p, m);
+        }
+        if (flags & REWIND_PC)
+        {
+            p = rewind_put(p, pc);
+        }
+        *p++ = flags;
+
+        rewind_push(rewind, entry, p - entry);
+    }
+
+    return executed;
+}
+
+long hack_rewind_back(HackRewind *rewind, Hack *machine, long cycles)
+{
+    long undone = 0;
+
+    while (undone < cycles && rewind->count > 0)
+    {
+        uint8_t entry[REWIND_MAX_ENTRY];
+        rewind_pop(rewind, entry);
+
+        const uint8_t flags = entry[0];
+        const uint8_t *p = entry + 1;
+        uint16_t value;
+
+        if (flags & REWIND_A)
+        {
+            p = rewind_get(p, &value);
+            machine->a_reg = value;
+        }
+        if (flags & REWIND_D)
+        {
+            p = rewind_get(p, &value);
+            machine->d_reg = value;
+        }
+        if (flags & REWIND_M)
+        {
+            uint16_t addr;
+            p = rewind_get(p, &addr);
+            p = rewind_get(p, &value);
+            machine->ram[addr] = value;
+            machine->dirty_rows[addr / HACK_ROW_WORDS] = 1;
+        }
+        if (flags & REWIND_PC)
+        {
+            p = rewind_get(p, &value);
+            machine->pc = value;
+        }
+        else
+        {
+            machine->pc--;
+        }
+
+        undone++;
+    }
+
+    return undone;
+}
@@ -0,0 +1,50 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include "emulib.h"
+
+/* A history of the instructions executed by a machine, so that execution can
+ * be stepped backwards.
+ *
+ * Rather than snapshots, every instruction records only what it changed: the
+ * old A and D registers if they changed, the old value of the RAM word it
+ * stored to, and the old PC if it jumped. Most instructions take 2 to 6 bytes.
+ * The history lives in a ring buffer of fixed size, forgetting the oldest
+ * instructions once it is full.
+ *
+ * Only changes made by the CPU are recorded: anything else writing to RAM,
+ * such as the keyboard, is not undone by stepping back.
+ */
+typedef struct HackRewind HackRewind;
+
+/* Create an empty history of at most 'bytes' bytes
+ * Returns NULL if unable to allocate memory
+ */
+HackRewind *hack_rewind_create(size_t bytes);
+
+// Free a history
+void hack_rewind_destroy(HackRewind *rewind);
+
+/* Forget all history
+ * Must be called whenever the machine changes other than by hack_rewind_run,
+ * such as when it is restored from a snapshot.
+ */
+void hack_rewind_clear(HackRewind *rewind);
+
+// Number of instructions that can currently be stepped back
+long hack_rewind_available(const HackRewind *rewind);
+
+/* Execute up to 'cycles' instructions like hack_execute, recording each one,
+ * stopping early once the program counter leaves the program.
+ * Returns the number of instructions executed.
+ */
+long hack_rewind_run(HackRewind *rewind, Hack *machine, long cycles);
+
+/* Undo up to the last 'cycles' instructions recorded, newest first
+ * Returns the number of instructions undone, which is less than 'cycles' if
+ * the history does not reach back that far.
+ */
+long hack_rewind_back(HackRewind *rewind, Hack *machine, long cycles);
+
+#endif
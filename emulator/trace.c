@@ -0,0 +1,464 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define TRACE_MAGIC_LEN (sizeof(HACK_TRACE_MAGIC) - 1)
+
+// What a step holds besides its flags, in this order
+#define TRACE_PC 0x01      // PC, only when it did not simply move on by one
+#define TRACE_A 0x02       // Change of A, only for C instructions
+#define TRACE_D 0x04       // Change of D
+#define TRACE_STORE 0x08   // Value stored to RAM
+#define TRACE_STORE_D 0x10 // A store of the new D, which takes no bytes
+#define TRACE_END 0x80     // Not a step: the number of steps follows
+
+/* Largest step: flags, the PC and both changes as varints, and a value, which
+ * is also enough for the end of the trace
+ */
+#define TRACE_MAX_STEP 12
+
+/* The ring buffer is made of blocks so that the CPU thread only has to
+ * synchronize with the writer once per block
+ */
+#define TRACE_BLOCK_SIZE (64 * 1024)
+#define TRACE_NUM_BLOCKS 16
+
+struct HackTrace
+{
+    FILE *fp;
+
+    // Registers after the last step, and the PC the next one is expected at
+    uint16_t pc;
+    int16_t a, d;
+    long cycle;
+
+    // Recording: blocks are filled at 'head' and written from 'tail'
+    uint8_t *blocks;
+    size_t sizes[TRACE_NUM_BLOCKS]; // Bytes used by each full block
+    int head, tail, full;
+    uint8_t *next, *limit; // Where the next step goes in the head block
+    bool done;             // Set once the last block is full
+    pthread_mutex_t lock;
+    pthread_cond_t filled, emptied;
+    pthread_t writer;
+
+    // Reading: the ROM to fetch instructions from and a buffer of the file
+    uint16_t rom[MEM_SIZE];
+    int program_size;
+    uint8_t input[TRACE_BLOCK_SIZE];
+    size_t input_pos, input_len;
+    bool ended, valid;
+};
+
+// Appends an unsigned LEB128 varint to a step being built
+static uint8_t *trace_put_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+// Appends the change between two 16-bit values as a zigzag varint
+static uint8_t *trace_put_change(uint8_t *p, int16_t from, int16_t to)
+{
+    const int16_t change = (uint16_t)to - (uint16_t)from;
+    const uint16_t zigzag = (uint16_t)(change * 2) ^ (uint16_t)(change >> 15);
+    return trace_put_varint(p, zigzag);
+}
+
+// Writes a 16-bit little-endian word to the file
+static void trace_write_word(FILE *fp, uint16_t word)
+{
+    fputc(word & 0xFF, fp);
+    fputc(word >> 8, fp);
+}
+
+// Writes the blocks the CPU thread has filled until it fills the last one
+static void *trace_writer(void *data)
+{
+    HackTrace *this = data;
+
+    pthread_mutex_lock(&this->lock);
+    while (this->full > 0 || !this->done)
+    {
+        if (this->full == 0)
+        {
+            pthread_cond_wait(&this->filled, &this->lock);
+            continue;
+        }
+
+        // The CPU thread never touches full blocks, so write without the lock
+        const uint8_t *block = this->blocks + this->tail * TRACE_BLOCK_SIZE;
+        const size_t size = this->sizes[this->tail];
+        pthread_mutex_unlock(&this->lock);
+        fwrite(block, 1, size, this->fp);
+        pthread_mutex_lock(&this->lock);
+
+        this->tail = (this->tail + 1) % TRACE_NUM_BLOCKS;
+        this->full--;
+        pthread_cond_signal(&this->emptied);
+    }
+    pthread_mutex_unlock(&this->lock);
+
+    return NULL;
+}
+
+/* Hands the head block to the writer and moves on to the next one, waiting
+ * for the writer if every block is full
+ */
+static void trace_submit(HackTrace *this, bool last)
+{
+    uint8_t *block = this->blocks + this->head * TRACE_BLOCK_SIZE;
+
+    pthread_mutex_lock(&this->lock);
+    this->sizes[this->head] = this->next - block;
+    this->full++;
+    this->done = last;
+    pthread_cond_signal(&this->filled);
+
+    while (this->full == TRACE_NUM_BLOCKS)
+    {
+        pthread_cond_wait(&this->emptied, &this->lock);
+    }
+    this->head = (this->head + 1) % TRACE_NUM_BLOCKS;
+    pthread_mutex_unlock(&this->lock);
+
+    block = this->blocks + this->head * TRACE_BLOCK_SIZE;
+    this->next = block;
+    this->limit = block + TRACE_BLOCK_SIZE - TRACE_MAX_STEP;
+}
+
+HackTrace *hack_trace_record(const char *path, const Hack *machine)
+{
+    HackTrace *trace = calloc(1, sizeof(HackTrace));
+    if (trace != NULL)
+    {
+        trace->blocks = malloc(TRACE_NUM_BLOCKS * TRACE_BLOCK_SIZE);
+    }
+    if (trace == NULL || trace->blocks == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for trace.\n");
+        free(trace);
+        return NULL;
+    }
+
+    trace->fp = fopen(path, "wb");
+    if (trace->fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        free(trace->blocks);
+        free(trace);
+        return NULL;
+    }
+
+    fwrite(HACK_TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace->fp);
+    trace_write_word(trace->fp, machine->program_size);
+    for (int i = 0; i < machine->program_size; i++)
+    {
+        trace_write_word(trace->fp, machine->rom[i]);
+    }
+    trace_write_word(trace->fp, machine->pc);
+    trace_write_word(trace->fp, machine->a_reg);
+    trace_write_word(trace->fp, machine->d_reg);
+
+    trace->pc = machine->pc;
+    trace->a = machine->a_reg;
+    trace->d = machine->d_reg;
+    trace->next = trace->blocks;
+    trace->limit = trace->blocks + TRACE_BLOCK_SIZE - TRACE_MAX_STEP;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->filled, NULL);
+    pthread_cond_init(&trace->emptied, NULL);
+    if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0)
+    {
+        fprintf(stderr, "Unable to start the trace writer.\n");
+        fclose(trace->fp);
+        free(trace->blocks);
+        free(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+long hack_trace_run(HackTrace *trace, Hack *machine, long cycles)
+{
+    long executed = 0;
+
+    while (executed < cycles && machine->pc < machine->program_size)
+    {
+        if (trace->next > trace->limit)
+        {
+            trace_submit(trace, false);
+        }
+
+        const uint16_t pc = machine->pc;
+        const HackOp op = machine->ops[pc];
+        const uint16_t addr = (uint16_t)machine->a_reg & (MEM_SIZE - 1);
+
+        hack_execute(machine);
+        executed++;
+
+        const bool c_instruction = op.alu != HACK_ALU_LOAD;
+        const bool stored = c_instruction && (op.dest & HACK_DEST_M);
+        const int16_t value = machine->ram[addr];
+
+        uint8_t flags = 0;
+        flags |= pc != trace->pc ? TRACE_PC : 0;
+        flags |= c_instruction && machine->a_reg != trace->a ? TRACE_A : 0;
+        flags |= machine->d_reg != trace->d ? TRACE_D : 0;
+        if (stored)
+        {
+            flags |= value == machine->d_reg ? TRACE_STORE_D : TRACE_STORE;
+        }
+
+        uint8_t *p = trace->next;
+        *p++ = flags;
+        if (flags & TRACE_PC)
+        {
+            p = trace_put_varint(p, pc);
+        }
+        if (flags & TRACE_A)
+        {
+            p = trace_put_change(p, trace->a, machine->a_reg);
+        }
+        if (flags & TRACE_D)
+        {
+            p = trace_put_change(p, trace->d, machine->d_reg);
+        }
+        if (flags & TRACE_STORE)
+        {
+            *p++ = (uint16_t)value & 0xFF;
+            *p++ = (uint16_t)value >> 8;
+        }
+        trace->next = p;
+
+        trace->pc = pc + 1;
+        trace->a = machine->a_reg;
+        trace->d = machine->d_reg;
+        trace->cycle++;
+    }
+
+    return executed;
+}
+
+// Reads a byte of an opened trace, returning false at the end of the file
+static bool trace_get_byte(HackTrace *this, uint8_t *byte)
+{
+    if (this->input_pos == this->input_len)
+    {
+        this->input_len = fread(this->input, 1, TRACE_BLOCK_SIZE, this->fp);
+        this->input_pos = 0;
+        if (this->input_len == 0)
+        {
+            return false;
+        }
+    }
+
+    *byte = this->input[this->input_pos++];
+    return true;
+}
+
+// Reads an unsigned LEB128 varint, returning false if the file ends first
+static bool trace_get_varint(HackTrace *this, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t byte;
+        if (!trace_get_byte(this, &byte))
+        {
+            return false;
+        }
+
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Reads a change written by trace_put_change and applies it to a register
+static bool trace_get_change(HackTrace *this, int16_t *reg)
+{
+    uint64_t zigzag;
+    if (!trace_get_varint(this, &zigzag))
+    {
+        return false;
+    }
+
+    const uint16_t change = (zigzag >> 1) ^ -(zigzag & 1);
+    *reg = (uint16_t)*reg + change;
+    return true;
+}
+
+// Reads a 16-bit little-endian word
+static bool trace_get_word(HackTrace *this, uint16_t *word)
+{
+    uint8_t low, high;
+    if (!trace_get_byte(this, &low) || !trace_get_byte(this, &high))
+    {
+        return false;
+    }
+
+    *word = low | high << 8;
+    return true;
+}
+
+HackTrace *hack_trace_open(const char *path)
+{
+    HackTrace *trace = calloc(1, sizeof(HackTrace));
+    if (trace == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory for trace.\n");
+        return NULL;
+    }
+
+    trace->fp = fopen(path, "rb");
+    if (trace->fp == NULL)
+    {
+        fprintf(stderr, "Unable to open %s\n", path);
+        free(trace);
+        return NULL;
+    }
+
+    char magic[TRACE_MAGIC_LEN];
+    uint16_t size = 0;
+    bool valid = fread(magic, 1, TRACE_MAGIC_LEN, trace->fp) ==
+                     TRACE_MAGIC_LEN &&
+                 memcmp(magic, HACK_TRACE_MAGIC, TRACE_MAGIC_LEN) == 0 &&
+                 trace_get_word(trace, &size) && size <= MEM_SIZE;
+
+    for (int i = 0; valid && i < size; i++)
+    {
+        valid = trace_get_word(trace, &trace->rom[i]);
+    }
+
+    uint16_t a = 0, d = 0;
+    valid = valid && trace_get_word(trace, &trace->pc) &&
+            trace_get_word(trace, &a) && trace_get_word(trace, &d);
+    if (!valid)
+    {
+        fprintf(stderr, "Invalid trace: %s\n", path);
+        fclose(trace->fp);
+        free(trace);
+        return NULL;
+    }
+
+    trace->program_size = size;
+    trace->a = a;
+    trace->d = d;
+    trace->valid = true;
+    return trace;
+}
+
+bool hack_trace_read(HackTrace *trace, HackTraceStep *step)
+{
+    uint8_t flags;
+    if (trace->ended || !trace->valid || !trace_get_byte(trace, &flags))
+    {
+        trace->valid = trace->valid && trace->ended;
+        return false;
+    }
+
+    if (flags & TRACE_END)
+    {
+        uint64_t count;
+        trace->ended = true;
+        trace->valid = flags == TRACE_END &&
+                       trace_get_varint(trace, &count) &&
+                       count == (uint64_t)trace->cycle;
+        return false;
+    }
+
+    step->cycle = trace->cycle;
+    step->addr = (uint16_t)trace->a & (MEM_SIZE - 1);
+
+    uint64_t pc = trace->pc;
+    bool valid = !(flags & TRACE_PC) || trace_get_varint(trace, &pc);
+    step->pc = pc;
+    step->instruction =
+        pc < (uint64_t)trace->program_size ? trace->rom[pc] : 0;
+
+    // A instructions load themselves, and only C instructions record changes
+    const bool c_instruction = step->instruction & 0x8000;
+    if (!c_instruction)
+    {
+        trace->a = step->instruction;
+        valid = valid && !(flags & TRACE_A);
+    }
+    valid = valid && (!(flags & TRACE_A) || trace_get_change(trace, &trace->a));
+    valid = valid && (!(flags & TRACE_D) || trace_get_change(trace, &trace->d));
+
+    uint16_t value = trace->d;
+    step->stored = flags & (TRACE_STORE | TRACE_STORE_D);
+    valid = valid && (!(flags & TRACE_STORE) || trace_get_word(trace, &value));
+    step->value = value;
+
+    step->a = trace->a;
+    step->d = trace->d;
+    trace->pc = pc + 1;
+    trace->cycle++;
+
+    trace->valid = valid;
+    return valid;
+}
+
+bool hack_trace_close(HackTrace *trace)
+{
+    if (trace == NULL)
+    {
+        return true;
+    }
+
+    bool written = true;
+    if (trace->blocks != NULL)
+    {
+        // End the trace in the last block and wait for the writer to finish
+        if (trace->next > trace->limit)
+        {
+            trace_submit(trace, false);
+        }
+        uint8_t *p = trace->next;
+        *p++ = TRACE_END;
+        trace->next = trace_put_varint(p, trace->cycle);
+        trace_submit(trace, true);
+        pthread_join(trace->writer, NULL);
+
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->filled);
+        pthread_cond_destroy(&trace->emptied);
+        free(trace->blocks);
+
+        written = !ferror(trace->fp);
+        written = fclose(trace->fp) == 0 && written;
+        if (!written)
+        {
+            fprintf(stderr, "Unable to write the trace.\n");
+        }
+        free(trace);
+        return written;
+    }
+
+    if (!trace->valid)
+    {
+        fprintf(stderr, "Invalid trace: cut short or corrupt after %ld"
+                        " steps.\n",
+                trace->cycle);
+    }
+
+    written = trace->valid;
+    fclose(trace->fp);
+    free(trace);
+    return written;
+}
@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include "emulib.h"
+
+/* A trace of every instruction a machine executes, written to a file as the
+ * machine runs so that two runs can be compared step by step afterwards.
+ *
+ * The CPU thread encodes steps into blocks of a ring buffer and a writer
+ * thread of the trace's own writes the full blocks to the file, so the CPU
+ * never waits on the disk unless it outruns it by the whole ring.
+ *
+ * The file starts with HACK_TRACE_MAGIC, the program size, the ROM and the
+ * registers the run started with, all as 16-bit little-endian words. Each
+ * step follows as a byte of flags and only what the reader cannot work out
+ * from the ROM and the steps before it: the PC if it jumped, the change of
+ * A (only for C instructions) and D as zigzag LEB128 varints, and the value
+ * stored, unless it is the new D. The store's address is always A before
+ * the step. Most steps take 1 to 3 bytes. A byte of flags no step has and
+ * the number of steps as a varint end the file.
+ */
+#define HACK_TRACE_MAGIC "HKTR"
+
+// A single instruction executed
+typedef struct HackTraceStep
+{
+    long cycle; // Instructions executed before this one
+    uint16_t pc;
+    uint16_t instruction;
+    int16_t a, d; // Registers once it executed
+    bool stored;  // Whether it stored to RAM, at 'addr'
+    uint16_t addr;
+    int16_t value;
+} HackTraceStep;
+
+typedef struct HackTrace HackTrace;
+
+/* Start tracing a machine to a file, from its current state
+ * Returns NULL (and prints why) if unable to open the file or start the
+ * writer thread.
+ */
+HackTrace *hack_trace_record(const char *path, const Hack *machine);
+
+/* Execute up to 'cycles' instructions like hack_execute, tracing each one,
+ * stopping early once the program counter leaves the program.
+ * Returns the number of instructions executed.
+ */
+long hack_trace_run(HackTrace *trace, Hack *machine, long cycles);
+
+/* Open a trace to read back
+ * Returns NULL (and prints why) if it cannot be read.
+ */
+HackTrace *hack_trace_open(const char *path);
+
+/* Read the next step of an opened trace
+ * Returns false once there are none left, or if the trace is cut short or
+ * corrupt, which hack_trace_close reports.
+ */
+bool hack_trace_read(HackTrace *trace, HackTraceStep *step);
+
+/* Free a trace, finishing the file of one being recorded
+ * Returns false (and prints why) if a recording could not be written
+ * completely or a trace being read was not valid up to where it was read.
+ */
+bool hack_trace_close(HackTrace *trace);
+
+#endif
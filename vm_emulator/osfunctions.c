@@ -690,110 +690,51 @@ sys_halt(Vm *this){
 	//this->haltcount++;
 }
 
-int
-check_os_function(Vm *this){
-	int handled = 0;
-
+// The functions of the Jack OS handled by built-in code
+const VmOsFunction vm_os_functions[] = {
 	// Math.vm
-	if(strcmp(this->label[this->pc], "Math.multiply") == 0){
-		math_multiply(this);
-		handled++;
-	}else if(strcmp(this->label[this->pc], "Math.divide") == 0){
-		math_divide(this);
-		handled++;
-	}else if(strcmp(this->label[this->pc], "Math.sqrt") == 0){
-		math_sqrt(this);
-		handled++;
-	}else if(strcmp(this->label[this->pc], "Math.min") == 0){
-		math_min(this);
-		handled++;
-	}else if(strcmp(this->label[this->pc], "Math.max") == 0){
-		math_max(this);
-		handled++;
-	}else if(strcmp(this->label[this->pc], "Math.abs") == 0){
-		math_abs(this);
-		handled++;
-	} else if(strcmp(this->label[this->pc], "Math.init") == 0){
-		math_init(this);
-		handled++;
-	} else
-
+	{"Math.multiply", math_multiply},
+	{"Math.divide", math_divide},
+	{"Math.sqrt", math_sqrt},
+	{"Math.min", math_min},
+	{"Math.max", math_max},
+	{"Math.abs", math_abs},
+	{"Math.init", math_init},
 
 	// Sys.vm
-	if(strcmp(this->label[this->pc], "Sys.halt") == 0){
-		sys_halt(this);
-		handled++;
-	}
-
+	{"Sys.halt", sys_halt},
 
 	// Screen.vm
-	else if(strcmp(this->label[this->pc], "Screen.init") == 0){
-		screen_init(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.clearScreen") == 0){
-		screen_clearScreen(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.darkScreen") == 0){
-		screen_darkScreen(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.invertScreen") == 0){
-		screen_invertScreen(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.setColor") == 0){
-		screen_setColor(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.drawPixel") == 0){
-		screen_drawPixel(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.drawLine") == 0){
-		screen_drawLine(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.drawRectangle") == 0){
-		screen_drawRectangle(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Screen.drawCircle") == 0){
-		screen_drawCircle(this);
-		handled++;
-	}
+	{"Screen.init", screen_init},
+	{"Screen.clearScreen", screen_clearScreen},
+	{"Screen.darkScreen", screen_darkScreen},
+	{"Screen.invertScreen", screen_invertScreen},
+	{"Screen.setColor", screen_setColor},
+	{"Screen.drawPixel", screen_drawPixel},
+	{"Screen.drawLine", screen_drawLine},
+	{"Screen.drawRectangle", screen_drawRectangle},
+	{"Screen.drawCircle", screen_drawCircle},
 
 	// Memory.vm
-	else if(strcmp(this->label[this->pc], "Memory.init") == 0){
-		memory_init(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Memory.alloc") == 0){
-		memory_alloc(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Memory.deAlloc") == 0){
-		memory_dealloc(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Memory.peek") == 0){
-		memory_peek(this);
-		handled++;
-	}
-	else if(strcmp(this->label[this->pc], "Memory.poke") == 0){
-		memory_poke(this);
-		handled++;
-	}
+	{"Memory.init", memory_init},
+	{"Memory.alloc", memory_alloc},
+	{"Memory.deAlloc", memory_dealloc},
+	{"Memory.peek", memory_peek},
+	{"Memory.poke", memory_poke},
 
 	// Array.vm (note that this is mapped to Memory.alloc and Memory.deAlloc)
-	else if(strcmp(this->label[this->pc], "Array.new") == 0){
-		memory_alloc(this);
-		handled++;
-	} else if(strcmp(this->label[this->pc], "Array.dispose") == 0){
-		memory_dealloc(this);
-		handled++;
-	}
+	{"Array.new", memory_alloc},
+	{"Array.dispose", memory_dealloc},
+
+	{NULL, NULL}
+};
 
-	return handled;
+int
+vm_find_os_function(const char *name){
+	for(int i=0;vm_os_functions[i].name != NULL;i++){
+		if(strcmp(name, vm_os_functions[i].name) == 0){
+			return i+1;
+		}
+	}
+	return 0;
 }
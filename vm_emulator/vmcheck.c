@@ -0,0 +1,192 @@
+//Runs small VM programs on vm_run and vm_run_ir in lockstep with vm_execute, and reports the
+//first slice after which either one left the machine differently
+//Context: nand2tetris
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmemulib.h"
+
+#define CHECK_CYCLES 20000 //instructions each program runs for
+#define CHECK_MAX_SLICE 40 //slices are 1 to this long, to stop in every line of a group
+
+// A line of a program, as vmemu would parse it
+typedef struct CheckLine
+{
+    int opcode;
+    int segment;
+    int arg;
+    const char *label;
+} CheckLine;
+
+#define PUSH(segment, arg) {VM_PUSH, segment, arg, ""}
+#define POP(segment, arg) {VM_POP, segment, arg, ""}
+#define OP(opcode) {opcode, VM_NO_SEGMENT, -1, ""}
+#define JUMP(opcode, label) {opcode, VM_NO_SEGMENT, -1, label}
+#define CALL(label, nargs) {VM_CALL, VM_NO_SEGMENT, nargs, label}
+#define FUNCTION(label, nlocals) {VM_FUNCTION, VM_NO_SEGMENT, nlocals, label}
+
+/* Calls right after labels, which start a group with the call, to VM code and (when
+ * OVERRIDE_OS_FUNCTIONS is set) to built-in code, with and without arguments pushed
+ * before the label, and an array store through pointer 1 and that.
+ */
+static const CheckLine calls_after_labels[] = {
+    CALL("Sys.init", 0),
+    JUMP(VM_LABEL, "Boot$HALT"),
+    JUMP(VM_GOTO, "Boot$HALT"),
+
+    FUNCTION("Sys.init", 0),
+    JUMP(VM_LABEL, "Sys.init$LOOP"),
+    CALL("Main.bump", 0),
+    POP(VM_TEMP, 0),
+    JUMP(VM_LABEL, "Sys.init$NATIVE"),
+    CALL("Screen.clearScreen", 0),
+    POP(VM_TEMP, 1),
+    PUSH(VM_STATIC, 0),
+    PUSH(VM_CONSTANT, 7),
+    JUMP(VM_LABEL, "Sys.init$ARGS"),
+    CALL("Math.multiply", 2),
+    POP(VM_STATIC, 1),
+    PUSH(VM_CONSTANT, 3000),
+    PUSH(VM_STATIC, 0),
+    OP(VM_ADD),
+    PUSH(VM_STATIC, 1),
+    POP(VM_TEMP, 0),
+    POP(VM_POINTER, 1),
+    PUSH(VM_TEMP, 0),
+    POP(VM_THAT, 0),
+    PUSH(VM_STATIC, 0),
+    PUSH(VM_CONSTANT, 100),
+    OP(VM_LT),
+    OP(VM_NOT),
+    JUMP(VM_IFGOTO, "Sys.init$END"),
+    JUMP(VM_GOTO, "Sys.init$LOOP"),
+    JUMP(VM_LABEL, "Sys.init$END"),
+    PUSH(VM_CONSTANT, 0),
+    OP(VM_RETURN),
+
+    FUNCTION("Main.bump", 0),
+    PUSH(VM_STATIC, 0),
+    PUSH(VM_CONSTANT, 1),
+    OP(VM_ADD),
+    POP(VM_STATIC, 0),
+    PUSH(VM_CONSTANT, 0),
+    OP(VM_RETURN),
+
+    // What the built-in code does, for when it is not used
+    FUNCTION("Screen.clearScreen", 0),
+    PUSH(VM_CONSTANT, 0),
+    OP(VM_RETURN),
+
+    FUNCTION("Math.multiply", 1),
+    JUMP(VM_LABEL, "Math.multiply$LOOP"),
+    PUSH(VM_ARGUMENT, 1),
+    PUSH(VM_CONSTANT, 0),
+    OP(VM_EQ),
+    JUMP(VM_IFGOTO, "Math.multiply$END"),
+    PUSH(VM_LOCAL, 0),
+    PUSH(VM_ARGUMENT, 0),
+    OP(VM_ADD),
+    POP(VM_LOCAL, 0),
+    PUSH(VM_ARGUMENT, 1),
+    PUSH(VM_CONSTANT, 1),
+    OP(VM_SUB),
+    POP(VM_ARGUMENT, 1),
+    JUMP(VM_GOTO, "Math.multiply$LOOP"),
+    JUMP(VM_LABEL, "Math.multiply$END"),
+    PUSH(VM_LOCAL, 0),
+    OP(VM_RETURN),
+};
+
+// Loads a program into a new machine, returning false if that fails
+static bool load_program(Vm *machine, const CheckLine *lines, int num_lines, bool ir)
+{
+    vm_init(machine);
+    vm_init_statics(machine, 1);
+    for (int i = 0; i < num_lines; i++)
+    {
+        const CheckLine *line = &lines[i];
+        if (!vm_add_instr(machine, line->opcode, line->segment, line->arg, 0, line->label))
+        {
+            return false;
+        }
+    }
+    machine->pc = 0;
+    return vm_init_labeltargets(machine) == 0 && (!ir || vm_translate_ir(machine));
+}
+
+// Runs a machine one line at a time, like vmemu -e step
+static long step(Vm *machine, long cycles)
+{
+    long executed = 0;
+    while (executed < cycles && !machine->quitflag &&
+           (uint32_t)machine->pc < (uint32_t)machine->program_size)
+    {
+        vm_execute(machine);
+        executed++;
+    }
+    return executed;
+}
+
+// Checks if a machine is where the reference is, other than in the values popped off the stack
+static bool same_machine(const Vm *machine, const Vm *reference)
+{
+    if (machine->pc != reference->pc || machine->quitflag != reference->quitflag ||
+        machine->instructioncounter != reference->instructioncounter)
+    {
+        return false;
+    }
+    for (int i = 0; i < MEM_SIZE; i++)
+    {
+        const bool popped = i >= reference->ram[0] && i < 2048;
+        if (!popped && machine->ram[i] != reference->ram[i])
+        {
+            return false;
+        }
+    }
+    return memcmp(machine->statics[0], reference->statics[0], VMSTATICVARS * sizeof(int16_t)) == 0;
+}
+
+// Checks a program on both engines with every slice length up to CHECK_MAX_SLICE
+static bool check_program(const char *name, const CheckLine *lines, int num_lines)
+{
+    for (long slice = 1; slice <= CHECK_MAX_SLICE; slice++)
+    {
+        Vm reference, thread, ir;
+        const bool loaded_reference = load_program(&reference, lines, num_lines, false);
+        const bool loaded_thread = load_program(&thread, lines, num_lines, false);
+        bool same = load_program(&ir, lines, num_lines, true) && loaded_reference && loaded_thread;
+        long cycles = 0;
+        while (same && cycles < CHECK_CYCLES)
+        {
+            const long executed = step(&reference, slice);
+            same = vm_run(&thread, slice) == executed && same_machine(&thread, &reference) &&
+                   vm_run_ir(&ir, slice) == executed && same_machine(&ir, &reference);
+            cycles += slice;
+        }
+
+        if (!same)
+        {
+            printf("%s: engines diverge within %ld instructions, in slices of %ld, pc %d on vm_execute,"
+                   " %d on vm_run, %d on vm_run_ir\n",
+                   name, cycles, slice, reference.pc, thread.pc, ir.pc);
+        }
+        vm_destroy(&reference);
+        vm_destroy(&thread);
+        vm_destroy(&ir);
+        if (!same)
+        {
+            return false;
+        }
+    }
+
+    printf("%s: same on every engine\n", name);
+    return true;
+}
+
+int main(void)
+{
+    const bool passed = check_program("calls after labels", calls_after_labels,
+                                      sizeof(calls_after_labels) / sizeof(calls_after_labels[0]));
+    return passed ? 0 : 1;
+}
@@ -9,16 +9,24 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <unistd.h>
 
 #include <SDL2/SDL.h>
 #include "vmemulib.h"
+#include "../emulator/blit.h"
+#include "../emulator/journal.h"
+#include "../emulator/pace.h"
 
 #define TITLE "VM Emulator"
 #define FRAME_RATE 25
-#define CPU_FREQ 300
+#define CPU_FREQ 1000000 // Default VM instructions per second, 0 for unlimited
 #define OFF_COLOR 0xFFFFFF
 #define ON_COLOR 0x000000
 
+#define USAGE \
+    "Usage: ./vmemu [-e <engine>] [-f <hz>] [-j <file>] [-p <file>] <path-to-files>\n" \
+    "  -e <engine>  Execution engine: step, thread (default) or ir\n"
+
 
 #define VM_MAX_LINE 1024
 #define VM_MAX_ARGS 3
@@ -28,22 +36,30 @@
 #define STACK_START_ADDR 256
 #define TEMP_START_ADDR 5
 
+// Ways of executing the VM code, all with the same results
+typedef enum
+{
+    ENGINE_STEP,   // vm_execute, one line at a time
+    ENGINE_THREAD, // vm_run
+    ENGINE_IR      // vm_run_ir
+} ENGINES;
+
 char FOLDER_NAME[FILENAME_MAX];
 char FILES[MAX_FILES][FILENAME_MAX] = {'\0'}; //also move this into the Vm struct some time
 //int NUM_FILES = 0;
 
-//Turn the type of memory segment from push and pop into a number for storing in Vm->vmarg1[]
+//Turn the type of memory segment from push and pop into a number for storing in VmInstr.segment
 uint16_t decode_segment(char *seg)
 {
-	if(strcmp(seg, "argument") == 0) return 0;
-	if(strcmp(seg, "local") == 0) return 1;
-	if(strcmp(seg, "static") == 0) return 2;
-	if(strcmp(seg, "constant") == 0) return 3;
-	if(strcmp(seg, "this") == 0) return 4;
-	if(strcmp(seg, "that") == 0) return 5;
-	if(strcmp(seg, "pointer") == 0) return 6;
-	if(strcmp(seg, "temp") == 0) return 7;
-	return -1;
+	if(strcmp(seg, "argument") == 0) return VM_ARGUMENT;
+	if(strcmp(seg, "local") == 0) return VM_LOCAL;
+	if(strcmp(seg, "static") == 0) return VM_STATIC;
+	if(strcmp(seg, "constant") == 0) return VM_CONSTANT;
+	if(strcmp(seg, "this") == 0) return VM_THIS;
+	if(strcmp(seg, "that") == 0) return VM_THAT;
+	if(strcmp(seg, "pointer") == 0) return VM_POINTER;
+	if(strcmp(seg, "temp") == 0) return VM_TEMP;
+	return VM_NO_SEGMENT;
 }
 
 // Initializes SDL
@@ -76,28 +92,24 @@ SDL_Window *create_window(void)
     return new_window;
 }
 
-// Sets a pixel of the SDL surface to a certain color
-void set_pixel(SDL_Surface *surface, int x, int y, long color)
-{
-    Uint32 *pixels = (Uint32 *)surface->pixels;
-    pixels[(y * surface->w) + x] = color;
-}
-
 // Makes the physical screen match the emulator display
 void draw_display(const Vm *machine, SDL_Window *window, SDL_Surface *surface)
 {
-    for (int i = SCREEN_ADDR; i < KEYBD_ADDR; i++)
-    {
-        int x, y;
-        vm_get_coords(&x, &y, i);
+    static const BlitColors colors = {ON_COLOR, OFF_COLOR};
+    const int row_words = DISPLAY_WIDTH / WORD_SIZE;
 
-        for (int j = 0; j < WORD_SIZE; j++)
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        // The VM keeps 32-bit RAM but only the low 16 bits reach the screen
+        int16_t row[DISPLAY_WIDTH / WORD_SIZE];
+        for (int x = 0; x < row_words; x++)
         {
-            int newx = (WORD_SIZE * x) + j;
-
-            long color = ((machine->ram[i] >> j) & 1) ? ON_COLOR : OFF_COLOR;
-            set_pixel(surface, newx, y, color);
+            row[x] = machine->ram[SCREEN_ADDR + y * row_words + x];
         }
+
+        Uint32 *pixels = (Uint32 *)((Uint8 *)surface->pixels +
+                                    y * surface->pitch);
+        blit_words(pixels, row, row_words, colors);
     }
 
     SDL_UpdateWindowSurface(window);
@@ -176,6 +188,103 @@ bool handle_input(Vm *machine, SDL_Event *e)
     return true;
 }
 
+/* Parses an engine name: step, thread or ir
+ * Returns false (and prints why) if it is not one.
+ */
+bool parse_engine(const char *name, ENGINES *engine)
+{
+    if (strcmp(name, "step") == 0)
+    {
+        *engine = ENGINE_STEP;
+    }
+    else if (strcmp(name, "thread") == 0)
+    {
+        *engine = ENGINE_THREAD;
+    }
+    else if (strcmp(name, "ir") == 0)
+    {
+        *engine = ENGINE_IR;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown engine: %s\n", name);
+        return false;
+    }
+
+    return true;
+}
+
+/* Runs the machine for up to 'cycles' instructions on the given engine
+ * Returns the number of instructions executed.
+ */
+long run_engine(Vm *machine, ENGINES engine, long cycles)
+{
+    long executed = 0;
+    switch (engine)
+    {
+    case ENGINE_STEP:
+        while (executed < cycles && !machine->quitflag &&
+               (uint32_t)machine->pc < (uint32_t)machine->program_size)
+        {
+            vm_execute(machine);
+            executed++;
+        }
+        return executed;
+    case ENGINE_THREAD:
+        return vm_run(machine, cycles);
+    default:
+        return vm_run_ir(machine, cycles);
+    }
+}
+
+/* Runs the machine without a window as fast as possible, pressing the keys of
+ * a journal after as many instructions as they were recorded after, until the
+ * session recorded ends
+ * Returns the number of instructions executed.
+ */
+long replay_input(Vm *machine, ENGINES engine, Journal *journal)
+{
+    const long length = journal_length(journal);
+    long cycles = 0;
+
+    long key_cycle;
+    int key;
+    bool key_pending = journal_read(journal, &key_cycle, &key);
+    while (cycles < length && !machine->quitflag &&
+           machine->pc < machine->program_size)
+    {
+        while (key_pending && key_cycle <= cycles)
+        {
+            machine->ram[KEYBD_ADDR] = key;
+            key_pending = journal_read(journal, &key_cycle, &key);
+        }
+
+        // Run up to the next key press
+        long slice = length - cycles;
+        if (key_pending && key_cycle - cycles < slice)
+        {
+            slice = key_cycle - cycles;
+        }
+        cycles += run_engine(machine, engine, slice);
+    }
+
+    return cycles;
+}
+
+// FNV-1a hash of the screen, to tell whether two runs ended on the same one
+uint32_t screen_checksum(const Vm *machine)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = SCREEN_ADDR; i < KEYBD_ADDR; i++)
+    {
+        const uint16_t word = machine->ram[i];
+        hash = (hash ^ (word & 0xFF)) * 16777619u;
+        hash = (hash ^ (word >> 8)) * 16777619u;
+    }
+
+    return hash;
+}
+
 // Frees all resources and exits.
 void clean_exit(SDL_Window *window, SDL_Surface *surface, int status)
 {
@@ -239,7 +348,30 @@ bool line_is_empty(const char *line)
     return true;
 }
 
-// WIP just store in memory, representation TBD
+// Turn the command of a line of VM code into its opcode, -1 if it is none
+int decode_command(char *cmd)
+{
+	if(strcmp(cmd, "push") == 0) return VM_PUSH;
+	if(strcmp(cmd, "pop") == 0) return VM_POP;
+	if(strcmp(cmd, "call") == 0) return VM_CALL;
+	if(strcmp(cmd, "function") == 0) return VM_FUNCTION;
+	if(strcmp(cmd, "goto") == 0) return VM_GOTO;
+	if(strcmp(cmd, "if-goto") == 0) return VM_IFGOTO;
+	if(strcmp(cmd, "label") == 0) return VM_LABEL;
+	if(strcmp(cmd, "add") == 0) return VM_ADD;
+	if(strcmp(cmd, "and") == 0) return VM_AND;
+	if(strcmp(cmd, "eq") == 0) return VM_EQ;
+	if(strcmp(cmd, "gt") == 0) return VM_GT;
+	if(strcmp(cmd, "lt") == 0) return VM_LT;
+	if(strcmp(cmd, "neg") == 0) return VM_NEG;
+	if(strcmp(cmd, "not") == 0) return VM_NOT;
+	if(strcmp(cmd, "or") == 0) return VM_OR;
+	if(strcmp(cmd, "return") == 0) return VM_RETURN;
+	if(strcmp(cmd, "sub") == 0) return VM_SUB;
+	return -1;
+}
+
+// Append a line of VM code to the machine's code
 bool parse(Vm *this, char *line, int filenum, /* AsmProg *prog, const char *filename, */ char *cur_func, char *cur_subfun)
 {
     // The 'arguments' of a line (the instruction itself plus additional arguments)
@@ -257,205 +389,41 @@ bool parse(Vm *this, char *line, int filenum, /* AsmProg *prog, const char *file
         token = strtok(NULL, VM_ARG_DELIM);
     }
 
-    if (strcmp(args[0], "push") == 0)
-    {
-    	this->vmarg0[this->pc] = 0; //code for push
-    	this->vmarg1[this->pc] = decode_segment(args[1]);
-    	this->vmarg2[this->pc] = atoi(args[2]); //Turn the number that this part of the instruction string into an int
-    	strncpy(this->label[this->pc], line, VM_MAXLABEL); //keep a copy of the line for debugging (wherever we do not need the label)
-    	if(DEBUG) printf("parse push:pc=%d, %hi %hi %hi .. %s\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-    	this->pc++;
-    }
-    else if (strcmp(args[0], "pop") == 0)
-    {
-    	this->vmarg0[this->pc] = 1; //code for pop
-    	this->vmarg1[this->pc] = decode_segment(args[1]);
-    	this->vmarg2[this->pc] = atoi(args[2]);
-    	strncpy(this->label[this->pc], line, VM_MAXLABEL);
-    	if(DEBUG) printf("parse pop:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "call") == 0)
-    {
-    	this->vmarg0[this->pc] = 2; //code for pop
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = atoi(args[2]); //nargs
-    	strncpy(this->label[this->pc], args[1], VM_MAXLABEL);
-    	if(DEBUG) printf("parse call:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "function") == 0)
-    {
-    	this->vmarg0[this->pc] = 3; //code for pop
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = atoi(args[2]); //nlocals
-    	strncpy(this->label[this->pc], args[1], VM_MAXLABEL);
-    	strncpy(cur_subfun, args[1], VM_MAXLABEL);
-    	if(DEBUG) printf("parse function:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	if(DEBUG) printf("  updated cur_subfun to |%s|\n", cur_subfun);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    // Branching
-    else if (strcmp(args[0], "goto") == 0)
-    {
-    	this->vmarg0[this->pc] = 4; //code for goto
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-//    	strcpy(this->label[this->pc],cur_func);//GLOB_
-    	strcpy(this->label[this->pc],cur_subfun);
-    	strcat(this->label[this->pc],"$");
-    	strncat(this->label[this->pc], args[1], VM_MAXLABEL);
-    	if(DEBUG) printf("parse goto:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "if-goto") == 0)
-    {
-    	this->vmarg0[this->pc] = 5; //code for if-goto
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-//    	strcpy(this->label[this->pc],cur_func);
-    	strcpy(this->label[this->pc],cur_subfun);
-    	strcat(this->label[this->pc],"$");
-    	strncat(this->label[this->pc], args[1], VM_MAXLABEL);
-    	if(DEBUG) printf("parse if-goto:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "label") == 0)
-    {
-    	this->vmarg0[this->pc] = 6; //code for label
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-//    	strcpy(this->label[this->pc],cur_func);
-    	strcpy(this->label[this->pc],cur_subfun);
-    	strcat(this->label[this->pc],"$");
-    	strncat(this->label[this->pc], args[1], VM_MAXLABEL);
-    	if(DEBUG) printf("parse label:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    		 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-
-    // Arithmetic
-    else if (strcmp(args[0], "add") == 0)
-    {
-    	this->vmarg0[this->pc] = 7; //code for add
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse add:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "and") == 0)
-    {
-    	this->vmarg0[this->pc] = 8; //code for and
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse and:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "eq") == 0)
-    {
-    	this->vmarg0[this->pc] = 9; //code for eq
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse eq:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "gt") == 0)
-    {
-    	this->vmarg0[this->pc] = 10; //code for gt
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse gt:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "lt") == 0)
-    {
-    	this->vmarg0[this->pc] = 11; //code for lt
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse lt:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "neg") == 0)
-    {
-    	this->vmarg0[this->pc] = 12; //code for neg
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse neg:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "not") == 0)
-    {
-       	this->vmarg0[this->pc] = 13; //code for not
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse not:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-
-    else if (strcmp(args[0], "or") == 0)
-    {
-    	this->vmarg0[this->pc] = 14; //code for or
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse or:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "return") == 0)
-    {
-    	this->vmarg0[this->pc] = 15; //code for return
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse return:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else if (strcmp(args[0], "sub") == 0)
-    {
-    	this->vmarg0[this->pc] = 16; //code for sub
-    	this->vmarg1[this->pc] = -1; //not used
-    	this->vmarg2[this->pc] = -1;
-    	if(DEBUG) printf("parse sub:pc=%d, %hi %hi %hi\n", this->pc, this->vmarg0[this->pc],
-    		this->vmarg1[this->pc], this->vmarg2[this->pc]);
-	this->filenum[this->pc] = filenum; //important to know which static segment to target
-  	this->pc++;
-    }
-    else
-    {
+    const int opcode = decode_command(args[0]);
+    int segment = VM_NO_SEGMENT;
+    int arg = -1; //not used
+    char label[VM_MAXLABEL + VM_MAX_ARG_LEN] = "";
+    switch (opcode)
+    {
+    case VM_PUSH:
+    case VM_POP:
+    	segment = decode_segment(args[1]);
+    	arg = atoi(args[2]); //Turn the number that this part of the instruction string into an int
+    	strncpy(label, line, sizeof(label) - 1); //keep a copy of the line for debugging (wherever we do not need the label)
+    	break;
+    case VM_FUNCTION:
+    	snprintf(cur_subfun, VM_MAXLABEL, "%s", args[1]);
+    	if(DEBUG) printf("  updated cur_subfun to |%s|\n", cur_subfun);
+    	arg = atoi(args[2]); //nlocals
+    	strcpy(label, args[1]);
+    	break;
+    case VM_CALL:
+    	arg = atoi(args[2]); //nargs
+    	strcpy(label, args[1]);
+    	break;
+    case VM_GOTO:
+    case VM_IFGOTO:
+    case VM_LABEL:
+    	//labels are scoped to the function they are in (new book 8.2.1)
+    	snprintf(label, sizeof(label), "%s$%s", cur_subfun, args[1]);
+    	break;
+    case -1:
         fprintf(stderr, "Unrecognized instruction.\n");
         return false;
     }
-    if(this->pc > this->program_size) this->program_size = this->pc; //increase program_size to this->pc
-    return true;
+
+    if(DEBUG) printf("parse %s:pc=%d, %d %d %d ..%s\n", args[0], this->pc, opcode, segment, arg, label);
+    return vm_add_instr(this, opcode, segment, arg, filenum, label); //filenum is important to know which static segment to target
 }
 
 // Gets a list of VM files from a filepath
@@ -535,24 +503,17 @@ void get_filename(const char *filepath, char *filename)
 bool read_vm_files(Vm *this)
 {
     //add_bootstrap(prog);
-    this->vmarg0[this->pc] = 2; //code for call
-    this->vmarg1[this->pc] = -1; //not used
-    this->vmarg2[this->pc] = 0; //nargs
-    strncpy(this->label[this->pc], "Sys.init", VM_MAXLABEL);
-    if(DEBUG) printf("initial line/ bootstrap: call:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    	 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-    this->filenum[this->pc] = 0; //important to know which static segment to target IRRELEVANT HERE
-    this->pc++;
+    //the static segment of file 0 is irrelevant to these calls
+    if (!vm_add_instr(this, VM_CALL, VM_NO_SEGMENT, 0, 0, "Sys.init"))
+    {
+        return false;
+    }
 
     //add Sys.halt, just in case
-    this->vmarg0[this->pc] = 2; //code for call
-    this->vmarg1[this->pc] = -1; //not used
-    this->vmarg2[this->pc] = 0; //nargs
-    strncpy(this->label[this->pc], "Sys.halt", VM_MAXLABEL);
-    if(DEBUG) printf("initial line/ bootstrap: call:pc=%d, %hi %hi %hi ..%s\n", this->pc, this->vmarg0[this->pc],
-    	 this->vmarg1[this->pc], this->vmarg2[this->pc], this->label[this->pc]);
-    this->filenum[this->pc] = 0; //important to know which static segment to target IRRELEVANT HERE
-    this->pc++;
+    if (!vm_add_instr(this, VM_CALL, VM_NO_SEGMENT, 0, 0, "Sys.halt"))
+    {
+        return false;
+    }
 
 
     // read all the files
@@ -607,40 +568,90 @@ bool read_vm_files(Vm *this)
 int main(int argc, char **argv)
 {
     char vm_path[FILENAME_MAX];
+    long hz = CPU_FREQ;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    ENGINES engine = ENGINE_THREAD;
 
-    if (argc != 2)
+    int opt;
+    while ((opt = getopt(argc, argv, "e:f:j:p:")) != -1)
     {
-        fprintf(stderr, "Usage: ./vmemu <path-to-files>\n");
+        switch (opt)
+        {
+        case 'e':
+            if (!parse_engine(optarg, &engine))
+            {
+                return 1;
+            }
+            break;
+        case 'f':
+            if (!pacer_parse_hz(optarg, &hz))
+            {
+                fprintf(stderr, "Invalid clock rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'j':
+            record_path = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1 || (record_path != NULL && replay_path != NULL))
+    {
+        fprintf(stderr, USAGE);
         return 1;
     }
     else
     {
-        strncpy(vm_path, argv[1], FILENAME_MAX);
+        strncpy(vm_path, argv[optind], FILENAME_MAX);
         vm_path[FILENAME_MAX - 1] = '\0';
     }
 
-    if (!init_SDL())
+    // Replays run headless, so they need neither a window nor SDL
+    Journal *journal = NULL;
+    SDL_Window *window = NULL;
+    SDL_Surface *surface = NULL;
+    if (replay_path != NULL)
     {
-        return 1;
+        journal = journal_replay(replay_path);
+        if (journal == NULL)
+        {
+            return 1;
+        }
     }
-
-    SDL_Window *window = create_window();
-    if (!window)
+    else
     {
-        clean_exit(NULL, NULL, 1);
-    }
+        if (!init_SDL())
+        {
+            return 1;
+        }
 
-    SDL_Surface *surface = SDL_GetWindowSurface(window);
-    if (!surface)
-    {
-        fprintf(stderr, "Could not create SDL surface: %s\n", SDL_GetError());
-        clean_exit(window, NULL, 1);
+        window = create_window();
+        if (!window)
+        {
+            clean_exit(NULL, NULL, 1);
+        }
+
+        surface = SDL_GetWindowSurface(window);
+        if (!surface)
+        {
+            fprintf(stderr, "Could not create SDL surface: %s\n",
+                    SDL_GetError());
+            clean_exit(window, NULL, 1);
+        }
     }
 
     Vm machine;
     vm_init(&machine);
 
-    int nfiles = get_files(argv[1]); //from vmtranslator
+    int nfiles = get_files(vm_path); //from vmtranslator
 
     vm_init_statics(&machine, nfiles);
 
@@ -651,29 +662,65 @@ int main(int argc, char **argv)
     }
     vm_init_labeltargets(&machine);
     if(DEBUG) vm_print_vmcode(&machine);
+    if (engine == ENGINE_IR && !vm_translate_ir(&machine))
+    {
+        fprintf(stderr, "Out of memory translating the VM code\n");
+        vm_destroy(&machine);
+        clean_exit(window, surface, 1);
+    }
 
     machine.pc = 0; //set pc to 0 to start at the beginning
 
+    if (journal != NULL)
+    {
+        const long cycles = replay_input(&machine, engine, journal);
+        printf("replayed %ld instructions, screen checksum %08x\n", cycles,
+               screen_checksum(&machine));
+        journal_close(journal, 0);
+        vm_destroy(&machine);
+        clean_exit(NULL, NULL, 0);
+    }
+
+    if (record_path != NULL)
+    {
+        journal = journal_record(record_path, hz);
+        if (journal == NULL)
+        {
+            vm_destroy(&machine);
+            clean_exit(window, surface, 1);
+        }
+    }
+
     SDL_Event e;
     bool quit = false;
+    Uint32 next_frame = SDL_GetTicks();
+    Pacer pacer;
+    pacer_init(&pacer, hz);
+    long total = 0; // Instructions executed, which journaled keys are stamped with
     while (!machine.quitflag && !quit && machine.pc < machine.program_size)
     {
-        // Cap execution speed
-        if (SDL_GetTicks() % (1000 / CPU_FREQ) <= 1)
-        {
-	    // WIP: Everything is set up. Now run the VM instructions. Implement them
-            vm_execute(&machine);
-        }
+        // Run a slice of instructions, then sleep until it is due
+        const long cycles = run_engine(&machine, engine, pacer.slice);
+        total += cycles;
 
         // Cap input/draw rate
-        if (SDL_GetTicks() % (1000 / FRAME_RATE) <= 1)
+        const Uint32 now = SDL_GetTicks();
+        if ((Sint32)(now - next_frame) >= 0)
         {
             quit = !handle_input(&machine, &e);
+            if (journal != NULL)
+            {
+                journal_write(journal, total, machine.ram[KEYBD_ADDR]);
+            }
             draw_display(&machine, window, surface);
+            next_frame = now + 1000 / FRAME_RATE;
         }
+
+        pacer_wait(&pacer, cycles);
     }
     if(DEBUG) vm_print_statics(&machine);
     if(DEBUG) vm_print_ram(&machine);
+    const bool written = journal_close(journal, total);
     vm_destroy(&machine);
-    clean_exit(window, surface, 0);
+    clean_exit(window, surface, written ? 0 : 1);
 }
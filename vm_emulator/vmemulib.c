@@ -8,16 +8,210 @@
 #include <string.h>
 #include "vmemulib.h"
 
+// Handlers vm_run executes lines with, see VmInstr.thread
+enum
+{
+    VM_THREAD_EXECUTE, //anything not worth a handler of its own, run by vm_execute
+    VM_THREAD_END, //past the last line, which stops vm_run
+    VM_THREAD_PUSH, //one for each segment, in the order of VM_SEGMENTS
+    VM_THREAD_POP = VM_THREAD_PUSH + 8,
+    VM_THREAD_CALL = VM_THREAD_POP + 8,
+    VM_THREAD_CALL_NATIVE,
+    VM_THREAD_FUNCTION,
+    VM_THREAD_GOTO,
+    VM_THREAD_IFGOTO,
+    VM_THREAD_LABEL,
+    VM_THREAD_ADD,
+    VM_THREAD_AND,
+    VM_THREAD_EQ,
+    VM_THREAD_GT,
+    VM_THREAD_LT,
+    VM_THREAD_NEG,
+    VM_THREAD_NOT,
+    VM_THREAD_OR,
+    VM_THREAD_RETURN,
+    VM_THREAD_SUB
+};
+
+// Pick the handler for a line of VM code
+static uint8_t vm_thread(const VmInstr *instr)
+{
+    switch (instr->opcode)
+    {
+    case VM_PUSH:
+        return instr->segment <= VM_TEMP ? VM_THREAD_PUSH + instr->segment : VM_THREAD_EXECUTE;
+    case VM_POP:
+        //popping to a constant is only reported by vm_execute
+        return instr->segment <= VM_TEMP && instr->segment != VM_CONSTANT ? VM_THREAD_POP + instr->segment
+                                                                          : VM_THREAD_EXECUTE;
+    case VM_CALL:
+        return instr->native != 0 && OVERRIDE_OS_FUNCTIONS ? VM_THREAD_CALL_NATIVE : VM_THREAD_CALL;
+    default:
+        //the rest are in the same order as their opcodes
+        return instr->opcode <= VM_SUB ? VM_THREAD_FUNCTION + instr->opcode - VM_FUNCTION : VM_THREAD_EXECUTE;
+    }
+}
+
 // Clear the ROM
 void vm_clear_vmcode(Vm *this)
 {
-    for (int i = 0; i < MEM_SIZE; i++)
+    this->program_size = 0;
+    this->pc = 0;
+}
+
+// FNV-1a hash of a string
+static uint32_t vm_hash(const char *str)
+{
+    uint32_t hash = 2166136261u;
+    while (*str != '\0')
     {
-        this->vmarg0[i] = -1;
-        this->vmarg1[i] = -1;
-        this->vmarg2[i] = -1;
-        this->label[i][0] = '\0';
+        hash = (hash ^ (uint8_t)*str++) * 16777619u;
     }
+    return hash;
+}
+
+// Double the hash table of a string pool, or create it
+static bool vm_grow_slots(VmStrings *this)
+{
+    uint32_t num_slots = this->num_slots == 0 ? 1024 : this->num_slots * 2;
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if (slots == NULL)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < this->num_slots; i++)
+    {
+        if (this->slots[i] != 0)
+        {
+            uint32_t slot = vm_hash(this->chars + this->slots[i]) & (num_slots - 1);
+            while (slots[slot] != 0)
+            {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+            slots[slot] = this->slots[i];
+        }
+    }
+
+    free(this->slots);
+    this->slots = slots;
+    this->num_slots = num_slots;
+    return true;
+}
+
+bool vm_intern(VmStrings *this, const char *str, uint32_t *offset)
+{
+    if (str[0] == '\0')
+    {
+        *offset = 0;
+        return true;
+    }
+
+    // Keep the table at most half full so that probes stay short
+    if (2 * (this->count + 1) > this->num_slots && !vm_grow_slots(this))
+    {
+        return false;
+    }
+
+    uint32_t slot = vm_hash(str) & (this->num_slots - 1);
+    while (this->slots[slot] != 0)
+    {
+        if (strcmp(this->chars + this->slots[slot], str) == 0)
+        {
+            *offset = this->slots[slot];
+            return true;
+        }
+        slot = (slot + 1) & (this->num_slots - 1);
+    }
+
+    const uint32_t length = strlen(str) + 1;
+    if (this->size + length > this->capacity)
+    {
+        uint32_t capacity = this->capacity == 0 ? 65536 : this->capacity;
+        while (this->size + length > capacity)
+        {
+            capacity *= 2;
+        }
+        char *chars = realloc(this->chars, capacity);
+        if (chars == NULL)
+        {
+            return false;
+        }
+        this->chars = chars;
+        this->capacity = capacity;
+    }
+
+    // Offset 0 is the empty string every pool starts with
+    if (this->size == 0)
+    {
+        this->chars[this->size++] = '\0';
+    }
+
+    memcpy(this->chars + this->size, str, length);
+    this->slots[slot] = this->size;
+    this->size += length;
+    this->count++;
+    *offset = this->slots[slot];
+    return true;
+}
+
+bool vm_add_instr(Vm *this, int opcode, int segment, int arg, int filenum, const char *label)
+{
+    // Keep room for the line after the last one, which ends the program
+    if (this->pc + 1 >= this->code_capacity)
+    {
+        const int32_t capacity = this->code_capacity == 0 ? 4096 : this->code_capacity * 2;
+        VmInstr *code = realloc(this->code, capacity * sizeof(VmInstr));
+        if (code != NULL)
+        {
+            this->code = code;
+        }
+        uint32_t *labels = realloc(this->label, capacity * sizeof(uint32_t));
+        if (labels != NULL)
+        {
+            this->label = labels;
+        }
+        if (code == NULL || labels == NULL)
+        {
+            fprintf(stderr, "vm_add_instr(): out of memory for %d lines of VM code\n", capacity);
+            return false;
+        }
+        this->code_capacity = capacity;
+    }
+
+    uint32_t offset;
+    if (!vm_intern(&this->strings, label, &offset))
+    {
+        fprintf(stderr, "vm_add_instr(): out of memory for label %s\n", label);
+        return false;
+    }
+
+    VmInstr *instr = &this->code[this->pc];
+    instr->opcode = opcode;
+    instr->segment = segment;
+    instr->arg = arg;
+    instr->target = -1;
+    instr->filenum = filenum;
+    instr->native = 0;
+    instr->thread = vm_thread(instr);
+    this->label[this->pc] = offset;
+
+    this->pc++;
+    if (this->pc >= this->program_size)
+    {
+        this->program_size = this->pc;
+        this->code[this->pc].thread = VM_THREAD_END;
+    }
+    return true;
+}
+
+const char *vm_label(const Vm *this, int32_t line)
+{
+    if (this->strings.chars == NULL)
+    {
+        return "";
+    }
+    return this->strings.chars + this->label[line];
 }
 
 // Clear the RAM
@@ -39,14 +233,15 @@ void vm_get_coords(int *x, int *y, uint16_t addr)
 
 void vm_init(Vm *this)
 {
-    int i;
-    this->vmarg0 = calloc(VM_SIZE, sizeof(uint16_t));
-    this->vmarg1 = calloc(VM_SIZE, sizeof(uint16_t));
-    this->vmarg2 = calloc(VM_SIZE, sizeof(uint16_t));
-    this->filenum = calloc(VM_SIZE, sizeof(uint16_t));
-    this->targetline = calloc(VM_SIZE, sizeof(int32_t));
+    // The code grows as it is loaded, see vm_add_instr
+    this->code = NULL;
+    this->code_capacity = 0;
+    this->label = NULL;
+    memset(&this->strings, 0, sizeof(VmStrings));
+    this->ir = NULL;
+    this->ir_size = 0;
+    this->ir_of_line = NULL;
     this->ram = calloc(MEM_SIZE, sizeof(int32_t));
-    this->label = calloc(VM_SIZE, sizeof(char*));
     this->statics = calloc(MAX_FILES, sizeof(int16_t*));
     this->program_size = 0;
     this->pc = 0;
@@ -56,10 +251,6 @@ void vm_init(Vm *this)
     
     this->currentcolor = -1;//true --> -1, black
 
-    for(i=0;i<VM_SIZE;i++){
-    	this->label[i]=calloc(VM_MAXLABEL, sizeof(char));
-    }
-
     vm_clear_vmcode(this);
     vm_clear_ram(this);
     //this->ram[0] = 256; //set SP
@@ -81,6 +272,24 @@ void vm_init_statics(Vm *this, int nfiles)
     }
 }
 
+// Where a label or function is, in the hash table vm_init_labeltargets looks them up in
+typedef struct VmTarget
+{
+	uint32_t label; //offset of the interned label, 0 for an empty slot
+	int32_t line; //-1 for a label nothing defines
+} VmTarget;
+
+// Find the slot of a label in a table of 2^bits slots, or the empty slot it would go in
+static VmTarget *vm_find_target(VmTarget *table, int bits, uint32_t label)
+{
+	const uint32_t mask = (1u << bits) - 1;
+	uint32_t slot = (label * 2654435769u) >> (32 - bits); //Fibonacci hashing, the top bits of the product mix in every bit of the offset
+	while(table[slot].label != 0 && table[slot].label != label){
+		slot = (slot + 1) & mask;
+	}
+	return &table[slot];
+}
+
 // This returns 0 if all labeltargets can be resolved.
 // Otherwise 1
 // 1 would mean that we need to internally implement OS functions or that stuff is missing
@@ -90,71 +299,99 @@ int vm_init_labeltargets(Vm *this)
 	// We need a table to find the correct (VM) line number for specific labels (goto, if-goto, call)
 	// And we need to check if we have a Main.main and Sys.init label
 
-	// Count the labels out of curiosity
-	int i, j, labelcount, functioncount, found, missingflag;
-	i = 0;
-	missingflag = 0;
+	// Count the labels, to size the table, and out of curiosity
+	int i, labelcount, functioncount, jumpcount, missingcount;
 	labelcount = 0;
 	functioncount = 0;
-	while(i<this->program_size){
-		if(this->vmarg0[i] == 3){ //function
+	jumpcount = 0;
+	for(i=0;i<this->program_size;i++){
+		if(this->code[i].opcode == VM_FUNCTION){
 			functioncount++;
 		}
-		if(this->vmarg0[i] == 6){ //label
+		if(this->code[i].opcode == VM_LABEL){
 			labelcount++;
 		}
-		i++;
+		if(this->code[i].opcode == VM_CALL || this->code[i].opcode == VM_GOTO || this->code[i].opcode == VM_IFGOTO){
+			jumpcount++;
+		}
 	}
 	printf("vm_init_labeltargets(): found %d functions and %d labels.\n", functioncount, labelcount);
 
-	// set the targetline for all goto if-goto and call instructions
-
-	i = 0; //go through all instructions
-	j = 0; //find the right label
-	while(i<this->program_size){
-		if(this->vmarg0[i] == 2 || this->vmarg0[i] == 4 || this->vmarg0[i] == 5){ //call, goto, if-goto
-			//check for matching label or function now.
-			j =0;
-			found =0;
-			while(j<this->program_size){
-				if(this->vmarg0[j] == 3 ||this->vmarg0[j] == 6){ // if function label, check if it matches
-					if(strcmp(this->label[i], this->label[j])==0){
-						this->targetline[i] = j;
-						found = 1;
-						if(DEBUG){
-							printf("  %d %s: %d\n", this->vmarg0[j], this->label[i], j); 
-								//print the resolved target
-						}
-						break; //break the j while loop
-					}
-				}
-				j++;
+	// Keep the table at most half full, even if every jump goes to a label no line defines
+	int bits = 10;
+	while((1u << bits) < 2 * (uint32_t)(functioncount + labelcount + jumpcount)){
+		bits++;
+	}
+	const uint32_t size = 1u << bits;
+	VmTarget *table = calloc(size, sizeof(VmTarget));
+	if(table == NULL){
+		printf("vm_init_labeltargets(): out of memory for %d labels\n", functioncount + labelcount);
+		return 1;
+	}
+
+	// Put every function and label in the table, the first line defining one winning
+	for(i=0;i<this->program_size;i++){
+		if(this->code[i].opcode == VM_FUNCTION || this->code[i].opcode == VM_LABEL){
+			//labels are interned, so the same label has the same offset
+			VmTarget *target = vm_find_target(table, bits, this->label[i]);
+			if(target->label == 0){
+				target->label = this->label[i];
+				target->line = i;
+			}
+		}
+	}
+
+	// set the target for all goto if-goto and call instructions
+	missingcount = 0;
+	for(i=0;i<this->program_size;i++){
+		const int opcode = this->code[i].opcode;
+		if(opcode == VM_CALL && OVERRIDE_OS_FUNCTIONS){
+			//handle simple OS functions directly, looked up here once rather than on every call
+			this->code[i].native = vm_find_os_function(vm_label(this, i));
+			this->code[i].thread = vm_thread(&this->code[i]);
+			if(this->code[i].native != 0){
+				continue; //no need for their VM code
+			}
+		}
+		if(opcode == VM_CALL || opcode == VM_GOTO || opcode == VM_IFGOTO){
+			VmTarget *target = vm_find_target(table, bits, this->label[i]);
+			if(target->label == 0){
+				// Remember what is missing, to report each label once
+				target->label = this->label[i];
+				target->line = -1;
+				missingcount++;
 			}
-			if(found == 0){
-				printf("vm_init_labeltargets(): did not find target for label %s\n", this->label[i]);
-				missingflag = 1;
+			//jumping to a label nothing defines goes past the end of the program, which stops it
+			this->code[i].target = target->line >= 0 ? target->line : this->program_size;
+			if(DEBUG && target->line >= 0){
+				printf("  %d %s: %d\n", this->code[target->line].opcode, vm_label(this, i), target->line);
+					//print the resolved target
 			}
 		}
-		i++;
 	}
-	return missingflag; 
+
+	if(missingcount > 0){
+		printf("vm_init_labeltargets(): did not find targets for %d labels:\n", missingcount);
+		for(uint32_t slot=0;slot<size;slot++){
+			if(table[slot].label != 0 && table[slot].line == -1){
+				printf("  %s\n", this->strings.chars + table[slot].label);
+			}
+		}
+	}
+	free(table);
+	return missingcount > 0;
 }
 
 void vm_destroy(Vm *this)
 {
 	int i;
-	if(this->vmarg0 != NULL) free(this->vmarg0);
-	if(this->vmarg1 != NULL) free(this->vmarg1);
-	if(this->vmarg2 != NULL) free(this->vmarg2);
+	free(this->code);
+	free(this->label);
+	free(this->strings.chars);
+	free(this->strings.slots);
+	free(this->ir);
+	free(this->ir_of_line);
 	if(this->ram != NULL) free(this->ram);
-	if(this->filenum != NULL) free(this->filenum);
-	if(this->targetline != NULL) free(this->targetline);
-	if(this->label != NULL){
-		for(i=0;i<VM_SIZE;i++){
-    			if(this->label[i] != NULL) free(this->label[i]);
-	    	}
-	    	free(this->label);
-    	}
 	if(this->statics != NULL){
 		for(i=0;i<this->nfiles;i++){
     			if(this->statics[i] != NULL) free(this->statics[i]);
@@ -171,7 +408,7 @@ void vm_execute_label(Vm *this)
 void vm_execute_function(Vm *this)
 {
 	int i, k;
-	k = this->vmarg2[this->pc]; //k local variables to clear
+	k = this->code[this->pc].arg; //k local variables to clear
 	for(i=0;i<k;i++){
 		this->ram[this->ram[0]] = 0;
 		this->ram[0]++;
@@ -184,10 +421,9 @@ void vm_execute_call(Vm *this)
 	int line;
 
 	//handle simple OS functions directly
-	if(OVERRIDE_OS_FUNCTIONS){
-		if(check_os_function(this)){
-			return;
-		}
+	if(OVERRIDE_OS_FUNCTIONS && this->code[this->pc].native != 0){
+		vm_os_functions[this->code[this->pc].native - 1].handler(this);
+		return;
 	}
 
 	//save 'environment' on stack
@@ -201,11 +437,11 @@ void vm_execute_call(Vm *this)
 	this->ram[0]++;
 	this->ram[this->ram[0]] = this->ram[4];//push THAT
 	this->ram[0]++;
-	this->ram[2] = this->ram[0]-5-this->vmarg2[this->pc]; //ARG = SP-n-5
+	this->ram[2] = this->ram[0]-5-this->code[this->pc].arg; //ARG = SP-n-5
 	this->ram[1] = this->ram[0]; //LCL = SP
 
 	//goto f
-	line = this->targetline[this->pc];
+	line = this->code[this->pc].target;
 	this->pc=line;
 }
 
@@ -315,7 +551,7 @@ void vm_execute_neg(Vm *this)
 void vm_execute_goto(Vm *this) 
 {
 	int line;
-	line = this->targetline[this->pc];
+	line = this->code[this->pc].target;
 	this->pc=line;
 }
 
@@ -327,7 +563,7 @@ void vm_execute_ifgoto(Vm *this)
 	if((short) (this->ram[this->ram[0] -1]) == 0){ //false
 		this->pc++;
 	} else { //true
-		line = this->targetline[this->pc];
+		line = this->code[this->pc].target;
 		this->pc=line;
 	}
 	this->ram[0]--; //SP--
@@ -354,33 +590,34 @@ RAM[13–15] general purpose (only 3 words)
 */
 void vm_execute_push(Vm *this)
 {
+	const VmInstr *instr = &this->code[this->pc];
 	short i = 0; //pushvalue
 	//Get the push value
-	switch (this->vmarg1[this->pc])
+	switch (instr->segment)
 	{
-	case 0: //ARG RAM[2]
-		i = (short) this->ram[this->ram[2]+this->vmarg2[this->pc]];
+	case VM_ARGUMENT: //ARG RAM[2]
+		i = (short) this->ram[this->ram[2]+instr->arg];
 		break;
-	case 1: //LCL RAM[1]
-		i = (short) this->ram[this->ram[1]+this->vmarg2[this->pc]];
+	case VM_LOCAL: //LCL RAM[1]
+		i = (short) this->ram[this->ram[1]+instr->arg];
 		break;
-	case 2: //static (special)
-		i = this->statics[this->filenum[this->pc]][this->vmarg2[this->pc]]; //is of type int16_t
+	case VM_STATIC: //static (special)
+		i = this->statics[instr->filenum][instr->arg]; //is of type int16_t
 		break;
-	case 3: //constant 
-		i = (short) this->vmarg2[this->pc]; 
+	case VM_CONSTANT: //constant 
+		i = (short) instr->arg; 
 		break;
-	case 4: //THIS RAM[3]
-		i = (short) this->ram[this->ram[3]+this->vmarg2[this->pc]];
+	case VM_THIS: //THIS RAM[3]
+		i = (short) this->ram[this->ram[3]+instr->arg];
 		break;
-	case 5: //THAT RAM[4]
-		i = (short) this->ram[this->ram[4]+this->vmarg2[this->pc]];
+	case VM_THAT: //THAT RAM[4]
+		i = (short) this->ram[this->ram[4]+instr->arg];
 		break;
-	case 6: //pointer [0] or [1]
-		i = (short) this->ram[3+this->vmarg2[this->pc]];
+	case VM_POINTER: //pointer [0] or [1]
+		i = (short) this->ram[3+instr->arg];
 		break;
-	case 7: //TEMP
-		i = (short) this->ram[5+this->vmarg2[this->pc]];
+	case VM_TEMP: //TEMP
+		i = (short) this->ram[5+instr->arg];
 		break;
 	default:
 		printf("vm_execute_push(): unhandled case\n");
@@ -399,37 +636,38 @@ void vm_execute_push(Vm *this)
 
 void vm_execute_pop(Vm *this)
 {
+	const VmInstr *instr = &this->code[this->pc];
 	short i; //popvalue
 	//Get the pop value
 	i = (short) this->ram[this->ram[0] - 1];
 	this->ram[0]--; //SP--
 
 	//put the value where it should go
-	switch (this->vmarg1[this->pc])
+	switch (instr->segment)
 	{
-	case 0: //ARG RAM[2]
-		this->ram[this->ram[2]+this->vmarg2[this->pc]] = (int) i;
+	case VM_ARGUMENT: //ARG RAM[2]
+		this->ram[this->ram[2]+instr->arg] = (int) i;
 		break;
-	case 1: //LCL RAM[1]
-		this->ram[this->ram[1]+this->vmarg2[this->pc]] = (int) i;
+	case VM_LOCAL: //LCL RAM[1]
+		this->ram[this->ram[1]+instr->arg] = (int) i;
 		break;
-	case 2: //static (special)
-		this->statics[this->filenum[this->pc]][this->vmarg2[this->pc]] = i; //statics is int16_t, i.e. short
+	case VM_STATIC: //static (special)
+		this->statics[instr->filenum][instr->arg] = i; //statics is int16_t, i.e. short
 		break;
-	case 3: //constant makes no sense
+	case VM_CONSTANT: //constant makes no sense
 		printf("vm_execute_pop(): popping to constant makes no sense!\n");
 		break;
-	case 4: //THIS RAM[3]
-		this->ram[this->ram[3]+this->vmarg2[this->pc]] = (int) i;
+	case VM_THIS: //THIS RAM[3]
+		this->ram[this->ram[3]+instr->arg] = (int) i;
 		break;
-	case 5: //THAT RAM[4]
-		this->ram[this->ram[4]+this->vmarg2[this->pc]] = (int) i;
+	case VM_THAT: //THAT RAM[4]
+		this->ram[this->ram[4]+instr->arg] = (int) i;
 		break;
-	case 6: //pointer [0] or [1]
-		this->ram[3+this->vmarg2[this->pc]] = (int) i;
+	case VM_POINTER: //pointer [0] or [1]
+		this->ram[3+instr->arg] = (int) i;
 		break;
-	case 7: //TEMP
-		this->ram[5+this->vmarg2[this->pc]] = (int) i;
+	case VM_TEMP: //TEMP
+		this->ram[5+instr->arg] = (int) i;
 		break;
 	default:
 		printf("vm_execute_pop(): unhandled case\n");
@@ -443,74 +681,74 @@ void vm_execute_pop(Vm *this)
 void vm_execute(Vm *this)
 {
 	//check line and process it.
-	if(DEBUG) printf("   line: %d %s | ", this->pc, this->label[this->pc]);
-	switch(this->vmarg0[this->pc])
+	if(DEBUG) printf("   line: %d %s | ", this->pc, vm_label(this, this->pc));
+	switch(this->code[this->pc].opcode)
 	{
-	case 0:
+	case VM_PUSH:
 		vm_execute_push(this); //3 args; push segment index
 		if(DEBUG) printf(" push SP: %d\n", this->ram[0]);
 		break;
-	case 1:
+	case VM_POP:
 		vm_execute_pop(this); //3 args; pop segment index
 		if(DEBUG) printf(" pop SP: %d\n", this->ram[0]);
 		break;
-	case 2:
+	case VM_CALL:
 		vm_execute_call(this); //3 args; call bla nargs
 		if(DEBUG) printf(" call SP: %d\n", this->ram[0]);
 		break;
-	case 3:
+	case VM_FUNCTION:
 		vm_execute_function(this); //3 args; function label nlocals
 		if(DEBUG) printf(" fn SP: %d\n", this->ram[0]);
 		break;
-	case 4:
+	case VM_GOTO:
 		vm_execute_goto(this); //2 args; goto label
 		if(DEBUG) printf(" goto SP: %d\n", this->ram[0]);
 		break;
-	case 5:
+	case VM_IFGOTO:
 		vm_execute_ifgoto(this); //2 args; if-goto label
 		if(DEBUG) printf(" ifgoto SP: %d\n", this->ram[0]);
 		break;
-	case 6:
+	case VM_LABEL:
 		vm_execute_label(this); //2 args; label label //This is a do nothing statement
 		if(DEBUG) printf(" label SP: %d\n", this->ram[0]);
 		break;
-	case 7:
+	case VM_ADD:
 		vm_execute_add(this);
 		if(DEBUG) printf(" add SP: %d\n", this->ram[0]);
 		break;
-	case 8:
+	case VM_AND:
 		vm_execute_and(this);
 		if(DEBUG) printf(" and SP: %d\n", this->ram[0]);
 		break;
-	case 9:
+	case VM_EQ:
 		vm_execute_eq(this);
 		if(DEBUG) printf(" eq SP: %d\n", this->ram[0]);
 		break;
-	case 10:
+	case VM_GT:
 		vm_execute_gt(this);
 		if(DEBUG) printf(" gt SP: %d\n", this->ram[0]);
 		break;
-	case 11:
+	case VM_LT:
 		vm_execute_lt(this);
 		if(DEBUG) printf(" lt SP: %d\n", this->ram[0]);
 		break;
-	case 12:
+	case VM_NEG:
 		vm_execute_neg(this);
 		if(DEBUG) printf(" neg SP: %d\n", this->ram[0]);
 		break;
-	case 13:
+	case VM_NOT:
 		vm_execute_not(this);
 		if(DEBUG) printf(" not SP: %d\n", this->ram[0]);
 		break;
-	case 14:
+	case VM_OR:
 		vm_execute_or(this);
 		if(DEBUG) printf(" or SP: %d\n", this->ram[0]);
 		break;
-	case 15:
+	case VM_RETURN:
 		vm_execute_return(this);
 		if(DEBUG) printf("  ret SP: %d\n", this->ram[0]);
 		break;
-	case 16:
+	case VM_SUB:
 		vm_execute_sub(this);
 		if(DEBUG) printf("  sub SP: %d\n", this->ram[0]);
 		break;
@@ -521,11 +759,228 @@ void vm_execute(Vm *this)
 	this->instructioncounter++;
 }
 
+#if defined(__GNUC__) && !DEBUG
+
+// Count the instruction just executed and go straight to the handler of the next
+#define VM_THREAD_NEXT()                                                       \
+    do                                                                         \
+    {                                                                          \
+        if (--budget == 0)                                                     \
+        {                                                                      \
+            goto done;                                                         \
+        }                                                                      \
+        goto *handlers[code[pc].thread];                                       \
+    } while (0)
+
+// Go on after an instruction that jumped somewhere that may not be in the program
+#define VM_THREAD_JUMPED()                                                     \
+    do                                                                         \
+    {                                                                          \
+        if ((uint32_t)pc >= (uint32_t)this->program_size || this->quitflag)    \
+        {                                                                      \
+            budget--;                                                          \
+            goto done;                                                         \
+        }                                                                      \
+        VM_THREAD_NEXT();                                                      \
+    } while (0)
+
+// Push and pop through a segment, exactly like vm_execute_push and vm_execute_pop
+#define VM_THREAD_PUSH_POP(segment, addr)                                      \
+    push_##segment:                                                            \
+    {                                                                          \
+        const short i = (short)ram[addr];                                      \
+        ram[ram[0]] = (int)i;                                                  \
+        ram[0]++;                                                              \
+        pc++;                                                                  \
+        VM_THREAD_NEXT();                                                      \
+    }                                                                          \
+    pop_##segment:                                                             \
+    {                                                                          \
+        const short i = (short)ram[ram[0] - 1];                                \
+        ram[0]--;                                                              \
+        ram[addr] = (int)i;                                                    \
+        pc++;                                                                  \
+        VM_THREAD_NEXT();                                                      \
+    }
+
+// Replace the two topmost values of the stack with 'expr' of them
+#define VM_THREAD_BINARY(name, expr)                                           \
+    name:                                                                      \
+    {                                                                          \
+        const short a = (short)ram[ram[0] - 2];                                \
+        const short b = (short)ram[ram[0] - 1];                                \
+        ram[ram[0] - 2] = (expr);                                              \
+        ram[0]--;                                                              \
+        pc++;                                                                  \
+        VM_THREAD_NEXT();                                                      \
+    }
+
+// Labels as values and computed gotos are GNU extensions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+long vm_run(Vm *this, long cycles)
+{
+	static const void *const handlers[] = {
+		&&execute, &&done,
+		&&push_argument, &&push_local, &&push_static, &&push_constant,
+		&&push_this, &&push_that, &&push_pointer, &&push_temp,
+		&&pop_argument, &&pop_local, &&pop_static, &&execute,
+		&&pop_this, &&pop_that, &&pop_pointer, &&pop_temp,
+		&&call, &&call_native, &&function, &&jump, &&ifgoto, &&label,
+		&&add, &&and, &&eq, &&gt, &&lt, &&neg, &&not, &&or, &&ret, &&sub};
+
+	if(cycles <= 0 || (uint32_t)this->pc >= (uint32_t)this->program_size){
+		return 0;
+	}
+
+	// Keep what every handler needs in locals so it can live in host registers
+	const VmInstr *const code = this->code;
+	int32_t *const ram = this->ram;
+	int16_t **const statics = this->statics;
+	int32_t pc = this->pc;
+	long budget = cycles;
+
+	goto *handlers[code[pc].thread];
+
+	VM_THREAD_PUSH_POP(argument, ram[2] + code[pc].arg)
+	VM_THREAD_PUSH_POP(local, ram[1] + code[pc].arg)
+	VM_THREAD_PUSH_POP(this, ram[3] + code[pc].arg)
+	VM_THREAD_PUSH_POP(that, ram[4] + code[pc].arg)
+	VM_THREAD_PUSH_POP(pointer, 3 + code[pc].arg)
+	VM_THREAD_PUSH_POP(temp, 5 + code[pc].arg)
+
+push_static:
+	ram[ram[0]] = statics[code[pc].filenum][code[pc].arg];
+	ram[0]++;
+	pc++;
+	VM_THREAD_NEXT();
+
+pop_static:
+	statics[code[pc].filenum][code[pc].arg] = (short)ram[ram[0] - 1]; //statics is int16_t, i.e. short
+	ram[0]--;
+	pc++;
+	VM_THREAD_NEXT();
+
+push_constant:
+	ram[ram[0]] = code[pc].arg;
+	ram[0]++;
+	pc++;
+	VM_THREAD_NEXT();
+
+call:
+	//save 'environment' on stack
+	ram[ram[0]] = pc + 1; //return address
+	ram[0]++;
+	ram[ram[0]] = ram[1]; //LCL
+	ram[0]++;
+	ram[ram[0]] = ram[2]; //ARG
+	ram[0]++;
+	ram[ram[0]] = ram[3]; //THIS
+	ram[0]++;
+	ram[ram[0]] = ram[4]; //THAT
+	ram[0]++;
+	ram[2] = ram[0] - 5 - code[pc].arg; //ARG = SP-n-5
+	ram[1] = ram[0]; //LCL = SP
+	pc = code[pc].target;
+	VM_THREAD_NEXT();
+
+call_native:
+	this->pc = pc;
+	vm_os_functions[code[pc].native - 1].handler(this);
+	pc = this->pc;
+	VM_THREAD_JUMPED();
+
+function:
+	for(int k = code[pc].arg; k > 0; k--){ //clear the local variables
+		ram[ram[0]] = 0;
+		ram[0]++;
+	}
+	pc++;
+	VM_THREAD_NEXT();
+
+jump:
+	pc = code[pc].target;
+	VM_THREAD_NEXT();
+
+ifgoto:
+	//Important: if(x) is true in Hack if(~(x=0)), i.e. any value other than 0
+	pc = (short)ram[ram[0] - 1] == 0 ? pc + 1 : code[pc].target;
+	ram[0]--;
+	VM_THREAD_NEXT();
+
+label:
+	pc++;
+	VM_THREAD_NEXT();
+
+	VM_THREAD_BINARY(add, (int)((short)(a + b)))
+	VM_THREAD_BINARY(sub, (int)((short)(a - b)))
+	VM_THREAD_BINARY(and, (int)((short)(a & b)))
+	VM_THREAD_BINARY(or, (int)((short)(a | b)))
+	VM_THREAD_BINARY(eq, a == b ? -1 : 0)
+	VM_THREAD_BINARY(gt, a > b ? -1 : 0)
+	VM_THREAD_BINARY(lt, a < b ? -1 : 0)
+
+neg:
+	ram[ram[0] - 1] = (int)(-(short)ram[ram[0] - 1]);
+	pc++;
+	VM_THREAD_NEXT();
+
+not:
+	ram[ram[0] - 1] = (int)(~(short)ram[ram[0] - 1]);
+	pc++;
+	VM_THREAD_NEXT();
+
+ret:
+{
+	const int32_t frame = ram[1]; //LCL
+	const int32_t ret = ram[frame - 5];
+	ram[ram[2]] = ram[ram[0] - 1]; // *ARG = pop
+	ram[0] = ram[2] + 1; //SP = ARG+1
+	ram[4] = ram[frame - 1]; //THAT
+	ram[3] = ram[frame - 2]; //THIS
+	ram[2] = ram[frame - 3]; //ARG
+	ram[1] = ram[frame - 4]; //LCL
+	pc = ret; //goto return address
+	VM_THREAD_JUMPED();
+}
+
+execute:
+	this->pc = pc;
+	vm_execute(this);
+	this->instructioncounter--; //counted below with the rest
+	pc = this->pc;
+	VM_THREAD_JUMPED();
+
+done:
+	this->pc = pc;
+	this->instructioncounter += cycles - budget;
+	return cycles - budget;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+long vm_run(Vm *this, long cycles)
+{
+	long executed = 0;
+	while(executed < cycles && !this->quitflag && (uint32_t)this->pc < (uint32_t)this->program_size){
+		vm_execute(this);
+		executed++;
+	}
+	return executed;
+}
+
+#endif
+
 void vm_print_vmcode(Vm *this)
 {
     for (int i = 0; i < this->program_size; i++)
     {
-        printf("line %d: %hi %hi %hi %s\n", i, this->vmarg0[i], this->vmarg1[i], this->vmarg2[i], this->label[i]);
+        const VmInstr *instr = &this->code[i];
+        printf("line %d: %d %d %d %s\n", i, instr->opcode, instr->segment == VM_NO_SEGMENT ? -1 : instr->segment,
+               instr->arg, vm_label(this, i));
     }
 }
 
@@ -3,7 +3,9 @@
 //Context: nand2tetris
 
 #define DEBUG 0
+#ifndef OVERRIDE_OS_FUNCTIONS //vmcheck is also built with it set
 #define OVERRIDE_OS_FUNCTIONS 0
+#endif
 
 #ifndef EMULIB_H
 #define EMULIB_H
@@ -13,14 +15,12 @@
 #include <unistd.h> //sleep
 
 #define MEM_SIZE 32768
-#define VM_SIZE 262144 //This should dynamically adjust to the number of VM instruction lines. For now MEM_SIZE*8
-		//do some allocs and proper pointers in the struct otherwise stack problem
 #define WORD_SIZE 16
 #define SCREEN_ADDR 0x4000  //16384
 #define KEYBD_ADDR 0x6000  //24576
 #define DISPLAY_WIDTH 512
 #define DISPLAY_HEIGHT 256
-#define VM_MAXLABEL 128 //maximum number of characters in a label
+#define VM_MAXLABEL 128 //maximum number of characters in a function name
 #define VMSTATICVARS 256 //maximum number of characters in a label
 #define MAX_FILES 64 //be generous
 typedef enum
@@ -90,13 +90,78 @@ RAM[5–12] TEMP
 RAM[13–15] general purpose (only 3 words)
 */
 
+typedef enum
+{
+    VM_PUSH,
+    VM_POP,
+    VM_CALL,
+    VM_FUNCTION,
+    VM_GOTO,
+    VM_IFGOTO,
+    VM_LABEL,
+    VM_ADD,
+    VM_AND,
+    VM_EQ,
+    VM_GT,
+    VM_LT,
+    VM_NEG,
+    VM_NOT,
+    VM_OR,
+    VM_RETURN,
+    VM_SUB
+} VM_OPCODES;
+
+typedef enum
+{
+    VM_ARGUMENT,
+    VM_LOCAL,
+    VM_STATIC,
+    VM_CONSTANT,
+    VM_THIS,
+    VM_THAT,
+    VM_POINTER,
+    VM_TEMP
+} VM_SEGMENTS;
+
+#define VM_NO_SEGMENT 0xff //segment of the instructions other than push and pop
+
+// One line of VM code, packed into 12 bytes so that about five lines share a cache line
+typedef struct VmInstr
+{
+    uint8_t opcode; //see the encoding above
+    uint8_t segment; //push and pop only
+    int16_t arg; //index for push and pop, nargs for call, nlocals for function, otherwise -1
+    int32_t target; //line of the label or function for goto, if-goto and call
+    uint16_t filenum; //which file the line is from, to find its static segment
+    uint8_t native; //for call, 1 + the index in vm_os_functions of the built-in code handling it, 0 if none
+    uint8_t thread; //handler vm_run executes the line with, specialized on its opcode and segment
+} VmInstr;
+
+// Strings stored once each and known by their offset, 0 being the empty string
+typedef struct VmStrings
+{
+    char *chars; //all the strings, each ending with '\0'
+    uint32_t size, capacity;
+    uint32_t *slots; //hash table of the offsets of the strings, 0 for an empty slot
+    uint32_t num_slots, count;
+} VmStrings;
+
+typedef struct VmIrOp VmIrOp; //see vmir.c
+
 typedef struct Vm
 {
     // Read-only instruction memory.
-    int16_t *vmarg0, *vmarg1, *vmarg2;
-    int32_t *targetline; //where the labels are (for goto, if-goto, call)
-    int16_t *filenum; //track which file we are in in 'line' pc for static element
-    char **label; //[VM_SIZE][VM_MAXLABEL]
+    VmInstr *code;
+    int32_t code_capacity;
+
+    // Labels, function names and the lines of push and pop, only needed to debug and load code
+    uint32_t *label; //offset in 'strings' of the label of each line
+    VmStrings strings;
+
+    // The code translated to the register IR vm_run_ir executes, see vmir.c
+    VmIrOp *ir;
+    int32_t ir_size;
+    int32_t *ir_of_line; //op starting the group at each line, -1 for lines inside a group
 
     // Random-access memory
     int16_t **statics; //this is where we put the 'static' memory segment
@@ -133,13 +198,26 @@ void vm_init(Vm *this);
 // Initialize statics segment
 void vm_init_statics(Vm *this, int nfiles);
 
-// Generate label table
+// Generate label table, resolving the target of every call, goto and if-goto
+// Calls to functions handled by built-in code go to it when OVERRIDE_OS_FUNCTIONS is set
+// Lists the labels nothing defines, which jump past the end of the program
 // return 0 for ok, 1 for missing >=1 label
 int vm_init_labeltargets(Vm *this);
 
 // Clear the 'ROM'
 void vm_clear_vmcode(Vm *this);
 
+// Append a line of VM code at the program counter, its label a string to keep for debugging
+// Returns false if out of memory
+bool vm_add_instr(Vm *this, int opcode, int segment, int arg, int filenum, const char *label);
+
+// Get the label of a line of VM code, "" if it has none
+const char *vm_label(const Vm *this, int32_t line);
+
+// Get the offset of a string in the pool, adding it if it is not there yet
+// Returns false if out of memory
+bool vm_intern(VmStrings *this, const char *str, uint32_t *offset);
+
 // Clear the RAM
 void vm_clear_ram(Vm *this);
 
@@ -149,6 +227,22 @@ void vm_destroy(Vm *this);
 // Execute the instruction located by the program counter
 void vm_execute(Vm *this);
 
+// Execute up to 'cycles' instructions using direct-threaded code, stopping early once the
+// program counter leaves the program or quitflag is set
+// Behaves exactly like calling vm_execute repeatedly, only much faster, unless DEBUG is set.
+// The targets of jumps must have been resolved by vm_init_labeltargets.
+// Returns the number of instructions executed.
+long vm_run(Vm *this, long cycles);
+
+// Translate the code to the register IR vm_run_ir executes, once the targets of jumps are resolved
+// Returns false if out of memory
+bool vm_translate_ir(Vm *this);
+
+// Execute up to 'cycles' instructions like vm_run, from the IR vm_translate_ir made of the code
+// Values popped off the stack are all that is left in RAM differently.
+// Returns the number of instructions executed.
+long vm_run_ir(Vm *this, long cycles);
+
 // Load a file into the machine's VM code 'ROM'
 // Returns false if unable to open file
 bool vm_load_vmcode(Vm *this, char *filepath);
@@ -162,7 +256,17 @@ void vm_print_ram(Vm *this);
 // Prints statics RAM registers with values != 0
 void vm_print_statics(Vm *this);
 
+// A function of the Jack OS handled by built-in code (see osfunctions.c) instead of its VM code
+typedef struct VmOsFunction
+{
+    const char *name;
+    void (*handler)(Vm *this); //pops the arguments, pushes the result and moves on from the call
+} VmOsFunction;
+
+// Every function handled by built-in code, ending with a NULL name
+extern const VmOsFunction vm_os_functions[];
+
 // Checks if the function can be handled by built-in code.
-// Returns 1 if it got handled, 0 if not
-int check_os_function(Vm *this);
+// Returns 1 + its index in vm_os_functions if so, 0 if not
+int vm_find_os_function(const char *name);
 #endif
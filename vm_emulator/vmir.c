@@ -0,0 +1,747 @@
+//Register IR for the VM code, run by vm_run_ir
+//Context: nand2tetris
+
+/* vm_translate_ir cuts the VM code into groups of lines, most of them a single
+ * statement of the Jack program, and translates each group on its own. The
+ * values a group pushes live in virtual registers instead of on the stack, or
+ * are not even loaded until something uses them, so that
+ * 'push local 0, push constant 1, add, pop local 0' becomes
+ * 'r0 = local 0 + 1, local 0 = r0' and never touches the stack pointer. Only
+ * the values still pushed when a group ends are written to the stack, and the
+ * stack pointer moved once.
+ *
+ * Where a group starts, the machine is exactly where the stack machine would
+ * be, so groups are what jumps, calls and returns land on, and the lines of a
+ * group too long for what is left of a slice run on vm_run instead. RAM only
+ * differs above the top of the stack, where the stack machine leaves the
+ * values it popped and the IR never wrote them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vmemulib.h"
+
+#define VM_IR_REGS 32 //virtual registers a group can use
+#define VM_IR_MAX_LINES 255 //lines in a group, to fit in VmIrOp.lines
+
+// Kinds of operands
+enum
+{
+    VM_IR_CONST,  //the constant k
+    VM_IR_REG,    //virtual register k
+    VM_IR_MEM,    //ram[ram[base] + k], a segment or (base 0) the stack where the group started
+    VM_IR_ABS,    //ram[k], pointer and temp
+    VM_IR_STATIC, //statics[base][k]
+    VM_IR_KINDS
+};
+
+// Binary operations, each comparison next to its negation to turn 'not' into
+enum
+{
+    VM_IR_ADD,
+    VM_IR_SUB,
+    VM_IR_AND,
+    VM_IR_OR,
+    VM_IR_EQ,
+    VM_IR_NE,
+    VM_IR_GT,
+    VM_IR_LE,
+    VM_IR_LT,
+    VM_IR_GE,
+    VM_IR_BINARY_OPS
+};
+
+// Unary operations, moving being how values are loaded into registers
+enum
+{
+    VM_IR_MOV,
+    VM_IR_NEG,
+    VM_IR_NOT,
+    VM_IR_UNARY_OPS
+};
+
+// Handlers of the ops, those moving values specialized on the kinds of their operands
+enum
+{
+    VM_IR_THREAD_END,
+    VM_IR_THREAD_NOP,
+    VM_IR_THREAD_EXECUTE,
+    VM_IR_THREAD_CALL,
+    VM_IR_THREAD_CALL_NATIVE,
+    VM_IR_THREAD_FUNCTION,
+    VM_IR_THREAD_RETURN,
+    VM_IR_THREAD_GOTO,
+    VM_IR_THREAD_IFGOTO,
+    VM_IR_THREAD_ADJUST,
+    VM_IR_THREAD_SPILL,                                          // + kind of a
+    VM_IR_THREAD_STORE = VM_IR_THREAD_SPILL + VM_IR_KINDS,       // + (kind of dst - VM_IR_MEM) * VM_IR_KINDS + kind of a
+    VM_IR_THREAD_UNARY = VM_IR_THREAD_STORE + 3 * VM_IR_KINDS,   // + op * VM_IR_KINDS + kind of a
+    VM_IR_THREAD_BINARY = VM_IR_THREAD_UNARY + VM_IR_UNARY_OPS * VM_IR_KINDS // + (op * VM_IR_KINDS + kind of a) * VM_IR_KINDS + kind of b
+};
+
+typedef struct VmIrOperand
+{
+    uint8_t kind;
+    uint8_t base; //register of RAM holding the base address for VM_IR_MEM, file for VM_IR_STATIC
+    int16_t k;
+} VmIrOperand;
+
+struct VmIrOp
+{
+    uint16_t thread;
+    uint8_t lines; //lines of the group the op starts, 0 if it does not start one
+    VmIrOperand dst, a, b;
+    int32_t line; //line the op is from, the first line of its group if it starts one
+    int32_t target; //op jumped to by goto, if-goto and call, native function of a native call
+};
+
+static VmIrOperand vm_ir_operand(int kind, int base, int k)
+{
+    VmIrOperand operand = {(uint8_t)kind, (uint8_t)base, (int16_t)k};
+    return operand;
+}
+
+// Gets the operand a push or pop reads or writes
+// Returns false if the IR cannot address it, to run the line on vm_execute
+static bool vm_ir_segment(const VmInstr *instr, VmIrOperand *operand)
+{
+    switch (instr->segment)
+    {
+    case VM_ARGUMENT:
+        *operand = vm_ir_operand(VM_IR_MEM, 2, instr->arg);
+        return true;
+    case VM_LOCAL:
+        *operand = vm_ir_operand(VM_IR_MEM, 1, instr->arg);
+        return true;
+    case VM_THIS:
+        *operand = vm_ir_operand(VM_IR_MEM, 3, instr->arg);
+        return true;
+    case VM_THAT:
+        *operand = vm_ir_operand(VM_IR_MEM, 4, instr->arg);
+        return true;
+    case VM_STATIC:
+        *operand = vm_ir_operand(VM_IR_STATIC, instr->filenum, instr->arg);
+        return instr->filenum < MAX_FILES;
+    case VM_CONSTANT:
+        *operand = vm_ir_operand(VM_IR_CONST, 0, instr->arg);
+        return true;
+    case VM_POINTER:
+        *operand = vm_ir_operand(VM_IR_ABS, 0, 3 + instr->arg);
+        return instr->arg >= 0 && instr->arg < 2;
+    case VM_TEMP:
+        *operand = vm_ir_operand(VM_IR_ABS, 0, 5 + instr->arg);
+        return instr->arg >= 0 && instr->arg < 8;
+    default:
+        return false;
+    }
+}
+
+// The IR being built, and the group being translated
+typedef struct VmIrBuilder
+{
+    Vm *vm;
+    VmIrOp *ops;
+    int32_t size, capacity;
+    bool failed; //out of memory
+
+    bool open; //in a group
+    int32_t first; //op starting the group
+    int lines;
+    VmIrOperand stack[VM_IR_REGS]; //values pushed in the group and not popped yet
+    int depth;
+    int popped; //values popped that were pushed before the group, at ram[ram[0] - popped]
+    int regs; //registers used
+} VmIrBuilder;
+
+// Append an op, returning NULL if out of memory
+static VmIrOp *vm_ir_emit(VmIrBuilder *this, int thread, int32_t line)
+{
+    if (this->size == this->capacity)
+    {
+        const int32_t capacity = this->capacity ? this->capacity * 2 : 4096;
+        VmIrOp *ops = realloc(this->ops, capacity * sizeof(VmIrOp));
+        if (ops == NULL)
+        {
+            this->failed = true;
+            return NULL;
+        }
+        this->ops = ops;
+        this->capacity = capacity;
+    }
+
+    VmIrOp *op = &this->ops[this->size++];
+    memset(op, 0, sizeof(VmIrOp));
+    op->thread = thread;
+    op->line = line;
+    return op;
+}
+
+// Append 'r = op a' for a new register r, returning the register as an operand
+static VmIrOperand vm_ir_unary(VmIrBuilder *this, int unary, VmIrOperand a, int32_t line)
+{
+    const VmIrOperand reg = vm_ir_operand(VM_IR_REG, 0, this->regs++);
+    VmIrOp *op = vm_ir_emit(this, VM_IR_THREAD_UNARY + unary * VM_IR_KINDS + a.kind, line);
+    if (op != NULL)
+    {
+        op->dst = reg;
+        op->a = a;
+    }
+    return reg;
+}
+
+// Take the value on top of the stack, from the stack in RAM if it was pushed before the group
+static VmIrOperand vm_ir_pop(VmIrBuilder *this)
+{
+    if (this->depth > 0)
+    {
+        return this->stack[--this->depth];
+    }
+    this->popped++;
+    return vm_ir_operand(VM_IR_MEM, 0, -this->popped);
+}
+
+// Load the pushed values a store to 'dst' could change into registers before it does
+static void vm_ir_protect(VmIrBuilder *this, VmIrOperand dst, int32_t line)
+{
+    for (int i = 0; i < this->depth; i++)
+    {
+        const VmIrOperand value = this->stack[i];
+        bool clobbered;
+        if (value.kind == VM_IR_STATIC)
+        {
+            clobbered = dst.kind == VM_IR_STATIC && dst.base == value.base && dst.k == value.k;
+        }
+        else if (value.kind == VM_IR_ABS && dst.kind == VM_IR_ABS)
+        {
+            clobbered = dst.k == value.k;
+        }
+        else
+        {
+            // A store to RAM could be anywhere a segment is, even where the segments start
+            clobbered = value.kind != VM_IR_CONST && value.kind != VM_IR_REG && dst.kind != VM_IR_STATIC;
+        }
+
+        if (clobbered)
+        {
+            this->stack[i] = vm_ir_unary(this, VM_IR_MOV, value, line);
+        }
+    }
+}
+
+// Write the values still pushed to the stack in RAM, and move the stack pointer past them
+static void vm_ir_flush(VmIrBuilder *this, int32_t line)
+{
+    for (int i = 0; i < this->depth; i++)
+    {
+        VmIrOp *op = vm_ir_emit(this, VM_IR_THREAD_SPILL + this->stack[i].kind, line);
+        if (op != NULL)
+        {
+            op->dst = vm_ir_operand(VM_IR_MEM, 0, i - this->popped);
+            op->a = this->stack[i];
+        }
+    }
+
+    if (this->depth != this->popped)
+    {
+        VmIrOp *op = vm_ir_emit(this, VM_IR_THREAD_ADJUST, line);
+        if (op != NULL)
+        {
+            op->a = vm_ir_operand(VM_IR_CONST, 0, this->depth - this->popped);
+        }
+    }
+
+    this->depth = 0;
+    this->popped = 0;
+    this->regs = 0;
+}
+
+// End the group, leaving the machine where the stack machine would be after its last line
+static void vm_ir_close(VmIrBuilder *this, int32_t start)
+{
+    if (!this->open)
+    {
+        return;
+    }
+
+    vm_ir_flush(this, start);
+    if (this->size == this->first)
+    {
+        vm_ir_emit(this, VM_IR_THREAD_NOP, start);
+    }
+    if (!this->failed)
+    {
+        this->ops[this->first].lines = this->lines;
+        this->ops[this->first].line = start;
+    }
+    this->open = false;
+}
+
+// Checks if the IR can translate a line, the others running on vm_execute
+static bool vm_ir_translatable(const VmInstr *instr)
+{
+    VmIrOperand operand;
+    switch (instr->opcode)
+    {
+    case VM_PUSH:
+        return vm_ir_segment(instr, &operand);
+    case VM_POP:
+        return vm_ir_segment(instr, &operand) && operand.kind != VM_IR_CONST;
+    default:
+        return instr->opcode <= VM_SUB;
+    }
+}
+
+// Translate a line of the group being built
+static void vm_ir_translate(VmIrBuilder *this, int32_t line, int32_t start)
+{
+    static const uint8_t binary_ops[] = {
+        [VM_ADD] = VM_IR_ADD, [VM_SUB] = VM_IR_SUB, [VM_AND] = VM_IR_AND, [VM_OR] = VM_IR_OR,
+        [VM_EQ] = VM_IR_EQ, [VM_GT] = VM_IR_GT, [VM_LT] = VM_IR_LT};
+    const VmInstr *instr = &this->vm->code[line];
+    VmIrOperand a, b;
+    VmIrOp *op;
+
+    switch (instr->opcode)
+    {
+    case VM_LABEL:
+        break;
+    case VM_PUSH:
+        vm_ir_segment(instr, &this->stack[this->depth++]);
+        break;
+    case VM_POP:
+        vm_ir_segment(instr, &b);
+        a = vm_ir_pop(this);
+        vm_ir_protect(this, b, line);
+        op = vm_ir_emit(this, VM_IR_THREAD_STORE + (b.kind - VM_IR_MEM) * VM_IR_KINDS + a.kind, line);
+        if (op != NULL)
+        {
+            op->dst = b;
+            op->a = a;
+        }
+        break;
+    case VM_ADD:
+    case VM_SUB:
+    case VM_AND:
+    case VM_OR:
+    case VM_EQ:
+    case VM_GT:
+    case VM_LT:
+        b = vm_ir_pop(this);
+        a = vm_ir_pop(this);
+        op = vm_ir_emit(this, VM_IR_THREAD_BINARY + (binary_ops[instr->opcode] * VM_IR_KINDS + a.kind) * VM_IR_KINDS + b.kind,
+                        line);
+        if (op != NULL)
+        {
+            op->dst = vm_ir_operand(VM_IR_REG, 0, this->regs);
+            op->a = a;
+            op->b = b;
+        }
+        this->stack[this->depth++] = vm_ir_operand(VM_IR_REG, 0, this->regs++);
+        break;
+    case VM_NEG:
+    case VM_NOT:
+        a = vm_ir_pop(this);
+        op = this->size > this->first ? &this->ops[this->size - 1] : NULL;
+        if (a.kind == VM_IR_CONST && (instr->opcode == VM_NOT || a.k != INT16_MIN))
+        {
+            // Fold constants, such as -1 and true, that Jack code computes
+            a.k = instr->opcode == VM_NEG ? -a.k : ~a.k;
+        }
+        else if (instr->opcode == VM_NOT && a.kind == VM_IR_REG && op != NULL && op->dst.kind == VM_IR_REG &&
+                 op->dst.k == a.k && op->thread >= VM_IR_THREAD_BINARY + VM_IR_EQ * VM_IR_KINDS * VM_IR_KINDS)
+        {
+            // Comparisons give -1 or 0, so not of one is the opposite comparison
+            const int thread = op->thread - VM_IR_THREAD_BINARY;
+            const int comparison = thread / (VM_IR_KINDS * VM_IR_KINDS);
+            op->thread = VM_IR_THREAD_BINARY + (comparison ^ 1) * VM_IR_KINDS * VM_IR_KINDS +
+                         thread % (VM_IR_KINDS * VM_IR_KINDS);
+        }
+        else
+        {
+            a = vm_ir_unary(this, instr->opcode == VM_NEG ? VM_IR_NEG : VM_IR_NOT, a, line);
+        }
+        this->stack[this->depth++] = a;
+        break;
+    case VM_GOTO:
+        vm_ir_flush(this, line);
+        op = vm_ir_emit(this, VM_IR_THREAD_GOTO, line);
+        if (op != NULL)
+        {
+            op->target = instr->target;
+        }
+        vm_ir_close(this, start);
+        break;
+    case VM_IFGOTO:
+        a = vm_ir_pop(this);
+        if (a.kind != VM_IR_CONST && a.kind != VM_IR_REG)
+        {
+            a = vm_ir_unary(this, VM_IR_MOV, a, line);
+        }
+        vm_ir_flush(this, line);
+        if (a.kind == VM_IR_REG || a.k != 0)
+        {
+            op = vm_ir_emit(this, a.kind == VM_IR_REG ? VM_IR_THREAD_IFGOTO : VM_IR_THREAD_GOTO, line);
+            if (op != NULL)
+            {
+                op->a = a;
+                op->target = instr->target;
+            }
+        }
+        vm_ir_close(this, start);
+        break;
+    case VM_CALL:
+        vm_ir_flush(this, line);
+        if (this->size == this->first && line != start)
+        {
+            // The op starting a group takes the group's first line, and calls need their own to return after
+            vm_ir_emit(this, VM_IR_THREAD_NOP, start);
+        }
+        op = vm_ir_emit(this, instr->native ? VM_IR_THREAD_CALL_NATIVE : VM_IR_THREAD_CALL, line);
+        if (op != NULL)
+        {
+            op->a = vm_ir_operand(VM_IR_CONST, 0, instr->arg);
+            op->target = instr->native ? instr->native - 1 : instr->target;
+        }
+        vm_ir_close(this, start);
+        break;
+    case VM_FUNCTION:
+        op = vm_ir_emit(this, VM_IR_THREAD_FUNCTION, line);
+        if (op != NULL)
+        {
+            op->a = vm_ir_operand(VM_IR_CONST, 0, instr->arg);
+        }
+        vm_ir_close(this, start);
+        break;
+    case VM_RETURN:
+        vm_ir_flush(this, line);
+        vm_ir_emit(this, VM_IR_THREAD_RETURN, line);
+        vm_ir_close(this, start);
+        break;
+    }
+}
+
+// Free the IR, if any
+static void vm_ir_free(Vm *this)
+{
+    free(this->ir);
+    free(this->ir_of_line);
+    this->ir = NULL;
+    this->ir_of_line = NULL;
+}
+
+bool vm_translate_ir(Vm *this)
+{
+    vm_ir_free(this);
+    this->ir_of_line = malloc((this->program_size + 1) * sizeof(int32_t));
+    if (this->ir_of_line == NULL)
+    {
+        return false;
+    }
+
+    VmIrBuilder builder;
+    memset(&builder, 0, sizeof(VmIrBuilder));
+    builder.vm = this;
+    int32_t start = 0;
+    for (int32_t line = 0; line < this->program_size; line++)
+    {
+        const VmInstr *instr = &this->code[line];
+        const bool translatable = vm_ir_translatable(instr);
+
+        // Lines jumped to start groups, as do those a group has no room left for
+        if (builder.open && (!translatable || instr->opcode == VM_LABEL || instr->opcode == VM_FUNCTION ||
+                             builder.lines == VM_IR_MAX_LINES || builder.regs + builder.depth + 2 > VM_IR_REGS))
+        {
+            vm_ir_close(&builder, start);
+        }
+        this->ir_of_line[line] = -1;
+        if (!builder.open)
+        {
+            builder.open = true;
+            builder.first = builder.size;
+            builder.lines = 0;
+            start = line;
+            this->ir_of_line[line] = builder.size;
+        }
+        builder.lines++;
+
+        if (!translatable)
+        {
+            vm_ir_emit(&builder, VM_IR_THREAD_EXECUTE, line);
+            vm_ir_close(&builder, start);
+            continue;
+        }
+
+        vm_ir_translate(&builder, line, start);
+
+        // Statements end with nothing left pushed, which is where groups end unless a label starts them
+        if (builder.open && instr->opcode != VM_LABEL && builder.depth == 0 && builder.popped == 0)
+        {
+            vm_ir_close(&builder, start);
+        }
+    }
+    vm_ir_close(&builder, start);
+    this->ir_of_line[this->program_size] = builder.size;
+    vm_ir_emit(&builder, VM_IR_THREAD_END, this->program_size);
+
+    if (builder.failed)
+    {
+        free(builder.ops);
+        vm_ir_free(this);
+        return false;
+    }
+
+    // Jumps go to lines that start groups, labels, functions and the end of the program
+    for (int32_t i = 0; i < builder.size; i++)
+    {
+        VmIrOp *op = &builder.ops[i];
+        if (op->thread == VM_IR_THREAD_CALL || op->thread == VM_IR_THREAD_GOTO || op->thread == VM_IR_THREAD_IFGOTO)
+        {
+            op->target = this->ir_of_line[op->target];
+        }
+    }
+
+    this->ir = builder.ops;
+    this->ir_size = builder.size;
+    return true;
+}
+
+#if defined(__GNUC__) && !DEBUG
+
+// Value of an operand of each kind, as pushing it leaves it on the stack
+#define VM_IR_LOAD_CONST(o) ((int32_t)(o).k)
+#define VM_IR_LOAD_REG(o) regs[(o).k]
+#define VM_IR_LOAD_MEM(o) ((int32_t)(short)ram[ram[(o).base] + (o).k])
+#define VM_IR_LOAD_ABS(o) ((int32_t)(short)ram[(o).k])
+#define VM_IR_LOAD_STATIC(o) ((int32_t)statics[(o).base][(o).k])
+
+// Pop a value to an operand of each kind that can be stored to
+#define VM_IR_STORE_MEM(o, v) ram[ram[(o).base] + (o).k] = (int)(short)(v)
+#define VM_IR_STORE_ABS(o, v) ram[(o).k] = (int)(short)(v)
+#define VM_IR_STORE_STATIC(o, v) statics[(o).base][(o).k] = (short)(v)
+
+// Expand F for every kind of operand, and of the operands stored to
+#define VM_IR_EACH_KIND_A(F, ...)                                              \
+    F(__VA_ARGS__, CONST) F(__VA_ARGS__, REG) F(__VA_ARGS__, MEM)              \
+    F(__VA_ARGS__, ABS) F(__VA_ARGS__, STATIC)
+#define VM_IR_EACH_KIND_B(F, ...)                                              \
+    F(__VA_ARGS__, CONST) F(__VA_ARGS__, REG) F(__VA_ARGS__, MEM)              \
+    F(__VA_ARGS__, ABS) F(__VA_ARGS__, STATIC)
+#define VM_IR_EACH_STORED(F, ...)                                              \
+    F(__VA_ARGS__, MEM) F(__VA_ARGS__, ABS) F(__VA_ARGS__, STATIC)
+
+// Expand F for every operation, in the order of their enums
+#define VM_IR_EACH_UNARY(F, ...)                                               \
+    F(__VA_ARGS__, mov, x)                                                     \
+    F(__VA_ARGS__, neg, (int)(-(short)x))                                      \
+    F(__VA_ARGS__, not, (int)(~(short)x))
+#define VM_IR_EACH_BINARY(F, ...)                                              \
+    F(__VA_ARGS__, add, (int)((short)(a + b)))                                 \
+    F(__VA_ARGS__, sub, (int)((short)(a - b)))                                 \
+    F(__VA_ARGS__, and, (int)((short)(a & b)))                                 \
+    F(__VA_ARGS__, or, (int)((short)(a | b)))                                  \
+    F(__VA_ARGS__, eq, a == b ? -1 : 0)                                        \
+    F(__VA_ARGS__, ne, a != b ? -1 : 0)                                        \
+    F(__VA_ARGS__, gt, a > b ? -1 : 0)                                         \
+    F(__VA_ARGS__, le, a <= b ? -1 : 0)                                        \
+    F(__VA_ARGS__, lt, a < b ? -1 : 0)                                         \
+    F(__VA_ARGS__, ge, a >= b ? -1 : 0)
+
+// Expand F for every handler specialized on its operands, in the order of their threads
+#define VM_IR_UNARY_OF(F, name, expr) VM_IR_EACH_KIND_B(F, name, expr)
+#define VM_IR_BINARY_OF_A(F, name, expr) VM_IR_EACH_KIND_A(VM_IR_BINARY_OF_B, F, name, expr)
+#define VM_IR_BINARY_OF_B(F, name, expr, ka) VM_IR_EACH_KIND_B(F, name, expr, ka)
+#define VM_IR_SPECIALIZED(SPILL, STORE, UNARY, BINARY)                         \
+    VM_IR_EACH_KIND_A(SPILL, _)                                                \
+    VM_IR_EACH_STORED(VM_IR_EACH_KIND_B, STORE)                                \
+    VM_IR_EACH_UNARY(VM_IR_UNARY_OF, UNARY)                                    \
+    VM_IR_EACH_BINARY(VM_IR_BINARY_OF_A, BINARY)
+
+// Handlers, and their addresses for the table of them
+#define VM_IR_SPILL(_, ka)                                                     \
+    spill_##ka : ram[ram[0] + op->dst.k] = VM_IR_LOAD_##ka(op->a);             \
+    VM_IR_NEXT();
+#define VM_IR_SPILL_ADDR(_, ka) &&spill_##ka,
+#define VM_IR_STORE(kd, ka)                                                    \
+    store_##kd##_##ka : VM_IR_STORE_##kd(op->dst, VM_IR_LOAD_##ka(op->a));     \
+    VM_IR_NEXT();
+#define VM_IR_STORE_ADDR(kd, ka) &&store_##kd##_##ka,
+#define VM_IR_UNARY(name, expr, ka)                                            \
+    unary_##name##_##ka:                                                       \
+    {                                                                          \
+        const int32_t x = VM_IR_LOAD_##ka(op->a);                              \
+        regs[op->dst.k] = (expr);                                              \
+        VM_IR_NEXT();                                                          \
+    }
+#define VM_IR_UNARY_ADDR(name, expr, ka) &&unary_##name##_##ka,
+#define VM_IR_BINARY(name, expr, ka, kb)                                       \
+    binary_##name##_##ka##_##kb:                                               \
+    {                                                                          \
+        const short a = (short)VM_IR_LOAD_##ka(op->a);                         \
+        const short b = (short)VM_IR_LOAD_##kb(op->b);                         \
+        regs[op->dst.k] = (expr);                                              \
+        VM_IR_NEXT();                                                          \
+    }
+#define VM_IR_BINARY_ADDR(name, expr, ka, kb) &&binary_##name##_##ka##_##kb,
+
+// Go to the handler of an op, paying for all the lines of a group as it starts
+#define VM_IR_DISPATCH()                                                       \
+    do                                                                         \
+    {                                                                          \
+        if ((budget -= op->lines) < 0)                                         \
+        {                                                                      \
+            goto partial;                                                      \
+        }                                                                      \
+        goto *handlers[op->thread];                                            \
+    } while (0)
+
+#define VM_IR_NEXT()                                                           \
+    do                                                                         \
+    {                                                                          \
+        op++;                                                                  \
+        VM_IR_DISPATCH();                                                      \
+    } while (0)
+
+// Labels as values and computed gotos are GNU extensions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Run groups from 'start' on, until one is longer than 'cycles' or leaves the IR
+static long vm_ir_run_groups(Vm *this, int32_t start, long cycles)
+{
+    static const void *const handlers[] = {
+        &&end, &&nop, &&execute, &&call, &&call_native, &&function, &&ret, &&jump, &&ifgoto, &&adjust,
+        VM_IR_SPECIALIZED(VM_IR_SPILL_ADDR, VM_IR_STORE_ADDR, VM_IR_UNARY_ADDR, VM_IR_BINARY_ADDR)};
+
+    // Keep what every handler needs in locals so it can live in host registers
+    const VmIrOp *const ir = this->ir;
+    const int32_t *const ir_of_line = this->ir_of_line;
+    int32_t *const ram = this->ram;
+    int16_t **const statics = this->statics;
+    int32_t regs[VM_IR_REGS];
+    const VmIrOp *op = &ir[start];
+    int32_t pc;
+    long budget = cycles;
+
+    VM_IR_DISPATCH();
+
+    VM_IR_SPECIALIZED(VM_IR_SPILL, VM_IR_STORE, VM_IR_UNARY, VM_IR_BINARY)
+
+nop:
+    VM_IR_NEXT();
+
+adjust:
+    ram[0] += op->a.k;
+    VM_IR_NEXT();
+
+jump:
+    op = &ir[op->target];
+    VM_IR_DISPATCH();
+
+ifgoto:
+    if ((short)regs[op->a.k] != 0)
+    {
+        op = &ir[op->target];
+        VM_IR_DISPATCH();
+    }
+    VM_IR_NEXT();
+
+call:
+    //save 'environment' on stack, exactly like vm_run
+    ram[ram[0]] = op->line + 1; //return address
+    ram[ram[0] + 1] = ram[1]; //LCL
+    ram[ram[0] + 2] = ram[2]; //ARG
+    ram[ram[0] + 3] = ram[3]; //THIS
+    ram[ram[0] + 4] = ram[4]; //THAT
+    ram[0] += 5;
+    ram[2] = ram[0] - 5 - op->a.k; //ARG = SP-n-5
+    ram[1] = ram[0]; //LCL = SP
+    op = &ir[op->target];
+    VM_IR_DISPATCH();
+
+call_native:
+    this->pc = op->line;
+    vm_os_functions[op->target].handler(this);
+    if (this->quitflag)
+    {
+        goto done;
+    }
+    pc = this->pc;
+    goto resume;
+
+function:
+    for (int k = op->a.k; k > 0; k--)
+    { //clear the local variables
+        ram[ram[0]] = 0;
+        ram[0]++;
+    }
+    VM_IR_NEXT();
+
+ret:
+{
+    const int32_t frame = ram[1]; //LCL
+    pc = ram[frame - 5]; //return address
+    ram[ram[2]] = ram[ram[0] - 1]; // *ARG = pop
+    ram[0] = ram[2] + 1; //SP = ARG+1
+    ram[4] = ram[frame - 1]; //THAT
+    ram[3] = ram[frame - 2]; //THIS
+    ram[2] = ram[frame - 3]; //ARG
+    ram[1] = ram[frame - 4]; //LCL
+    goto resume;
+}
+
+execute:
+    this->pc = op->line;
+    vm_execute(this);
+    this->instructioncounter--; //counted below with the rest
+    pc = this->pc;
+    goto resume;
+
+resume:
+    // Go on at line pc, leaving the IR for vm_run if no group starts there
+    if ((uint32_t)pc > (uint32_t)this->program_size || ir_of_line[pc] < 0)
+    {
+        this->pc = pc;
+        goto done;
+    }
+    op = &ir[ir_of_line[pc]];
+    VM_IR_DISPATCH();
+
+partial:
+    budget += op->lines;
+end:
+    this->pc = op->line;
+done:
+    this->instructioncounter += cycles - budget;
+    return cycles - budget;
+}
+
+#pragma GCC diagnostic pop
+
+long vm_run_ir(Vm *this, long cycles)
+{
+    long executed = 0;
+    while (executed < cycles && !this->quitflag && (uint32_t)this->pc < (uint32_t)this->program_size)
+    {
+        // Lines inside a group, and groups longer than what is left, run on the stack machine
+        const int32_t start = this->ir_of_line[this->pc];
+        if (start >= 0 && this->ir[start].lines <= cycles - executed)
+        {
+            executed += vm_ir_run_groups(this, start, cycles - executed);
+        }
+        else
+        {
+            executed += vm_run(this, 1);
+        }
+    }
+    return executed;
+}
+
+#else
+
+long vm_run_ir(Vm *this, long cycles)
+{
+    return vm_run(this, cycles);
+}
+
+#endif